@@ -0,0 +1,99 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include "mbed.h"
+#include "PybRadioConfig.h"
+
+// Buckets in each histogram. Bucket i counts latencies under 16 << i us,
+// and the last bucket everything longer.
+const uint8_t LATENCY_BUCKETS = 8;
+
+// TIMER1 capture channels, one per context so captures can't race
+const uint8_t LATENCY_CC_IRQ = 0;
+const uint8_t LATENCY_CC_THREAD = 1;
+
+/**
+ * Latencies seen for one command opcode
+ */
+typedef struct {
+    uint8_t cmd;
+    uint16_t max;
+    uint16_t counts[LATENCY_BUCKETS];
+} latency_slot_t;
+
+/**
+ * Fixed bucket latency histograms, one per command opcode.
+ *
+ * Times come from TIMER1 running as a free running 16 bit counter at 1MHz,
+ * so differences are in microseconds and wrap after 65ms. Slots are handed
+ * out to opcodes as they are first seen. Once they run out, further opcodes
+ * are not recorded. Counts saturate rather than wrap.
+ */
+class LatencyHistogram {
+    private:
+        latency_slot_t slots[PYB_RADIO_LATENCY_SLOTS];
+        uint8_t used;
+
+    public:
+        /**
+         * Constructor: create empty histograms
+         */
+        LatencyHistogram();
+
+        /**
+         * Set up and start TIMER1
+         */
+        static void start_timer(void);
+
+        /**
+         * Current TIMER1 count in microseconds, captured on the given channel
+         */
+        static uint16_t now(uint8_t channel);
+
+        /**
+         * Add one latency, in microseconds, to the histogram for cmd
+         */
+        void record(uint8_t cmd, uint16_t us);
+
+        /**
+         * Return the histogram for cmd, or NULL if it has none
+         */
+        const latency_slot_t *find(uint8_t cmd);
+
+        /**
+         * Write the opcodes that have histograms into out, which must hold
+         * PYB_RADIO_LATENCY_SLOTS bytes. Return how many were written.
+         */
+        uint8_t commands(uint8_t *out);
+
+        /**
+         * Empty all histograms
+         */
+        void clear(void);
+};
+
+#endif
@@ -43,9 +43,34 @@ DEALINGS IN THE SOFTWARE.
 
 #include "MicroBitRadio.h"
 
+#include "PybRadioConfig.h"
+
 // Module::flags
 #define MODULE_INITIALIZED                    0x01
 
+// Number of logical addresses the nRF51 radio can receive on
+#define NCSS_RADIO_PIPES                      8
+
+// Number of received frames whose details are kept until they are read. It
+// covers the frames the radio driver can queue and the one it is receiving.
+#define NCSS_RADIO_RX_INFO                    8
+
+// PPI channel that counts RADIO ADDRESS events on TIMER0. Both are left
+// alone by the DAL and mbed while Bluetooth is disabled.
+#define NCSS_RADIO_RX_PPI_CHANNEL             7
+
+/**
+  * What the radio recorded about a frame as it arrived
+  */
+typedef struct {
+    // system_timer_current_time_us() when the frame's address arrived
+    uint32_t time;
+    // Signal strength in dBm
+    int8_t rssi;
+    // Logical address the frame was received on
+    uint8_t pipe;
+} radio_rx_info_t;
+
 /**
   * Class definition for a NCSS PyBoard Radio device.
   *
@@ -60,6 +85,13 @@ class NCSSPybRadio
 
     uint8_t                     status;
 
+    // Receive addresses and data rate, kept so that they can be restored
+    // after the radio driver reprograms the radio
+    uint8_t                     rx_pipes;
+    uint8_t                     pipe_prefix[NCSS_RADIO_PIPES];
+    uint32_t                    pipe_base;
+    uint8_t                     rate;
+
     public:
 
     // Serial Interface
@@ -77,12 +109,93 @@ class NCSSPybRadio
     // A reference to the LED pin on the radio module
     MicroBitPin                 led_io;
 
+    // Data ready line to the pyboard
+    MicroBitPin                 data_ready;
+
     // Bluetooth related member variables.
     MicroBitRadio               radio;
     // Various functions to query the radio state
     uint8_t radio_enabled(void);
     uint8_t radio_channel(void);
     uint8_t radio_power(void);
+    uint8_t radio_pipes(void);
+    uint8_t radio_pipe_prefix(uint8_t pipe);
+    uint32_t radio_pipe_base(void);
+    uint8_t radio_rx_pipe(void);
+    uint8_t radio_rate(void);
+
+    /**
+      * Set the over the air data rate, as one of RADIO_MODE_MODE_Nrf_1Mbit,
+      * RADIO_MODE_MODE_Nrf_2Mbit or RADIO_MODE_MODE_Nrf_250Kbit. Every radio
+      * that is to hear this one must use the same rate.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if mode
+      *         is not one of those.
+      */
+    int radio_set_rate(uint8_t mode);
+
+    /**
+      * Receive on logical address pipe, with the given address prefix.
+      *
+      * Pipe 0 is the micro:bit group address, so setting its prefix changes
+      * the radio group. Pipes 1 to 7 share the base address set with
+      * radio_set_pipe_base, which defaults to the micro:bit base address, so
+      * that by default each pipe receives a further radio group.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if pipe
+      *         is out of range.
+      */
+    int radio_set_pipe(uint8_t pipe, uint8_t prefix);
+
+    /**
+      * Stop receiving on a logical address pipe.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if pipe
+      *         is out of range.
+      */
+    int radio_clear_pipe(uint8_t pipe);
+
+    /**
+      * Set the base address shared by pipes 1 to 7
+      */
+    void radio_set_pipe_base(uint32_t base);
+
+    /**
+      * Measure the energy on up to count channels starting at first,
+      * listening on each for dwell_us microseconds. energy[i] is set to the
+      * strongest signal heard on channel first + i, as the nRF51 RSSISAMPLE
+      * reports it: the signal strength in -dBm, so that quieter channels
+      * read higher. The radio interrupt is off while scanning, so the scan
+      * stops early rather than listen for longer than PYB_RADIO_SCAN_MAX_US
+      * in all. The channel and the state of the radio are restored after.
+      *
+      * @return the number of channels scanned, or MICROBIT_INVALID_PARAMETER
+      *         if the channels are not all between 0 and 100 or dwell_us is
+      *         over PYB_RADIO_SCAN_MAX_DWELL_US.
+      */
+    int radio_scan(uint8_t first, uint8_t count, uint16_t dwell_us, uint8_t *energy);
+
+    /**
+      * Find what the radio recorded about a frame as it arrived. frame is as
+      * MicroBitRadio::recv returned it, and carries its own signal strength.
+      * RXMATCH only holds the address of the latest frame, and more frames
+      * may have arrived since this one, so the time and address are recorded
+      * as each frame's address arrives, against the buffer the radio is
+      * receiving it into. The record is taken, so each frame is looked up
+      * once.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_DATA if there is no
+      *         record of the frame, in which case info holds the current
+      *         time and the address of the latest frame.
+      */
+    int radio_rx_info(FrameBuffer *frame, radio_rx_info_t *info);
+
+    /**
+      * Write the receive addresses and data rate back into the radio.
+      * MicroBitRadio resets them whenever it is enabled or its group is
+      * changed, so this must follow those calls.
+      */
+    void radio_restore_config(void);
 
     /**
       * Constructor.
@@ -0,0 +1,307 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Compile time configuration options for the radio module firmware.
+ *
+ * Each option can be overridden either by defining it before this file
+ * is included, or through the "pyb-radio" section of config.json, which
+ * yotta passes through as YOTTA_CFG_PYB_RADIO_* definitions.
+ */
+
+#ifndef PYB_RADIO_CONFIG_H
+#define PYB_RADIO_CONFIG_H
+
+//
+// Map yotta configuration onto our own options
+//
+#if defined(YOTTA_CFG_PYB_RADIO_RX_QUEUE_DEPTH) && !defined(PYB_RADIO_RX_QUEUE_DEPTH)
+#define PYB_RADIO_RX_QUEUE_DEPTH YOTTA_CFG_PYB_RADIO_RX_QUEUE_DEPTH
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_TX_QUEUE_DEPTH) && !defined(PYB_RADIO_TX_QUEUE_DEPTH)
+#define PYB_RADIO_TX_QUEUE_DEPTH YOTTA_CFG_PYB_RADIO_TX_QUEUE_DEPTH
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_MAX_MESSAGE) && !defined(PYB_RADIO_LINK_MAX_MESSAGE)
+#define PYB_RADIO_LINK_MAX_MESSAGE YOTTA_CFG_PYB_RADIO_LINK_MAX_MESSAGE
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_REASSEMBLY) && !defined(PYB_RADIO_LINK_REASSEMBLY)
+#define PYB_RADIO_LINK_REASSEMBLY YOTTA_CFG_PYB_RADIO_LINK_REASSEMBLY
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_REASSEMBLY_MS) && !defined(PYB_RADIO_LINK_REASSEMBLY_MS)
+#define PYB_RADIO_LINK_REASSEMBLY_MS YOTTA_CFG_PYB_RADIO_LINK_REASSEMBLY_MS
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_PEERS) && !defined(PYB_RADIO_LINK_PEERS)
+#define PYB_RADIO_LINK_PEERS YOTTA_CFG_PYB_RADIO_LINK_PEERS
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_WINDOW) && !defined(PYB_RADIO_LINK_WINDOW)
+#define PYB_RADIO_LINK_WINDOW YOTTA_CFG_PYB_RADIO_LINK_WINDOW
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_RETRY_MS) && !defined(PYB_RADIO_LINK_RETRY_MS)
+#define PYB_RADIO_LINK_RETRY_MS YOTTA_CFG_PYB_RADIO_LINK_RETRY_MS
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_RETRIES) && !defined(PYB_RADIO_LINK_RETRIES)
+#define PYB_RADIO_LINK_RETRIES YOTTA_CFG_PYB_RADIO_LINK_RETRIES
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_SEEN) && !defined(PYB_RADIO_LINK_SEEN)
+#define PYB_RADIO_LINK_SEEN YOTTA_CFG_PYB_RADIO_LINK_SEEN
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_SEEN_MS) && !defined(PYB_RADIO_LINK_SEEN_MS)
+#define PYB_RADIO_LINK_SEEN_MS YOTTA_CFG_PYB_RADIO_LINK_SEEN_MS
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LINK_RELAY_QUEUE) && !defined(PYB_RADIO_LINK_RELAY_QUEUE)
+#define PYB_RADIO_LINK_RELAY_QUEUE YOTTA_CFG_PYB_RADIO_LINK_RELAY_QUEUE
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_SCAN_MAX_DWELL_US) && !defined(PYB_RADIO_SCAN_MAX_DWELL_US)
+#define PYB_RADIO_SCAN_MAX_DWELL_US YOTTA_CFG_PYB_RADIO_SCAN_MAX_DWELL_US
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_SCAN_MAX_US) && !defined(PYB_RADIO_SCAN_MAX_US)
+#define PYB_RADIO_SCAN_MAX_US YOTTA_CFG_PYB_RADIO_SCAN_MAX_US
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_SPI_DOUBLE_BUFFER) && !defined(PYB_RADIO_SPI_DOUBLE_BUFFER)
+#define PYB_RADIO_SPI_DOUBLE_BUFFER YOTTA_CFG_PYB_RADIO_SPI_DOUBLE_BUFFER
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_DATA_READY_PIN) && !defined(PYB_RADIO_DATA_READY_PIN)
+#define PYB_RADIO_DATA_READY_PIN YOTTA_CFG_PYB_RADIO_DATA_READY_PIN
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LATENCY_HISTOGRAM) && !defined(PYB_RADIO_LATENCY_HISTOGRAM)
+#define PYB_RADIO_LATENCY_HISTOGRAM YOTTA_CFG_PYB_RADIO_LATENCY_HISTOGRAM
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_LATENCY_SLOTS) && !defined(PYB_RADIO_LATENCY_SLOTS)
+#define PYB_RADIO_LATENCY_SLOTS YOTTA_CFG_PYB_RADIO_LATENCY_SLOTS
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_FILTER_RULES) && !defined(PYB_RADIO_FILTER_RULES)
+#define PYB_RADIO_FILTER_RULES YOTTA_CFG_PYB_RADIO_FILTER_RULES
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_FILTER_MATCH_SIZE) && !defined(PYB_RADIO_FILTER_MATCH_SIZE)
+#define PYB_RADIO_FILTER_MATCH_SIZE YOTTA_CFG_PYB_RADIO_FILTER_MATCH_SIZE
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_TRACE) && !defined(PYB_RADIO_TRACE)
+#define PYB_RADIO_TRACE YOTTA_CFG_PYB_RADIO_TRACE
+#endif
+
+#if defined(YOTTA_CFG_PYB_RADIO_TRACE_DEPTH) && !defined(PYB_RADIO_TRACE_DEPTH)
+#define PYB_RADIO_TRACE_DEPTH YOTTA_CFG_PYB_RADIO_TRACE_DEPTH
+#endif
+
+//
+// SPI
+//
+
+// Receive into one SPIS buffer while processing the command in the other,
+// so the semaphore is only held long enough to swap them.
+#ifndef PYB_RADIO_SPI_DOUBLE_BUFFER
+#define PYB_RADIO_SPI_DOUBLE_BUFFER         1
+#endif
+
+// GPIO driven high while a reply or a received radio message is waiting
+// for the pyboard, so it can wait on an interrupt rather than polling.
+// Given as an nRF51 pin number.
+#ifndef PYB_RADIO_DATA_READY_PIN
+#define PYB_RADIO_DATA_READY_PIN            20
+#endif
+
+// Time each command from the end of its SPI transaction until its reply is
+// in place, and keep a histogram per opcode. Uses TIMER1.
+#ifndef PYB_RADIO_LATENCY_HISTOGRAM
+#define PYB_RADIO_LATENCY_HISTOGRAM         1
+#endif
+
+// Number of opcodes that can have a latency histogram
+#ifndef PYB_RADIO_LATENCY_SLOTS
+#define PYB_RADIO_LATENCY_SLOTS             16
+#endif
+
+//
+// Trace
+//
+
+// Record hot path events into a RAM ring that can be dumped over SPI with
+// SPI_TRACE_QUERY. Each record takes 8 bytes.
+#ifndef PYB_RADIO_TRACE
+#define PYB_RADIO_TRACE                     0
+#endif
+
+// Number of records held. Must be a power of two.
+#ifndef PYB_RADIO_TRACE_DEPTH
+#define PYB_RADIO_TRACE_DEPTH               128
+#endif
+
+#if (PYB_RADIO_TRACE_DEPTH & (PYB_RADIO_TRACE_DEPTH - 1)) != 0
+#error "PYB_RADIO_TRACE_DEPTH must be a power of two"
+#endif
+
+//
+// Receive queue
+//
+
+// Number of received radio messages that can be held waiting for the pyboard.
+// Must be a power of two no greater than 128.
+#ifndef PYB_RADIO_RX_QUEUE_DEPTH
+#define PYB_RADIO_RX_QUEUE_DEPTH            8
+#endif
+
+#if (PYB_RADIO_RX_QUEUE_DEPTH & (PYB_RADIO_RX_QUEUE_DEPTH - 1)) != 0 || PYB_RADIO_RX_QUEUE_DEPTH > 128
+#error "PYB_RADIO_RX_QUEUE_DEPTH must be a power of two no greater than 128"
+#endif
+
+//
+// Transmit queue
+//
+
+// Number of messages from the pyboard that can be waiting to be sent.
+// Must be a power of two no greater than 128.
+#ifndef PYB_RADIO_TX_QUEUE_DEPTH
+#define PYB_RADIO_TX_QUEUE_DEPTH            8
+#endif
+
+#if (PYB_RADIO_TX_QUEUE_DEPTH & (PYB_RADIO_TX_QUEUE_DEPTH - 1)) != 0 || PYB_RADIO_TX_QUEUE_DEPTH > 128
+#error "PYB_RADIO_TX_QUEUE_DEPTH must be a power of two no greater than 128"
+#endif
+
+//
+// Link layer
+//
+
+// Largest message that can be sent or received in fragments. A message
+// takes one receive or transmit queue slot for every 32 bytes.
+#ifndef PYB_RADIO_LINK_MAX_MESSAGE
+#define PYB_RADIO_LINK_MAX_MESSAGE          224
+#endif
+
+#if PYB_RADIO_LINK_MAX_MESSAGE < 32 || PYB_RADIO_LINK_MAX_MESSAGE > 240
+#error "PYB_RADIO_LINK_MAX_MESSAGE must be between 32 and 240"
+#endif
+
+// Number of fragmented messages that can be reassembled at once. Each one
+// holds PYB_RADIO_LINK_MAX_MESSAGE bytes of RAM.
+#ifndef PYB_RADIO_LINK_REASSEMBLY
+#define PYB_RADIO_LINK_REASSEMBLY           2
+#endif
+
+// Time in milliseconds after its first fragment that an incomplete message
+// is given up on
+#ifndef PYB_RADIO_LINK_REASSEMBLY_MS
+#define PYB_RADIO_LINK_REASSEMBLY_MS        200
+#endif
+
+// Number of other nodes whose reliable message sequence numbers are tracked.
+// Must be more than PYB_RADIO_LINK_WINDOW.
+#ifndef PYB_RADIO_LINK_PEERS
+#define PYB_RADIO_LINK_PEERS                8
+#endif
+
+// Number of reliable messages that can be waiting for an acknowledgement
+#ifndef PYB_RADIO_LINK_WINDOW
+#define PYB_RADIO_LINK_WINDOW               4
+#endif
+
+#if PYB_RADIO_LINK_PEERS <= PYB_RADIO_LINK_WINDOW
+#error "PYB_RADIO_LINK_PEERS must be more than PYB_RADIO_LINK_WINDOW"
+#endif
+
+// Time in milliseconds to wait for an acknowledgement before resending
+#ifndef PYB_RADIO_LINK_RETRY_MS
+#define PYB_RADIO_LINK_RETRY_MS             30
+#endif
+
+// Number of times a reliable message is resent before it is given up on
+#ifndef PYB_RADIO_LINK_RETRIES
+#define PYB_RADIO_LINK_RETRIES              5
+#endif
+
+// Number of flooded messages remembered so that each is only passed on and
+// relayed once. Must be a power of two.
+#ifndef PYB_RADIO_LINK_SEEN
+#define PYB_RADIO_LINK_SEEN                 16
+#endif
+
+#if (PYB_RADIO_LINK_SEEN & (PYB_RADIO_LINK_SEEN - 1)) != 0
+#error "PYB_RADIO_LINK_SEEN must be a power of two"
+#endif
+
+// Time in milliseconds a flooded message is remembered for
+#ifndef PYB_RADIO_LINK_SEEN_MS
+#define PYB_RADIO_LINK_SEEN_MS              2000
+#endif
+
+// Number of flooded messages that can be waiting out their backoff before
+// being relayed
+#ifndef PYB_RADIO_LINK_RELAY_QUEUE
+#define PYB_RADIO_LINK_RELAY_QUEUE          4
+#endif
+
+//
+// Receive filter
+//
+
+// Number of subscriptions the receive filter can hold
+#ifndef PYB_RADIO_FILTER_RULES
+#define PYB_RADIO_FILTER_RULES              8
+#endif
+
+// Longest byte sequence a single subscription can match
+#ifndef PYB_RADIO_FILTER_MATCH_SIZE
+#define PYB_RADIO_FILTER_MATCH_SIZE         8
+#endif
+
+//
+// Channel scan
+//
+
+// Longest time in microseconds a scan may listen on each channel. The module
+// answers nothing else while it scans, so this bounds how long the pyboard
+// is kept waiting.
+#ifndef PYB_RADIO_SCAN_MAX_DWELL_US
+#define PYB_RADIO_SCAN_MAX_DWELL_US         10000
+#endif
+
+// Longest time in microseconds one scan command may listen for, over all of
+// its channels. A scan stops at the channel that would go over, so that the
+// radio is back receiving and commands are answered between parts of a long
+// scan. One channel is always scanned.
+#ifndef PYB_RADIO_SCAN_MAX_US
+#define PYB_RADIO_SCAN_MAX_US               20000
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef PYB_RADIO_TRACE_H
+#define PYB_RADIO_TRACE_H
+
+#include "mbed.h"
+#include "PybRadioConfig.h"
+
+/**
+ * Trace events. The meaning of arg and data is given for each.
+ */
+typedef enum {
+    // SPIS transaction ended. arg: first byte received, data: AMOUNTRX
+    TRACE_SPIS_END = 0x01,
+    // CPU asked for the SPIS semaphore. arg: SEMSTAT beforehand
+    TRACE_SEM_ACQUIRE = 0x02,
+    // CPU released the SPIS semaphore
+    TRACE_SEM_RELEASE = 0x03,
+    // Radio datagram received. arg: length, data: queue depth afterwards
+    TRACE_RADIO_RX = 0x04,
+    // Main loop entered schedule()
+    TRACE_SCHEDULE = 0x05,
+    // Command handling started. arg: opcode, data: command length
+    TRACE_CMD_START = 0x06,
+    // Command handling finished. arg: opcode, data: reply status
+    TRACE_CMD_END = 0x07,
+    // Radio datagram dropped by the receive filter. arg: length
+    TRACE_RADIO_FILTERED = 0x08,
+    // Queued message handed to the radio. arg: length, data: messages left
+    TRACE_RADIO_TX = 0x09,
+    // Radio frame held by the link layer, such as a fragment of a message
+    // not yet complete. arg: first byte of the link header
+    TRACE_LINK_FRAGMENT = 0x0A
+} trace_event_t;
+
+/**
+ * One trace record, as stored and as sent over SPI (little endian)
+ */
+typedef struct {
+    // Microseconds since startup, wrapping after 71 minutes
+    uint32_t time;
+    uint8_t event;
+    uint8_t arg;
+    uint16_t data;
+} __attribute__((packed)) trace_record_t;
+
+#if PYB_RADIO_TRACE
+
+/**
+ * Add a record to the ring, overwriting the oldest if it is full. Safe to
+ * call from interrupts. Does nothing while tracing is paused.
+ */
+void trace_event(trace_event_t event, uint8_t arg, uint16_t data);
+
+/**
+ * Pause or resume recording. Recording starts enabled.
+ */
+void trace_enable(uint8_t enable);
+
+/**
+ * Copy up to max records, oldest first, starting from sequence number from,
+ * into out. If from has already been overwritten, start at the oldest record
+ * still held. first is set to the sequence number of the first record copied
+ * and next to the sequence number the next record will get.
+ * Return the number of records copied.
+ */
+uint32_t trace_read(uint32_t from, trace_record_t *out, uint32_t max,
+        uint32_t *first, uint32_t *next);
+
+#define TRACE(event, arg, data) trace_event(event, arg, data)
+#else
+#define TRACE(event, arg, data) do {} while (0)
+#endif
+
+#endif
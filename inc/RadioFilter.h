@@ -0,0 +1,104 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef RADIO_FILTER_H
+#define RADIO_FILTER_H
+
+#include "mbed.h"
+#include "PybRadioConfig.h"
+
+/**
+ * A single subscription: the bytes that must appear at offset in a packet
+ */
+typedef struct {
+    uint8_t offset;
+    uint8_t length;
+    uint8_t match[PYB_RADIO_FILTER_MATCH_SIZE];
+} filter_rule_t;
+
+/**
+ * Table of subscriptions that received radio packets are checked against
+ * before they are queued for the pyboard.
+ *
+ * A packet is accepted if it matches any rule. With no rules every packet
+ * is accepted, so the filter is transparent until the master sets it up.
+ * Rules are checked inline in the radio event, so each one is a single
+ * short compare at a fixed offset.
+ */
+class RadioFilter {
+    private:
+        filter_rule_t rules[PYB_RADIO_FILTER_RULES];
+        uint8_t count;
+        // Packets accepted and dropped since startup
+        volatile uint32_t accepted;
+        volatile uint32_t dropped;
+
+    public:
+        /**
+         * Constructor: create an empty filter, which accepts everything
+         */
+        RadioFilter();
+
+        /**
+         * Add a rule matching packets that contain match at offset.
+         *
+         * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if length
+         *         is zero or longer than PYB_RADIO_FILTER_MATCH_SIZE, or
+         *         MICROBIT_NO_RESOURCES if the table is full.
+         */
+        int add(uint8_t offset, const uint8_t *match, uint8_t length);
+
+        /**
+         * Remove every rule, so that all packets are accepted
+         */
+        void clear(void);
+
+        /**
+         * Check a received packet against the rules, and count the result.
+         * Return 1 if it should be passed on to the pyboard.
+         */
+        int accept(const uint8_t *packet, uint8_t length);
+
+        /**
+         * Number of rules in the table
+         */
+        uint8_t rule_count(void);
+
+        /**
+         * Return rule i, or NULL if there is no such rule
+         */
+        const filter_rule_t *rule(uint8_t i);
+
+        /**
+         * Number of packets accepted since startup
+         */
+        uint32_t accepted_count(void);
+
+        /**
+         * Number of packets dropped since startup
+         */
+        uint32_t dropped_count(void);
+};
+
+#endif
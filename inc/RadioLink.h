@@ -0,0 +1,471 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef RADIO_LINK_H
+#define RADIO_LINK_H
+
+#include "mbed.h"
+#include "MicroBitRadio.h"
+#include "PybRadioConfig.h"
+
+/**
+ * Link layer frames, carried as MicroBitRadio datagrams.
+ *
+ * Every frame starts with a link_header_t. The high nibble of type gives the
+ * frame type and the low nibble holds flags. A message that fits in one frame
+ * is sent as LINK_DATA with the message following the header. Longer messages
+ * are split into LINK_FRAGMENT frames, where a link_fragment_t follows the
+ * header and then up to LINK_FRAGMENT_DATA bytes of the message. Every
+ * fragment but the last is full.
+ *
+ * A message sent reliably goes to a single node as LINK_RELIABLE, with a
+ * link_reliable_t after the header and then up to LINK_RELIABLE_DATA bytes
+ * of the message. The node answers with a LINK_ACK holding a link_reliable_t
+ * that names the sender and repeats the sequence number.
+ *
+ * A message flooded through the network goes as LINK_FLOOD, with a
+ * link_flood_t after the header and then up to LINK_FLOOD_DATA bytes of the
+ * message. src stays the node the message came from as it is relayed.
+ *
+ * Several short messages can share a LINK_BATCH frame, where each message
+ * after the header is preceded by its length. A batch holds at least two
+ * messages, none of them empty, and its records fill the frame exactly.
+ */
+typedef struct {
+    uint8_t type;
+    // Node that sent the message, little endian
+    uint8_t src[2];
+} __attribute__((packed)) link_header_t;
+
+typedef struct {
+    // Number of the message, from the sending node
+    uint8_t msg_id;
+    // Position of this fragment, and the number in the message
+    uint8_t index;
+    uint8_t count;
+} __attribute__((packed)) link_fragment_t;
+
+typedef struct {
+    // Node the frame is for, little endian
+    uint8_t dst[2];
+    // Number of the message, counted separately for each destination
+    uint8_t seq;
+} __attribute__((packed)) link_reliable_t;
+
+typedef struct {
+    // Number of the message, from the node it came from
+    uint8_t seq;
+    // Number of hops left, including this one
+    uint8_t ttl;
+} __attribute__((packed)) link_flood_t;
+
+// Frame types
+const uint8_t LINK_DATA = 0x00;
+const uint8_t LINK_FRAGMENT = 0x10;
+const uint8_t LINK_RELIABLE = 0x20;
+const uint8_t LINK_ACK = 0x30;
+const uint8_t LINK_FLOOD = 0x40;
+const uint8_t LINK_BATCH = 0x50;
+const uint8_t LINK_TYPE_MASK = 0xF0;
+
+// Largest message that fits in a single LINK_DATA frame
+const uint8_t LINK_DATA_SIZE = MICROBIT_RADIO_MAX_PACKET_SIZE - sizeof(link_header_t);
+// Message bytes carried by each fragment
+const uint8_t LINK_FRAGMENT_DATA = MICROBIT_RADIO_MAX_PACKET_SIZE - sizeof(link_header_t) -
+    sizeof(link_fragment_t);
+// Most fragments a message can be split into
+const uint8_t LINK_MAX_FRAGMENTS = (PYB_RADIO_LINK_MAX_MESSAGE + LINK_FRAGMENT_DATA - 1) /
+    LINK_FRAGMENT_DATA;
+// Largest message that can be sent reliably
+const uint8_t LINK_RELIABLE_DATA = MICROBIT_RADIO_MAX_PACKET_SIZE - sizeof(link_header_t) -
+    sizeof(link_reliable_t);
+// Largest message that can be flooded
+const uint8_t LINK_FLOOD_DATA = MICROBIT_RADIO_MAX_PACKET_SIZE - sizeof(link_header_t) -
+    sizeof(link_flood_t);
+// Room for messages and their lengths in a LINK_BATCH frame
+const uint8_t LINK_BATCH_DATA = MICROBIT_RADIO_MAX_PACKET_SIZE - sizeof(link_header_t);
+// Longest a short message waits for others to share its frame, in
+// microseconds, until set otherwise
+const uint16_t LINK_DEFAULT_COALESCE_US = 2000;
+// Hops a flooded message makes, and the longest a relay waits before sending
+// it on, until set otherwise
+const uint8_t LINK_DEFAULT_TTL = 4;
+const uint8_t LINK_DEFAULT_BACKOFF_MS = 8;
+// Number of recent sequence numbers from each node remembered to spot repeats
+const uint8_t LINK_SEQ_WINDOW = 32;
+// Number of finished reliable messages whose outcome is remembered
+const uint8_t LINK_RESULTS = 16;
+
+// Outcome of a reliable message
+typedef enum {
+    LINK_PENDING = 0,
+    LINK_DELIVERED = 1,
+    LINK_FAILED = 2
+} link_outcome_t;
+
+/**
+ * A fragmented message being put back together
+ */
+typedef struct {
+    uint8_t busy;
+    uint16_t src;
+    uint8_t msg_id;
+    uint8_t count;
+    // Bit i set once fragment i has arrived
+    uint16_t received;
+    uint8_t length;
+    // Time in milliseconds the first fragment arrived
+    uint32_t started;
+    uint8_t data[PYB_RADIO_LINK_MAX_MESSAGE];
+} link_reassembly_t;
+
+/**
+ * Sequence numbers used with another node. tx_seq numbers the reliable
+ * messages sent to it. rx_top is the highest number received from it, and
+ * bit i of rx_seen is set once rx_top - i has arrived.
+ */
+typedef struct {
+    uint8_t in_use;
+    uint8_t rx_started;
+    uint16_t node;
+    uint8_t tx_seq;
+    uint8_t rx_top;
+    uint32_t rx_seen;
+    // Time in milliseconds the node was last sent to or heard from
+    uint32_t last_used;
+} link_peer_t;
+
+/**
+ * A reliable message waiting for its acknowledgement
+ */
+typedef struct {
+    uint8_t busy;
+    uint8_t seq;
+    uint16_t dst;
+    // Number of times it has been sent
+    uint8_t tries;
+    uint8_t length;
+    // Caller's number for the message, reported with its outcome
+    uint32_t tag;
+    // Time in milliseconds it was last sent
+    uint32_t sent_at;
+    uint8_t frame[MICROBIT_RADIO_MAX_PACKET_SIZE];
+} link_unacked_t;
+
+/**
+ * The outcome of a finished reliable message
+ */
+typedef struct {
+    uint32_t tag;
+    uint8_t outcome;
+} link_result_t;
+
+/**
+ * An acknowledgement waiting to be sent
+ */
+typedef struct {
+    uint16_t node;
+    uint8_t seq;
+} link_ack_t;
+
+/**
+ * A flooded message seen recently
+ */
+typedef struct {
+    uint8_t valid;
+    uint8_t seq;
+    uint16_t src;
+    // Time in milliseconds it was first seen
+    uint32_t seen_at;
+} link_seen_t;
+
+/**
+ * A flooded message waiting out its backoff before being relayed
+ */
+typedef struct {
+    uint8_t busy;
+    uint8_t length;
+    // Time in milliseconds it is to be sent
+    uint32_t due;
+    uint8_t frame[MICROBIT_RADIO_MAX_PACKET_SIZE];
+} link_relay_t;
+
+/**
+ * Counters kept by the link layer
+ */
+typedef struct {
+    // Messages put back together from fragments
+    uint32_t reassembled;
+    // Messages given up on before all their fragments arrived
+    uint32_t incomplete;
+    // Frames too short, of an unknown type, or with bad fragment fields
+    uint32_t invalid;
+    // Reliable messages acknowledged, and given up on after every retry
+    uint32_t delivered;
+    uint32_t failed;
+    // Reliable frames sent again after no acknowledgement came
+    uint32_t retransmits;
+    // Reliable frames received again and dropped
+    uint32_t duplicates;
+    // Acknowledgements sent
+    uint32_t acks_sent;
+    // Flooded messages relayed, dropped because they had already been seen,
+    // not relayed because they had run out of hops, and not relayed because
+    // the relay queue was full
+    uint32_t relayed;
+    uint32_t flood_duplicates;
+    uint32_t ttl_expired;
+    uint32_t relay_dropped;
+    // Batch frames sent and the messages in them, and batch frames received
+    uint32_t batches_sent;
+    uint32_t batched_messages;
+    uint32_t batches_received;
+} link_stats_t;
+
+/**
+ * Optional link layer between the pyboard's messages and radio datagrams.
+ *
+ * While disabled, messages are sent as bare datagrams, which lets the module
+ * talk to plain micro:bits. Once enabled, every frame carries a link header.
+ * This lets messages of up to PYB_RADIO_LINK_MAX_MESSAGE bytes be split into
+ * fragments and put back together at the other end. Only a fixed number of
+ * messages can be part way through reassembly at once. A message is dropped
+ * if the rest of its fragments do not arrive within
+ * PYB_RADIO_LINK_REASSEMBLY_MS, or if it is pushed out by a newer one.
+ *
+ * Messages can also be sent reliably to a single node. The receiving node
+ * acknowledges each one and drops repeats. Up to PYB_RADIO_LINK_WINDOW
+ * messages can be waiting for their acknowledgement at once. Each is resent
+ * every PYB_RADIO_LINK_RETRY_MS until it is acknowledged, or
+ * PYB_RADIO_LINK_RETRIES times before it is given up on. Sequence numbers
+ * are kept for PYB_RADIO_LINK_PEERS nodes, and the least recently used node
+ * is forgotten to make room. A node that is forgotten by a sender, and then
+ * sent to again soon after, may have its first few messages taken for
+ * repeats by a receiver that still remembers the old numbers.
+ *
+ * With relaying on, messages are flooded through the network instead. Each
+ * carries a hop count, and every node passes it on to the pyboard once and
+ * relays it once while hops are left. A relay waits a random time of up to
+ * the backoff before sending, so that neighbours that heard the same frame
+ * do not all send at once. Flooded messages are recognised by their source
+ * and number in a small hashed cache, for PYB_RADIO_LINK_SEEN_MS.
+ *
+ * With coalescing on, the caller can pack short messages sent close
+ * together into one LINK_BATCH frame with send_batch, saving the preamble,
+ * address, CRC and radio ramp up of every frame but one. Received batches
+ * are handed back one message at a time by input and next_message.
+ *
+ * Frames go out through the transmit function given to the constructor, so
+ * several links can be connected together in a simulation. Acknowledgements
+ * and resends are only sent from poll, never from input, so that frames
+ * are not transmitted from the receive path.
+ */
+class RadioLink {
+    private:
+        int (*transmit)(uint8_t *frame, int length);
+        uint8_t enabled;
+        uint16_t node;
+        uint8_t next_msg_id;
+        link_reassembly_t reassembly[PYB_RADIO_LINK_REASSEMBLY];
+        link_peer_t peers[PYB_RADIO_LINK_PEERS];
+        link_unacked_t unacked[PYB_RADIO_LINK_WINDOW];
+        link_result_t results[LINK_RESULTS];
+        uint8_t next_result;
+        // Acknowledgements waiting for poll, a ring of free running counters
+        link_ack_t acks[PYB_RADIO_LINK_WINDOW];
+        volatile uint8_t ack_head;
+        volatile uint8_t ack_tail;
+        uint8_t relaying;
+        uint8_t ttl;
+        uint8_t backoff;
+        uint8_t next_flood_seq;
+        link_seen_t seen[PYB_RADIO_LINK_SEEN];
+        link_relay_t relays[PYB_RADIO_LINK_RELAY_QUEUE];
+        // State of the generator picking relay backoffs
+        uint32_t random_state;
+        uint8_t coalescing;
+        uint16_t coalesce_us;
+        // Received batch being handed out, and the position of the next message
+        uint8_t batch[LINK_BATCH_DATA];
+        uint8_t batch_length;
+        uint8_t batch_pos;
+        link_stats_t stats;
+
+        link_reassembly_t *find_reassembly(uint16_t src, uint8_t msg_id, uint32_t now);
+        link_peer_t *find_peer(uint16_t node, uint32_t now);
+        int send_fragments(const uint8_t *msg, uint8_t length);
+        int input_fragment(uint8_t *frame, uint8_t length, const uint8_t **msg, uint32_t now);
+        int input_reliable(uint8_t *frame, uint8_t length, uint32_t now);
+        void input_ack(const uint8_t *frame, uint8_t length);
+        void finish(link_unacked_t *entry, link_outcome_t outcome);
+        int check_seen(uint16_t src, uint8_t seq, uint32_t now);
+        int send_flood(const uint8_t *msg, uint8_t length, uint32_t now);
+        int input_flood(uint8_t *frame, uint8_t length, uint32_t now);
+        uint32_t next_random(void);
+        int input_batch(const uint8_t *frame, uint8_t length, const uint8_t **msg);
+
+    public:
+        /**
+         * Constructor: create a disabled link that sends frames with transmit,
+         * which returns MICROBIT_OK if the frame was sent.
+         */
+        RadioLink(int (*transmit)(uint8_t *frame, int length));
+
+        /**
+         * Turn the link layer on or off. Any messages part way through
+         * reassembly are dropped.
+         */
+        void enable(uint8_t on);
+
+        /**
+         * Whether the link layer is on
+         */
+        uint8_t is_enabled(void);
+
+        /**
+         * Set the node id put in the header of frames this node sends
+         */
+        void set_node_id(uint16_t id);
+
+        /**
+         * Node id put in the header of frames this node sends
+         */
+        uint16_t node_id(void);
+
+        /**
+         * Longest message that can currently be sent
+         */
+        uint8_t max_message(void);
+
+        /**
+         * Send a message, in fragments if it does not fit in one frame, or
+         * flooded if relaying is on. now is the time in milliseconds.
+         *
+         * @return MICROBIT_OK if every frame was sent, MICROBIT_INVALID_PARAMETER
+         *         if the message is too long, or the error from transmit.
+         */
+        int send(const uint8_t *msg, uint8_t length, uint32_t now = 0);
+
+        /**
+         * Turn flooding and relaying on or off. While on, messages are sent
+         * to travel up to hops hops, and flooded messages received are relayed
+         * after a random wait of up to backoff_ms. Relaying needs the link
+         * layer, and is turned off along with it.
+         */
+        void set_relay(uint8_t on, uint8_t hops = LINK_DEFAULT_TTL,
+                uint8_t backoff_ms = LINK_DEFAULT_BACKOFF_MS);
+
+        /**
+         * Whether relaying is on, and the hops and backoff it uses
+         */
+        uint8_t relay_enabled(void);
+        uint8_t relay_ttl(void);
+        uint8_t relay_backoff(void);
+
+        /**
+         * Handle a received frame. now is the time in milliseconds.
+         *
+         * Return the length of the message the frame completes and point *msg
+         * at it, or -1 if there is no message to pass on yet. A message in a
+         * single frame is moved to the start of frame. A reassembled or batched
+         * message is held by the link and stays valid until the next call.
+         * Any further messages in a batch are returned by next_message.
+         */
+        int input(uint8_t *frame, uint8_t length, const uint8_t **msg, uint32_t now);
+
+        /**
+         * Return the length of the next message in the batch last passed to
+         * input and point *msg at it, or -1 once there are no more
+         */
+        int next_message(const uint8_t **msg);
+
+        /**
+         * Turn coalescing on or off. window_us is how long the caller should
+         * hold a short message for others to share its frame. Coalescing
+         * needs the link layer, and is turned off along with it.
+         */
+        void set_coalesce(uint8_t on, uint16_t window_us = LINK_DEFAULT_COALESCE_US);
+
+        /**
+         * Whether coalescing is on, and its window in microseconds
+         */
+        uint8_t coalesce_enabled(void);
+        uint16_t coalesce_window(void);
+
+        /**
+         * Send several messages in one LINK_BATCH frame. records is the list of
+         * messages, each preceded by its length, and length is the length of
+         * the whole list, at most LINK_BATCH_DATA.
+         *
+         * @return MICROBIT_OK if the frame was sent, MICROBIT_INVALID_PARAMETER
+         *         if the list is too long, MICROBIT_NOT_SUPPORTED if the link is
+         *         disabled, or the error from transmit.
+         */
+        int send_batch(const uint8_t *records, uint8_t length);
+
+        /**
+         * Number of reliable messages that can be sent before the window is full
+         */
+        uint8_t window_free(void);
+
+        /**
+         * Send a message of up to LINK_RELIABLE_DATA bytes reliably to node dst.
+         * tag is reported along with its outcome. now is the time in
+         * milliseconds. The message is held and resent by poll until it is
+         * acknowledged, even if this first transmission fails.
+         *
+         * @return MICROBIT_OK if the frame was sent, MICROBIT_INVALID_PARAMETER
+         *         if the message is too long, MICROBIT_NOT_SUPPORTED if the link
+         *         is disabled, MICROBIT_NO_RESOURCES if the window is full, or
+         *         the error from transmit.
+         */
+        int send_reliable(uint16_t dst, const uint8_t *msg, uint8_t length, uint32_t tag,
+                uint32_t now);
+
+        /**
+         * Send waiting acknowledgements and relays that have waited out their
+         * backoff, resend reliable messages whose acknowledgement is overdue,
+         * and give up on those out of retries. now is the time in
+         * milliseconds. Return the number of frames sent.
+         */
+        int poll(uint32_t now);
+
+        /**
+         * Whether any acknowledgements are waiting to be sent by poll
+         */
+        uint8_t acks_waiting(void);
+
+        /**
+         * Outcome of the reliable message sent with tag, or -1 if it is not in
+         * the window and has been forgotten
+         */
+        int outcome(uint32_t tag);
+
+        /**
+         * Counters since startup
+         */
+        const link_stats_t *get_stats(void);
+};
+
+#endif
@@ -0,0 +1,180 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef RADIO_QUEUE_H
+#define RADIO_QUEUE_H
+
+#include "mbed.h"
+#include "MicroBitRadio.h"
+#include "PybRadioConfig.h"
+
+// Largest message that fits in a single queue slot
+const uint8_t RADIO_QUEUE_SLOT_SIZE = MICROBIT_RADIO_MAX_PACKET_SIZE;
+
+/**
+ * A single queued radio message. A message longer than RADIO_QUEUE_SLOT_SIZE
+ * continues in the data of the slots that follow it, whose other fields are
+ * unused.
+ */
+typedef struct {
+    uint8_t length;
+    // Signal strength in dBm, as reported by the radio
+    int8_t rssi;
+    // Low 32 bits of the system time in microseconds when it was received,
+    // or queued to be sent
+    uint32_t time;
+    // Logical address the message was received on
+    uint8_t pipe;
+    // How a message waiting to be sent is to be sent
+    uint8_t flags;
+    uint8_t data[RADIO_QUEUE_SLOT_SIZE];
+} radio_msg_t;
+
+// Flags of a message waiting to be sent: send it reliably, to the node whose
+// little endian id makes up the first two bytes of data
+const uint8_t RADIO_MSG_RELIABLE = 0x01;
+
+/**
+ * Progress of the transmit queue. Messages are numbered from 0 in the order
+ * they are queued, and message n has been handled once completed > n.
+ */
+typedef struct {
+    // Messages accepted into the queue, the number of the next one
+    volatile uint32_t queued;
+    // Messages taken from the queue and handed to the radio
+    volatile uint32_t completed;
+    // Of those, the ones the radio sent and the ones it failed to send
+    volatile uint32_t sent;
+    volatile uint32_t failed;
+    // Messages refused because the queue was full
+    volatile uint32_t full;
+} tx_status_t;
+
+/**
+ * Fixed capacity ring of radio messages.
+ *
+ * The queue has a single producer and a single consumer: the radio event
+ * handler and the SPI command handler for received messages, and the other
+ * way around for messages to transmit. head is only ever written by the
+ * producer and tail only by the consumer, so no locking is needed between them.
+ * When the queue is full, new messages are dropped and counted.
+ */
+class RadioQueue {
+    private:
+        radio_msg_t *slots;
+        // Number of slots, a power of two no greater than 128
+        uint8_t size;
+        // Free running slot counters, the slot index is counter % size
+        volatile uint8_t head;
+        volatile uint8_t tail;
+        // Free running message counters
+        volatile uint8_t msg_head;
+        volatile uint8_t msg_tail;
+        // Number of messages dropped because the queue was full
+        volatile uint32_t overflows;
+
+    public:
+        /**
+         * Constructor: create an empty queue holding its messages in slots,
+         * an array of size messages.
+         */
+        RadioQueue(radio_msg_t *slots, uint8_t size);
+
+        /**
+         * Number of slots a message of length bytes takes
+         */
+        static uint8_t slots_for(uint8_t length) {
+            return length > RADIO_QUEUE_SLOT_SIZE ?
+                (length + RADIO_QUEUE_SLOT_SIZE - 1) / RADIO_QUEUE_SLOT_SIZE : 1;
+        }
+
+        /**
+         * Copy a message into the back of the queue, with the given flags,
+         * stamped with the current time.
+         *
+         * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the message
+         *         is longer than the whole queue or MICROBIT_NO_RESOURCES if the
+         *         queue is full.
+         */
+        int push(const uint8_t *msg, uint8_t length, uint8_t flags = 0);
+
+        /**
+         * Return the free slot at the back of the queue, so a message of up to
+         * length bytes can be written into it in place, or NULL if there is not
+         * enough room. A message that fits in one slot can be written straight
+         * into its data, longer ones are written with fill. The message is only
+         * queued once commit is called.
+         */
+        radio_msg_t *claim(uint8_t length = RADIO_QUEUE_SLOT_SIZE);
+
+        /**
+         * Copy a message into the slots returned by claim(length)
+         */
+        void fill(const uint8_t *msg, uint8_t length);
+
+        /**
+         * Queue the message written into the slot returned by claim.
+         * The caller fills in data, rssi, time, pipe and flags first.
+         */
+        void commit(uint8_t length);
+
+        /**
+         * Copy the whole of a queued message, including any part held in
+         * following slots, into buffer. Return its length.
+         */
+        uint8_t read(const radio_msg_t *msg, uint8_t *buffer);
+
+        /**
+         * Count a message dropped because the queue was full
+         */
+        void drop(void);
+
+        /**
+         * Return the message at the front of the queue, or NULL if the queue is empty.
+         * The message remains valid until pop is called.
+         */
+        const radio_msg_t *front(void);
+
+        /**
+         * Return the message queued after msg, or NULL if msg is the last
+         */
+        const radio_msg_t *next(const radio_msg_t *msg);
+
+        /**
+         * Discard the message at the front of the queue
+         */
+        void pop(void);
+
+        /**
+         * Number of messages waiting in the queue
+         */
+        uint8_t depth(void);
+
+        /**
+         * Number of messages dropped since startup
+         */
+        uint32_t overflow_count(void);
+};
+
+#endif
@@ -28,7 +28,28 @@ DEALINGS IN THE SOFTWARE.
 #include "mbed.h"
 #include "SPIRadioCmds.h"
 
-// Loop to handle SPI commands
-void spi_cmd_switch(spi_radio_cmds_t, uint8_t *io_buffer, uint32_t length);
+// Event raised when a SPI transaction ends
+static const uint16_t PYB_RADIO_ID_SPI = 3000;
+static const uint16_t PYB_RADIO_SPI_EVT_END = 1;
+// Event raised when messages are waiting to be transmitted
+static const uint16_t PYB_RADIO_SPI_EVT_TX = 2;
+
+// Loop to handle SPI commands. The command is read from in_buffer and the
+// reply written into out_buffer, both in place in the SPIS buffers.
+void spi_cmd_switch(spi_radio_cmds_t, const uint8_t *in_buffer, uint32_t length,
+        uint8_t *out_buffer);
+
+// Whether every transaction is answered with a stream frame, after
+// SPI_STREAM_ENABLE
+uint8_t spi_streaming(void);
+
+// Handle a transaction while streaming: drop the messages in the last stream
+// frame if the master read all of it, then handle the command the master
+// sent, or put the next stream frame in place if it only clocked bytes out.
+void spi_stream(const uint8_t *in_buffer, uint32_t length, uint8_t *out_buffer);
+
+// Rebuild the stream frame waiting to be read to take in newly received
+// messages, unless the master has started reading it
+void spi_stream_refresh(void);
 
 #endif
@@ -37,6 +37,23 @@ static const uint8_t SPI_RADIO_POWER = 0x03 << 2;
 static const uint8_t SPI_MSG_AVAIL = 0x04 << 2;
 static const uint8_t SPI_SEND_MSG = 0x05 << 2;
 static const uint8_t SPI_RECV_MSG = 0x06 << 2;
+static const uint8_t SPI_RECV_MANY_MSG = 0x07 << 2;
+static const uint8_t SPI_SEND_MANY_MSG = 0x08 << 2;
+static const uint8_t SPI_PROTOCOL = 0x09 << 2;
+static const uint8_t SPI_STATS = 0x0A << 2;
+static const uint8_t SPI_LATENCY = 0x0B << 2;
+static const uint8_t SPI_TRACE = 0x0C << 2;
+static const uint8_t SPI_RX_META = 0x0D << 2;
+static const uint8_t SPI_FILTER = 0x0E << 2;
+static const uint8_t SPI_PIPE = 0x0F << 2;
+static const uint8_t SPI_TX = 0x10 << 2;
+static const uint8_t SPI_RADIO_RATE = 0x11 << 2;
+static const uint8_t SPI_LINK = 0x12 << 2;
+static const uint8_t SPI_RELIABLE = 0x13 << 2;
+static const uint8_t SPI_RELAY = 0x14 << 2;
+static const uint8_t SPI_COALESCE = 0x15 << 2;
+static const uint8_t SPI_RADIO_SCAN = 0x16 << 2;
+static const uint8_t SPI_STREAM = 0x17 << 2;
 
 // Cmds from master
 typedef enum {
@@ -52,13 +69,81 @@ typedef enum {
     // Radio Transmit Power
     SPI_RADIO_POWER_SET = SPI_RADIO_POWER,
     SPI_RADIO_POWER_QUERY = SPI_RADIO_POWER | SPI_QUERY,
+    // Radio Data Rate
+    SPI_RADIO_RATE_SET = SPI_RADIO_RATE,
+    SPI_RADIO_RATE_QUERY = SPI_RADIO_RATE | SPI_QUERY,
+    // Channel energy scan
+    SPI_RADIO_SCAN_CMD = SPI_RADIO_SCAN,
     // Message Available Query
     SPI_MSG_QUERY = SPI_MSG_AVAIL | SPI_QUERY,
     // Send and recieve commands
     SPI_SEND_CMD = SPI_SEND_MSG,
-    SPI_RECV_CMD = SPI_RECV_MSG
+    SPI_RECV_CMD = SPI_RECV_MSG,
+    SPI_RECV_MANY_CMD = SPI_RECV_MANY_MSG,
+    SPI_SEND_MANY_CMD = SPI_SEND_MANY_MSG,
+    // Reply framing
+    SPI_PROTOCOL_SET = SPI_PROTOCOL,
+    SPI_PROTOCOL_QUERY = SPI_PROTOCOL | SPI_QUERY,
+    // Performance counters
+    SPI_STATS_RESET = SPI_STATS | SPI_STATE_OFF,
+    SPI_STATS_QUERY = SPI_STATS | SPI_QUERY,
+    // Command latency histograms
+    SPI_LATENCY_RESET = SPI_LATENCY | SPI_STATE_OFF,
+    SPI_LATENCY_QUERY = SPI_LATENCY | SPI_QUERY,
+    // Event trace
+    SPI_TRACE_DISABLE = SPI_TRACE | SPI_STATE_OFF,
+    SPI_TRACE_ENABLE = SPI_TRACE | SPI_STATE_ON,
+    SPI_TRACE_QUERY = SPI_TRACE | SPI_QUERY,
+    // Received message metadata
+    SPI_RX_META_DISABLE = SPI_RX_META | SPI_STATE_OFF,
+    SPI_RX_META_ENABLE = SPI_RX_META | SPI_STATE_ON,
+    SPI_RX_META_QUERY = SPI_RX_META | SPI_QUERY,
+    // Receive filter
+    SPI_FILTER_CLEAR = SPI_FILTER | SPI_STATE_OFF,
+    SPI_FILTER_ADD = SPI_FILTER | SPI_STATE_ON,
+    SPI_FILTER_QUERY = SPI_FILTER | SPI_QUERY,
+    // Receive address pipes
+    SPI_PIPE_CLEAR = SPI_PIPE | SPI_STATE_OFF,
+    SPI_PIPE_SET = SPI_PIPE | SPI_STATE_ON,
+    SPI_PIPE_QUERY = SPI_PIPE | SPI_QUERY,
+    // Transmit queue
+    SPI_TX_QUERY = SPI_TX | SPI_QUERY,
+    // Link layer
+    SPI_LINK_DISABLE = SPI_LINK | SPI_STATE_OFF,
+    SPI_LINK_ENABLE = SPI_LINK | SPI_STATE_ON,
+    SPI_LINK_QUERY = SPI_LINK | SPI_QUERY,
+    // Reliable delivery
+    SPI_RELIABLE_SEND = SPI_RELIABLE | SPI_STATE_ON,
+    SPI_RELIABLE_QUERY = SPI_RELIABLE | SPI_QUERY,
+    // Mesh relaying
+    SPI_RELAY_DISABLE = SPI_RELAY | SPI_STATE_OFF,
+    SPI_RELAY_ENABLE = SPI_RELAY | SPI_STATE_ON,
+    SPI_RELAY_QUERY = SPI_RELAY | SPI_QUERY,
+    // Coalescing short messages
+    SPI_COALESCE_DISABLE = SPI_COALESCE | SPI_STATE_OFF,
+    SPI_COALESCE_ENABLE = SPI_COALESCE | SPI_STATE_ON,
+    SPI_COALESCE_QUERY = SPI_COALESCE | SPI_QUERY,
+    // Streaming received messages
+    SPI_STREAM_DISABLE = SPI_STREAM | SPI_STATE_OFF,
+    SPI_STREAM_ENABLE = SPI_STREAM | SPI_STATE_ON,
+    SPI_STREAM_QUERY = SPI_STREAM | SPI_QUERY
 } spi_radio_cmds_t;
 
+// Radio data rates for SPI_RADIO_RATE_SET, the nRF51 RADIO MODE values
+typedef enum {
+    SPI_RADIO_RATE_1MBIT = 0x00,
+    SPI_RADIO_RATE_2MBIT = 0x01,
+    SPI_RADIO_RATE_250KBIT = 0x02
+} spi_radio_rate_t;
+
+// Reply framing, selected with SPI_PROTOCOL_SET
+typedef enum {
+    // Replies without data are a single status byte
+    SPI_PROTOCOL_LEGACY = 0x00,
+    // Every reply starts with a status byte and a length
+    SPI_PROTOCOL_FRAMED = 0x01
+} spi_protocol_t;
+
 // Responses
 typedef enum {
     SPI_NOCMD = 0x00,
@@ -70,8 +155,10 @@ typedef enum {
     SPI_REPLY_OVERFLOW = 0x06,
     SPI_CHECKSUM_FAIL = 0x07,
     SPI_INVALID_COMMAND = 0x08,
+    SPI_QUEUE_FULL = 0x09,
     SPI_NO_MESSAGE = 0x10,
     SPI_MESSAGE = 0x11,
+    SPI_STREAM_FRAME = 0x12,
     SPI_PERIPH_BUSY = 0xF0,
     SPI_OVERFLOW = 0xF1,
     SPI_OTHER_FAIL = 0xFF
@@ -89,4 +176,177 @@ typedef enum {
 //Note: The above message format is only sent for commands that have data
 //      so the SPI_RADIO_STATE_* commands only send a response.
 //
+// In SPI_PROTOCOL_FRAMED every reply has a status byte and a length first,
+// with a zero length for replies without data. The checksum only follows a
+// non-zero length. The master can then read the two byte header and exactly
+// the rest of the reply in the same transaction. The module starts in
+// SPI_PROTOCOL_LEGACY, and the reply to SPI_PROTOCOL_SET is already framed
+// in the new mode.
+//
+// SPI_RECV_MANY_CMD packs as many queued messages as will fit into a single
+// reply of the format above. The master may send a one byte payload giving the
+// largest reply it is willing to read, otherwise the whole buffer is used.
+// SPI_SEND_MANY_CMD carries the same list as its payload, and the reply holds
+// a bitmap with bit i (LSB first) set if message i was queued for sending.
+// msg is then a list of length prefixed messages:
+//typedef struct {
+//    uint8_t length;
+//    uint8_t data[length];
+//} __attribute__((packed)) msg_record;
+//
+// After SPI_RX_META_ENABLE, each message returned by SPI_RECV_CMD and
+// SPI_RECV_MANY_CMD is preceded by its metadata. The length in a msg_record
+// still counts only the data:
+//typedef struct {
+//    int8_t rssi;    // dBm
+//    uint32_t time;  // little endian, system time in us when received
+//    uint8_t pipe;   // logical address received on, see SPI_PIPE_SET
+//} __attribute__((packed)) msg_meta;
+//
+// SPI_STATS_QUERY replies with a list of little endian uint32 counters, all
+// counted since startup or the last SPI_STATS_RESET. New counters are only
+// ever added to the end, so the master should accept a longer list:
+//   0  commands handled
+//   1  commands that failed their checksum
+//   2  unknown commands
+//   3  radio packets sent
+//   4  received radio packets dropped because the queue was full
+//   5  SPI transactions seen
+//   6  transactions answered with SPI_PERIPH_BUSY
+//   7  commands dropped because the last one was still being handled
+//   8  transactions longer than the receive buffer
+//   9  transactions that read past the reply (answered SPI_OVERFLOW)
+//  10  semaphore force releases by the main loop
+//  11  received radio packets accepted by the receive filter
+//  12  received radio packets dropped by the receive filter
+//
+// SPI_LATENCY_QUERY with no payload replies with the list of command opcodes
+// that have latency histograms. With a one byte payload holding an opcode, it
+// replies with that command's histogram as little endian uint16s: the largest
+// latency seen in microseconds, then the counts for each bucket. Bucket i
+// counts latencies under 16 << i us, and the last one everything longer.
+// SPI_OUT_OF_RANGE means the opcode has no histogram. Latency is measured
+// from the end of the command's transaction until its reply is in place.
+//
+// SPI_TRACE_QUERY reads the event trace, in builds with PYB_RADIO_TRACE. An
+// optional four byte payload gives the sequence number of the first record
+// wanted, otherwise reading starts at the oldest record held. The reply is
+// the little endian uint32 sequence number of the first record returned and
+// of the next record to be written, followed by as many trace_record_t as
+// fit (see PybRadioTrace.h). SPI_TRACE_DISABLE pauses recording so that the
+// ring can be read out without the reads being recorded, and
+// SPI_TRACE_ENABLE resumes it.
+//
+// Sent messages go into a transmit queue and are handed to the radio in the
+// background, so the reply does not wait for the radio airtime. Messages are
+// numbered from 0 in the order they are queued. SPI_SEND_CMD replies with the
+// little endian uint32 number of the queued message, or SPI_QUEUE_FULL if
+// there was no room. SPI_TX_QUERY replies with little endian uint32 counts of
+// messages queued, completed, sent and failed, and of sends refused because
+// the queue was full, followed by the number of messages still waiting.
+// Message n has been handed to the radio once the completed count passes n.
+//
+// Messages are sent as bare radio datagrams of up to 32 bytes, so that plain
+// micro:bits can hear them. After SPI_LINK_ENABLE every frame carries a link
+// header (see RadioLink.h), and messages of up to PYB_RADIO_LINK_MAX_MESSAGE
+// bytes are sent in fragments and put back together by the receiving module.
+// All the modules in a network must have the link layer on. SPI_LINK_ENABLE
+// takes an optional two byte little endian node id, which otherwise comes from
+// the chip serial number. SPI_LINK_DISABLE goes back to bare datagrams.
+// SPI_LINK_QUERY replies with whether the link layer is on, the node id, and
+// little endian uint32 counts of messages reassembled, messages dropped
+// before all their fragments arrived, and invalid frames.
+//
+// With the link layer on, SPI_RELIABLE_SEND takes a payload of a two byte
+// little endian node id followed by a message of up to LINK_RELIABLE_DATA
+// bytes, and queues it to be sent to that node until it is acknowledged.
+// It is numbered and replied to as SPI_SEND_CMD is, and answered with
+// SPI_INVALID_COMMAND while the link layer is off. SPI_RELIABLE_QUERY with a
+// four byte payload holding a message number replies with one byte,
+// LINK_PENDING, LINK_DELIVERED or LINK_FAILED, or SPI_OUT_OF_RANGE once the
+// outcome has been forgotten. With no payload it replies with little endian
+// uint32 counts of messages delivered and failed, of resends, of repeated
+// frames dropped and of acknowledgements sent, then the number of messages
+// waiting for an acknowledgement.
+//
+// With the link layer on, SPI_RELAY_ENABLE floods every message sent through
+// the network, and relays flooded messages from other nodes, so the master
+// does not have to receive and resend them. An optional two byte payload
+// gives the number of hops messages sent travel, and the longest time in
+// milliseconds a relay waits at random before sending. Each flooded message
+// is received once however many relays it reaches us through. Only messages
+// of up to LINK_FLOOD_DATA bytes can be flooded. SPI_RELAY_DISABLE stops
+// flooding and relaying, and SPI_INVALID_COMMAND is returned while the link
+// layer is off. SPI_RELAY_QUERY replies with whether relaying is on, the
+// hops and the backoff, then little endian uint32 counts of messages relayed,
+// repeats dropped, messages not relayed because they were out of hops and
+// messages not relayed because the relay queue was full.
+//
+// With the link layer on, SPI_COALESCE_ENABLE packs short messages queued
+// close together into shared LINK_BATCH frames, which the receiving module
+// queues as separate messages. A short message is held until no more can
+// join its frame, or until it has waited for the window, given by an
+// optional two byte little endian payload in microseconds. A timer sends
+// the batch when the window closes. Messages are not coalesced
+// while relaying. SPI_COALESCE_DISABLE sends every message in its own frame
+// again, and SPI_INVALID_COMMAND is returned while the link layer is off.
+// SPI_COALESCE_QUERY replies with whether coalescing is on, the little
+// endian uint16 window, then little endian uint32 counts of batch frames
+// sent, messages sent in them and batch frames received.
+//
+// The receive filter drops radio packets the master has not subscribed to
+// before they are queued, so they never cross the SPI bus. With no rules
+// every packet is accepted. SPI_FILTER_ADD takes a payload of an offset
+// followed by 1 to PYB_RADIO_FILTER_MATCH_SIZE bytes, and subscribes to
+// packets holding those bytes at that offset: an offset of 0 matches a
+// prefix, others match a header field. It replies SPI_OUT_OF_RANGE when the
+// table is full. SPI_FILTER_CLEAR removes every rule. SPI_FILTER_QUERY
+// replies with the number of rules followed by each rule as its offset,
+// length and bytes. The accepted and dropped counts are in SPI_STATS_QUERY.
+//
+// The radio can receive on up to 8 logical addresses at once, and ignores
+// packets sent to any other address without waking the CPU. Pipe 0 is the
+// micro:bit group address. SPI_PIPE_SET takes a payload of a pipe number and
+// an address prefix, and starts receiving on that pipe. Pipes 1 to 7 share a
+// base address, which defaults to the micro:bit one so that each pipe hears
+// one more radio group. An optional four byte little endian base address
+// after the prefix replaces it. SPI_PIPE_CLEAR takes a pipe number and stops
+// receiving on it. SPI_PIPE_QUERY replies with the bitmap of enabled pipes,
+// the prefix of each of the 8 pipes and the little endian shared base.
+//
+// SPI_RADIO_SCAN_CMD measures the energy on a range of channels, to find a
+// quiet one for SPI_RADIO_CHAN_SET. Its payload is the first channel and
+// the number of channels, then an optional little endian uint16 time in
+// microseconds to listen on each, 1000 by default and at most
+// PYB_RADIO_SCAN_MAX_DWELL_US. The reply holds one byte per channel
+// scanned, the strongest signal heard on it in -dBm, so quieter channels
+// read higher. Only as many channels as can be listened to within
+// PYB_RADIO_SCAN_MAX_US are scanned, at least one, so the master carries on
+// from the first channel the reply is short of. Channels outside 0 to 100
+// or a longer time are SPI_OUT_OF_RANGE. The radio is back on its own
+// channel, and receiving if it was, once the reply is ready, but nothing is
+// received or sent during the scan.
+//
+// SPI_STREAM_ENABLE turns the module into a sniffer. Every radio frame heard
+// on the enabled pipes is queued as it arrived, without going through the
+// link layer or the receive filter, and every transaction is answered with
+// a stream frame, so the master only has to clock bytes out. A stream frame
+// is framed like a reply, with status SPI_STREAM_FRAME, and holds a little
+// endian uint16 count of messages dropped since the last frame (saturating
+// at 0xFFFF), the number of messages still queued after this frame, then as
+// many messages as fit, each as a msg_record of its length, its msg_meta and
+// its data. The frame waiting to be read is rebuilt as messages arrive, so
+// each frame holds every message that arrived before the transaction reading
+// it started, up to what fits. The messages in a frame are only removed from
+// the queue once a transaction has clocked out the whole frame, otherwise
+// they are sent again in the next one, so the master can read the header
+// first and the rest in the same transaction, or read the whole buffer. A
+// transaction that starts with a command byte other than SPI_NOOP is
+// handled as a command instead, and the frame after its reply picks up
+// where the stream left off. SPI_STREAM_DISABLE goes back to answering
+// commands only, and SPI_STREAM_QUERY replies with whether streaming is on
+// then little endian uint32 counts of frames read, messages in them and
+// messages dropped while streaming. The data ready line is high while
+// messages are queued.
+//
 #endif
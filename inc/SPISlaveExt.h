@@ -26,6 +26,7 @@ DEALINGS IN THE SOFTWARE.
 #define SPI_SLAVE_EXT_H
 
 #include "mbed.h"
+#include "PybRadioConfig.h"
 
 const uint16_t SPI_IOBUF_SIZE = 255;
 
@@ -36,6 +37,32 @@ typedef enum {
     SPI_OP_OTHER_FAIL
 } spi_op_status_t;
 
+/**
+ * A view of part of one of the SPIS buffers
+ */
+typedef struct {
+    uint8_t *data;
+    uint32_t length;
+} spi_view_t;
+
+/**
+ * Counters kept by the SPI slave since startup or the last clear_stats
+ */
+typedef struct {
+    // Transactions seen by the interrupt
+    uint32_t transactions;
+    // Transactions answered with SPI_PERIPH_BUSY
+    uint32_t busy;
+    // Commands dropped because the last one was still being handled
+    uint32_t dropped;
+    // Transactions longer than the receive buffer
+    uint32_t overflows;
+    // Transactions that read past the reply, and were sent SPI_OVERFLOW
+    uint32_t overreads;
+    // Times the main loop found the semaphore held with nothing to do
+    uint32_t forced_releases;
+} spi_stats_t;
+
 class SPISlaveExt : public SPISlave {
     private:
         // Allocate space for input and output
@@ -44,6 +71,37 @@ class SPISlaveExt : public SPISlave {
         uint8_t outputBuf[SPI_IOBUF_SIZE] = {0};
         uint8_t outputBuf_size;
 
+        // Double buffered mode. The SPIS receives into one input buffer while
+        // the CPU works on a command in the other.
+        uint8_t double_buffered;
+        uint8_t inputBuf2[SPI_IOBUF_SIZE] = {0};
+        // The command handed to the CPU, if any
+        uint8_t *volatile rxPending;
+        volatile uint32_t rxPendingLen;
+        // Set from when a command is accepted until its reply is ready
+        volatile uint8_t busy;
+        // Set while the CPU holds the semaphore to put a reply in place
+        volatile uint8_t arming;
+        // Set from when a reply is put in place until the master has read it
+        volatile uint8_t replyWaiting;
+        // Hand polls to the CPU as well as commands
+        volatile uint8_t streaming;
+        // Bytes of the last reply clocked out by the transaction that
+        // carried the waiting command, in double buffered mode
+        volatile uint32_t rxPendingRead;
+        // Counters, updated from the interrupt
+        volatile spi_stats_t stats;
+#if PYB_RADIO_LATENCY_HISTOGRAM
+        // TIMER1 count when the waiting command's transaction ended
+        volatile uint16_t cmdStart;
+#endif
+        // Single byte replies shown while busy, and once a reply has been read
+        uint8_t busyBuf[1];
+        uint8_t idleBuf[1];
+
+        // Flip input buffers at the end of a transaction
+        uint8_t swap_buffers(void);
+
         // SPI Device Commands
         // Acquire and release semaphores for modifying buffers
         void acquire_sem(void);
@@ -74,6 +132,25 @@ class SPISlaveExt : public SPISlave {
          */
         spi_op_status_t read_buffer(uint8_t* buffer, uint8_t maxLen, uint8_t release = 1);
 
+        /**
+         * Take the waiting command, in place in the SPIS receive buffer.
+         * Returns an empty view if no command is waiting. The view stays
+         * valid until the reply is sent.
+         */
+        spi_view_t rx_view(void);
+
+        /**
+         * The transmit buffer. A reply can be written straight into it and
+         * then sent with commit_reply.
+         */
+        spi_view_t tx_view(void);
+
+        /**
+         * Send the first len bytes of the transmit buffer as the reply.
+         * release has the same meaning as for reply_buffer.
+         */
+        spi_op_status_t commit_reply(uint8_t len, uint8_t release = 1);
+
         /**
          * prepare a response message
          * outBuffer is the response that we want to send
@@ -89,6 +166,84 @@ class SPISlaveExt : public SPISlave {
          */
         spi_op_status_t reply(int d);
 
+        /**
+         * Call handler from interrupt context each time a transaction ends.
+         * The END->ACQUIRE short means the CPU already holds the buffers when
+         * handler runs. The interrupt is masked until the transaction has been
+         * read with read_buffer, so handler runs once per transaction.
+         * In double buffered mode handler runs after the buffers are swapped,
+         * and receive() tells whether the transaction brought a new command.
+         */
+        void attach(void (*handler)(void));
+
+        /**
+         * Enable or disable double buffered operation.
+         *
+         * When enabled, the semaphore is only held in the SPIS interrupt for
+         * long enough to point the SPIS at the spare input buffer. The master
+         * is answered with SPI_PERIPH_BUSY from a TX buffer rather than DEF
+         * while the command is processed, and the reply is swapped in when
+         * reply_buffer is called. Polls (SPI_NOOP) are handled entirely in
+         * the interrupt, and commands arriving while busy are dropped, since
+         * the master saw SPI_PERIPH_BUSY and will retry.
+         */
+        void double_buffer(uint8_t enable);
+
+        /**
+         * Enable or disable streaming. While streaming every transaction is
+         * handed to the CPU as a command, SPI_NOOP polls included, so that
+         * each one can be answered with a new reply.
+         */
+        void stream(uint8_t enable);
+
+        /**
+         * Take back the reply in place so that it can be rewritten in
+         * tx_view and sent again with commit_reply. This fails with
+         * SPI_OP_NOT_READY once a transaction has started reading it, or if
+         * the CPU is handling a command.
+         */
+        spi_op_status_t reclaim_reply(void);
+
+        /**
+         * Number of bytes of the last reply that the master clocked out in
+         * the transaction carrying the waiting command
+         */
+        uint32_t reply_read(void);
+
+        /**
+         * Return 1 if a reply has been put in place that the master has not
+         * yet read.
+         */
+        uint8_t reply_waiting(void);
+
+        /**
+         * Return 1 if no command is waiting for, or being handled by, the CPU
+         */
+        uint8_t idle(void);
+
+#if PYB_RADIO_LATENCY_HISTOGRAM
+        /**
+         * TIMER1 count, in microseconds, when the transaction carrying the
+         * current command ended
+         */
+        uint16_t command_start(void);
+#endif
+
+        /**
+         * Copy out the counters
+         */
+        void get_stats(spi_stats_t *out);
+
+        /**
+         * Zero the counters
+         */
+        void clear_stats(void);
+
+        /**
+         * Handle the end of a transaction, called from the SPIS interrupt
+         */
+        void end_irq(void);
+
         /**
          * Check semaphore state
          */
@@ -98,6 +253,12 @@ class SPISlaveExt : public SPISlave {
          * Release CPU semaphore for next operation
          */
         spi_op_status_t release(void);
+
+        /**
+         * Release the semaphore if the CPU is holding it while no command is
+         * waiting, which should not happen. Counted as a forced release.
+         */
+        spi_op_status_t force_release(void);
 };
 
 #endif
@@ -3,6 +3,11 @@
 
 from pyb import delay, udelay, millis
 from machine import Pin, SPI
+import micropython
+try:
+    from ucollections import namedtuple
+except ImportError:
+    from collections import namedtuple
 
 # States
 SPI_STATE_ON = 0x01
@@ -16,6 +21,23 @@ SPI_RADIO_POWER = 0x03 << 2
 SPI_MSG_AVAIL = 0x04 << 2
 SPI_SEND_MSG = 0x05 << 2
 SPI_RECV_MSG = 0x06 << 2
+SPI_RECV_MANY_MSG = 0x07 << 2
+SPI_SEND_MANY_MSG = 0x08 << 2
+SPI_PROTOCOL = 0x09 << 2
+SPI_STATS = 0x0A << 2
+SPI_LATENCY = 0x0B << 2
+SPI_TRACE = 0x0C << 2
+SPI_RX_META = 0x0D << 2
+SPI_FILTER = 0x0E << 2
+SPI_PIPE = 0x0F << 2
+SPI_TX = 0x10 << 2
+SPI_RADIO_RATE = 0x11 << 2
+SPI_LINK = 0x12 << 2
+SPI_RELIABLE = 0x13 << 2
+SPI_RELAY = 0x14 << 2
+SPI_COALESCE = 0x15 << 2
+SPI_RADIO_SCAN = 0x16 << 2
+SPI_STREAM = 0x17 << 2
 
 # Cmds from master
 SPI_NOOP = 0x00
@@ -30,11 +52,78 @@ SPI_RADIO_CHAN_QUERY = SPI_RADIO_CHAN | SPI_QUERY
 # Radio Transmit Power
 SPI_RADIO_POWER_SET = SPI_RADIO_POWER
 SPI_RADIO_POWER_QUERY = SPI_RADIO_POWER | SPI_QUERY
+# Radio Data Rate
+SPI_RADIO_RATE_SET = SPI_RADIO_RATE
+SPI_RADIO_RATE_QUERY = SPI_RADIO_RATE | SPI_QUERY
+# Channel energy scan
+SPI_RADIO_SCAN_CMD = SPI_RADIO_SCAN
 # Message Available Query
 SPI_MSG_QUERY = SPI_MSG_AVAIL | SPI_QUERY
 # Send and recieve commands
 SPI_SEND_CMD = SPI_SEND_MSG
 SPI_RECV_CMD = SPI_RECV_MSG
+SPI_RECV_MANY_CMD = SPI_RECV_MANY_MSG
+SPI_SEND_MANY_CMD = SPI_SEND_MANY_MSG
+# Reply framing
+SPI_PROTOCOL_SET = SPI_PROTOCOL
+SPI_PROTOCOL_QUERY = SPI_PROTOCOL | SPI_QUERY
+# Performance counters
+SPI_STATS_RESET = SPI_STATS | SPI_STATE_OFF
+SPI_STATS_QUERY = SPI_STATS | SPI_QUERY
+# Command latency histograms
+SPI_LATENCY_RESET = SPI_LATENCY | SPI_STATE_OFF
+SPI_LATENCY_QUERY = SPI_LATENCY | SPI_QUERY
+# Event trace
+SPI_TRACE_DISABLE = SPI_TRACE | SPI_STATE_OFF
+SPI_TRACE_ENABLE = SPI_TRACE | SPI_STATE_ON
+SPI_TRACE_QUERY = SPI_TRACE | SPI_QUERY
+# Receive metadata
+SPI_RX_META_DISABLE = SPI_RX_META | SPI_STATE_OFF
+SPI_RX_META_ENABLE = SPI_RX_META | SPI_STATE_ON
+SPI_RX_META_QUERY = SPI_RX_META | SPI_QUERY
+# Receive filter
+SPI_FILTER_CLEAR = SPI_FILTER | SPI_STATE_OFF
+SPI_FILTER_ADD = SPI_FILTER | SPI_STATE_ON
+SPI_FILTER_QUERY = SPI_FILTER | SPI_QUERY
+# Receive address pipes
+SPI_PIPE_CLEAR = SPI_PIPE | SPI_STATE_OFF
+SPI_PIPE_SET = SPI_PIPE | SPI_STATE_ON
+SPI_PIPE_QUERY = SPI_PIPE | SPI_QUERY
+# Transmit queue
+SPI_TX_QUERY = SPI_TX | SPI_QUERY
+# Link layer
+SPI_LINK_DISABLE = SPI_LINK | SPI_STATE_OFF
+SPI_LINK_ENABLE = SPI_LINK | SPI_STATE_ON
+SPI_LINK_QUERY = SPI_LINK | SPI_QUERY
+# Reliable delivery
+SPI_RELIABLE_SEND = SPI_RELIABLE | SPI_STATE_ON
+SPI_RELIABLE_QUERY = SPI_RELIABLE | SPI_QUERY
+# Mesh relaying
+SPI_RELAY_DISABLE = SPI_RELAY | SPI_STATE_OFF
+SPI_RELAY_ENABLE = SPI_RELAY | SPI_STATE_ON
+SPI_RELAY_QUERY = SPI_RELAY | SPI_QUERY
+# Coalescing short messages
+SPI_COALESCE_DISABLE = SPI_COALESCE | SPI_STATE_OFF
+SPI_COALESCE_ENABLE = SPI_COALESCE | SPI_STATE_ON
+SPI_COALESCE_QUERY = SPI_COALESCE | SPI_QUERY
+# Streaming received messages
+SPI_STREAM_DISABLE = SPI_STREAM | SPI_STATE_OFF
+SPI_STREAM_ENABLE = SPI_STREAM | SPI_STATE_ON
+SPI_STREAM_QUERY = SPI_STREAM | SPI_QUERY
+
+# Data rates
+RATE_1MBIT = 0x00
+RATE_2MBIT = 0x01
+RATE_250KBIT = 0x02
+
+# Outcomes of a reliable message
+LINK_PENDING = 0x00
+LINK_DELIVERED = 0x01
+LINK_FAILED = 0x02
+
+# Protocols
+SPI_PROTOCOL_LEGACY = 0x00
+SPI_PROTOCOL_FRAMED = 0x01
 
 # Responses
 SPI_NOCMD = 0x00
@@ -46,16 +135,72 @@ SPI_INVALID_LENGTH = 0x05
 SPI_REPLY_OVERFLOW = 0x06
 SPI_CHECKSUM_FAIL = 0x07
 SPI_INVALID_COMMAND = 0x08
+SPI_QUEUE_FULL = 0x09
 SPI_NO_MESSAGE = 0x10
 SPI_MESSAGE = 0x11
+SPI_STREAM_FRAME = 0x12
 SPI_PERIPH_BUSY = 0xF0
 SPI_OVERFLOW = 0xF1
 SPI_OTHER_FAIL = 0xFF
 
+# Size of the SPI buffers on the radio
+SPI_IOBUF_SIZE = 255
+
+# Names of the counters returned by SPI_STATS_QUERY, in order
+STATS_FIELDS = (
+    'commands',
+    'checksum_fails',
+    'invalid_commands',
+    'radio_sent',
+    'rx_dropped',
+    'spi_transactions',
+    'spi_busy',
+    'spi_dropped',
+    'spi_overflows',
+    'spi_overreads',
+    'forced_releases',
+    'filter_accepted',
+    'filter_dropped',
+)
+
+# Upper bound in microseconds of each latency histogram bucket, the last
+# bucket has no upper bound
+LATENCY_BUCKETS_US = (16, 32, 64, 128, 256, 512, 1024, None)
+
+# Size of the metadata in front of each received message when enabled
+RX_META_SIZE = 6
+
+# A received message along with its signal strength in dBm and the radio's
+# clock in microseconds when it arrived, and the address pipe it arrived on
+RxMessage = namedtuple('RxMessage', ('message', 'rssi', 'time', 'pipe'))
+
+# Number of receive address pipes
+RADIO_PIPES = 8
+
+def _u32(data, i):
+    """
+    Decode the little endian 32 bit value at data[i]
+    """
+    return data[i] | data[i+1] << 8 | data[i+2] << 16 | data[i+3] << 24
+
 class Radio:
-    def __init__(self, slave_select, spi):
+    def __init__(self, slave_select, spi, data_ready=None, framed=True):
+        """
+        data_ready is an optional input Pin wired to the radio's data ready
+        line. When given, replies and received messages are waited for on
+        the pin rather than by polling over SPI.
+
+        If framed is True, replies are read using the framed protocol when
+        the radio firmware supports it.
+        """
         self.slave_select = slave_select
         self.spi = spi
+        self.data_ready = data_ready
+        self._callback = None
+        self._in_write = False
+        self._drain_pending = False
+        self.framed = False
+        self.rx_meta = False
 
         # Wait for up to a second for the nRF to be ready
         time = millis() + 1000
@@ -70,31 +215,36 @@ class Radio:
         if success == False:
             raise RuntimeError("Unable to communicate with radio")
 
+        # Older firmware rejects the command and keeps the legacy framing
+        if framed:
+            r = self._command(SPI_PROTOCOL_SET, [SPI_PROTOCOL_FRAMED], 1)
+            self.framed = (r[0] == SPI_SUCCESS)
+
     def version(self):
         """
         Return version string
         """
-        response = self._write([SPI_VERSION])
+        response = self._command(SPI_VERSION)
         return bytes(self.read_packet(response)).decode('ascii').strip('\x00')
 
     def enable(self):
         """
         Enable the radio
         """
-        self._write([SPI_RADIO_STATE_ENABLE])
+        self._command(SPI_RADIO_STATE_ENABLE)
 
     def disable(self):
         """
         Disable the radio
         """
-        self._write([SPI_RADIO_STATE_DISABLE])
+        self._command(SPI_RADIO_STATE_DISABLE)
 
     def is_enabled(self):
         """
         Check if the radio is enabled.
         Return true if so, otherwise false
         """
-        response = self._write([SPI_RADIO_STATE_QUERY])
+        response = self._command(SPI_RADIO_STATE_QUERY)
         if response[0] == SPI_SUCCESS_AND_ENABLED:
             return True
         elif response[0] == SPI_SUCCESS_AND_DISABLED:
@@ -108,14 +258,14 @@ class Radio:
         """
         if not 0 <= channel <= 100:
             raise ValueError("%d is an invalid channel. Must be between 0 and 100 inclusive." % channel)
-        self._write([SPI_RADIO_CHAN_SET, 1, channel&0xff, channel&0xff])
+        self._command(SPI_RADIO_CHAN_SET, [channel])
 
     def get_channel(self):
         """
         Get the channel the radio broadcasts on.
         This is defined as 2400MHz + N, where N is between 0 and 100
         """
-        response = self._write([SPI_RADIO_CHAN_QUERY])
+        response = self._command(SPI_RADIO_CHAN_QUERY)
         return self.read_packet(response)[0]
 
     def set_power(self, power):
@@ -125,7 +275,7 @@ class Radio:
         from [-30, -20, -16, -12, -8, -4, 0, 4].
         """
         assert 0 <= power <= 7, 'Power must be between 0 and 7'
-        self._write([SPI_RADIO_POWER_SET, 1, power, power])
+        self._command(SPI_RADIO_POWER_SET, [power])
 
     def get_power(self):
         """
@@ -133,43 +283,629 @@ class Radio:
         This is a number between 0 and 7 that maps to powers on the nRF
         from [-30, -20, -16, -12, -8, -4, 0, 4].
         """
-        response = self._write([SPI_RADIO_POWER_QUERY])
+        response = self._command(SPI_RADIO_POWER_QUERY)
+        return self.read_packet(response)[0]
+
+    def set_rate(self, rate):
+        """
+        Set the over the air data rate to RATE_1MBIT, RATE_2MBIT or
+        RATE_250KBIT. Radios only hear each other at the same rate.
+        """
+        assert rate in (RATE_1MBIT, RATE_2MBIT, RATE_250KBIT), 'Unknown data rate'
+        r = self._command(SPI_RADIO_RATE_SET, [rate])
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def get_rate(self):
+        """
+        Get the over the air data rate, one of RATE_1MBIT, RATE_2MBIT or
+        RATE_250KBIT
+        """
+        response = self._command(SPI_RADIO_RATE_QUERY)
         return self.read_packet(response)[0]
 
+    def scan(self, first=0, count=101, dwell_us=1000):
+        """
+        Measure the energy on count channels from first, listening on each
+        for dwell_us microseconds. Return a list of the strongest signal
+        heard on each channel in dBm. The module rejects dwells longer than
+        its PYB_RADIO_SCAN_MAX_DWELL_US, 10000 by default, with ValueError.
+        One command scans at most PYB_RADIO_SCAN_MAX_US of channels, so the
+        rest are asked for in further commands, with the radio back on its
+        channel in between. Nothing is sent or received while a part is
+        scanned.
+        """
+        if first < 0 or count < 1 or first + count > 101:
+            raise ValueError("Channels must be between 0 and 100")
+        if not 0 <= dwell_us <= 0xffff:
+            raise ValueError("dwell_us is longer than the module allows")
+        energy = []
+        while len(energy) < count:
+            payload = [first + len(energy), count - len(energy),
+                       dwell_us & 0xff, (dwell_us >> 8) & 0xff]
+            r = self._command(SPI_RADIO_SCAN_CMD, payload, payload[1] + 3)
+            if r[0] == SPI_OUT_OF_RANGE:
+                raise ValueError("dwell_us is longer than the module allows")
+            data = self.read_packet(r)
+            if not data:
+                raise RuntimeError("Radio Error. Scan returned no channels")
+            energy.extend(-e for e in data)
+        return energy
+
+    def quietest_channel(self, first=0, count=101, dwell_us=1000):
+        """
+        Scan count channels from first and return the one with the least
+        energy on it, for set_channel
+        """
+        energy = self.scan(first, count, dwell_us)
+        return first + energy.index(min(energy))
+
     def is_message_available(self):
         """
         Check if a message has been received
         """
-        response = self._write([SPI_MSG_QUERY])
+        response = self._command(SPI_MSG_QUERY)
         if response[0] == SPI_MESSAGE:
             return True
         elif response[0] == SPI_NO_MESSAGE:
             return False
         return False
 
+    def queue_status(self):
+        """
+        Return a tuple of (number of messages waiting to be received,
+        number of messages dropped because the receive queue was full)
+        """
+        response = self._command(SPI_MSG_QUERY)
+        if response[0] not in (SPI_MESSAGE, SPI_NO_MESSAGE):
+            raise RuntimeError("Radio Error. Status Code 0x%x" % response[0])
+        data = self._unpack(response)
+        overflows = _u32(data, 1)
+        return data[0], overflows
+
+    def set_pipe(self, pipe, prefix, base=None):
+        """
+        Receive on address pipe 0 to 7, with the given address prefix. Pipe 0
+        is the radio group. Pipes 1 to 7 share a base address, which is only
+        changed if base is given, and otherwise receive further radio groups.
+        Packets to other addresses are ignored by the radio hardware.
+        """
+        payload = [pipe, prefix]
+        if base is not None:
+            payload += [base & 0xff, (base >> 8) & 0xff, (base >> 16) & 0xff, (base >> 24) & 0xff]
+        r = self._command(SPI_PIPE_SET, payload)
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def clear_pipe(self, pipe):
+        """
+        Stop receiving on an address pipe
+        """
+        r = self._command(SPI_PIPE_CLEAR, [pipe])
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def pipes(self):
+        """
+        Return a tuple of (dict of enabled pipe number to prefix, shared base
+        address of pipes 1 to 7)
+        """
+        r = self._command(SPI_PIPE_QUERY)
+        data = self.read_packet(r)
+        enabled = {}
+        for i in range(RADIO_PIPES):
+            if data[0] & (1 << i):
+                enabled[i] = data[1+i]
+        i = 1 + RADIO_PIPES
+        base = _u32(data, i)
+        return enabled, base
+
+    def subscribe(self, match, offset=0):
+        """
+        Only pass on received messages holding the bytes match at offset.
+        An offset of 0 matches a prefix. Messages matching any subscription
+        are received, and with no subscriptions every message is.
+        """
+        if isinstance(match, str):
+            match = match.encode()
+        payload = [offset] + list(match)
+        r = self._command(SPI_FILTER_ADD, payload)
+        if r[0] == SPI_OUT_OF_RANGE:
+            raise RuntimeError("Subscription table is full")
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def unsubscribe_all(self):
+        """
+        Remove every subscription, so that all messages are received
+        """
+        r = self._command(SPI_FILTER_CLEAR)
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def subscriptions(self):
+        """
+        Return the subscriptions as a list of (offset, match) tuples
+        """
+        r = self._command(SPI_FILTER_QUERY)
+        data = self.read_packet(r)
+        rules = []
+        i = 1
+        for _ in range(data[0]):
+            offset, length = data[i], data[i+1]
+            rules.append((offset, bytes(data[i+2:i+2+length])))
+            i += length + 2
+        return rules
+
+    def set_link(self, enable, node_id=None):
+        """
+        Turn the link layer on or off. While on, every frame carries a short
+        header with the sending node id, and messages longer than a single
+        frame are sent in fragments and reassembled by the receiving radio.
+        Both ends must have it on, so leave it off to talk to radios running
+        the stock micro:bit radio library. node_id defaults to one derived
+        from the radio's serial number.
+        """
+        if not enable:
+            r = self._command(SPI_LINK_DISABLE)
+        elif node_id is None:
+            r = self._command(SPI_LINK_ENABLE)
+        else:
+            r = self._command(SPI_LINK_ENABLE, [node_id & 0xff, (node_id >> 8) & 0xff])
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def link_status(self):
+        """
+        Return a dict of the link layer state: whether it is enabled, the
+        node id, and the number of messages reassembled, given up on before
+        all their fragments arrived, and frames discarded as malformed
+        """
+        r = self._command(SPI_LINK_QUERY)
+        data = self.read_packet(r)
+        status = {'enabled': bool(data[0]), 'node_id': data[1] | data[2] << 8}
+        for i, name in enumerate(('reassembled', 'incomplete', 'invalid')):
+            j = 3 + 4*i
+            status[name] = _u32(data, j)
+        return status
+
+    def set_relay(self, enable, hops=None, backoff_ms=None):
+        """
+        Turn mesh flooding on or off. While on, every message sent is
+        flooded through the network to travel up to hops hops, and the radio
+        relays other nodes' flooded messages by itself after a random wait of
+        up to backoff_ms. Each flooded message is received once. Requires
+        the link layer, and messages of at most 27 bytes. hops and
+        backoff_ms keep their last values when not given.
+        """
+        if not enable:
+            r = self._command(SPI_RELAY_DISABLE)
+        elif hops is None and backoff_ms is None:
+            r = self._command(SPI_RELAY_ENABLE)
+        else:
+            status = self.relay_status()
+            hops = status['hops'] if hops is None else hops
+            backoff_ms = status['backoff_ms'] if backoff_ms is None else backoff_ms
+            r = self._command(SPI_RELAY_ENABLE, [hops, backoff_ms])
+        if r[0] == SPI_INVALID_COMMAND:
+            raise RuntimeError("The link layer is off")
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def relay_status(self):
+        """
+        Return a dict of the relay settings and counters: whether it is on,
+        the hops and backoff, and the number of messages relayed, repeats
+        dropped, messages out of hops and messages dropped because the relay
+        queue was full
+        """
+        r = self._command(SPI_RELAY_QUERY)
+        data = self.read_packet(r)
+        status = {'enabled': bool(data[0]), 'hops': data[1], 'backoff_ms': data[2]}
+        for i, name in enumerate(('relayed', 'duplicates', 'ttl_expired', 'dropped')):
+            j = 3 + 4*i
+            status[name] = _u32(data, j)
+        return status
+
+    def set_coalesce(self, enable, window_us=None):
+        """
+        Turn coalescing on or off. While on, short messages sent close
+        together share radio frames, each waiting up to window_us
+        microseconds for others to join it. Requires the link layer on both
+        ends. window_us keeps its last value when not given.
+        """
+        if not enable:
+            r = self._command(SPI_COALESCE_DISABLE)
+        elif window_us is None:
+            r = self._command(SPI_COALESCE_ENABLE)
+        else:
+            r = self._command(SPI_COALESCE_ENABLE, [window_us & 0xff, (window_us >> 8) & 0xff])
+        if r[0] == SPI_INVALID_COMMAND:
+            raise RuntimeError("The link layer is off")
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def coalesce_status(self):
+        """
+        Return a dict of the coalescing settings and counters: whether it is
+        on, the window, and the number of shared frames sent, messages sent
+        in them and shared frames received
+        """
+        r = self._command(SPI_COALESCE_QUERY)
+        data = self.read_packet(r)
+        status = {'enabled': bool(data[0]), 'window_us': data[1] | data[2] << 8}
+        for i, name in enumerate(('batches_sent', 'batched_messages', 'batches_received')):
+            j = 3 + 4*i
+            status[name] = _u32(data, j)
+        return status
+
+    def send_reliable(self, node_id, message):
+        """
+        Queue a message of up to 26 bytes to be sent to one node, and resent
+        until that node acknowledges it. Requires the link layer on both
+        ends. Return its sequence number, which delivery() takes.
+        """
+        payload = [node_id & 0xff, (node_id >> 8) & 0xff] + list(bytearray(message))
+        r = self._command(SPI_RELIABLE_SEND, payload)
+        if r[0] == SPI_QUEUE_FULL:
+            raise RuntimeError("Transmit queue is full")
+        if r[0] == SPI_INVALID_COMMAND:
+            raise RuntimeError("The link layer is off")
+        return _u32(self.read_packet(r), 0)
+
+    def delivery(self, seq):
+        """
+        Return LINK_PENDING, LINK_DELIVERED or LINK_FAILED for the reliable
+        message seq, or None if the radio no longer remembers it
+        """
+        payload = [seq & 0xff, (seq >> 8) & 0xff, (seq >> 16) & 0xff, (seq >> 24) & 0xff]
+        r = self._command(SPI_RELIABLE_QUERY, payload)
+        if r[0] == SPI_OUT_OF_RANGE:
+            return None
+        return self.read_packet(r)[0]
+
+    def wait_delivered(self, seq, timeout=1000):
+        """
+        Wait for up to timeout ms for the reliable message seq to be
+        delivered or given up on. Return its outcome, which is LINK_PENDING
+        if the wait timed out.
+        """
+        time = millis() + timeout
+        while True:
+            outcome = self.delivery(seq)
+            if outcome != LINK_PENDING or millis() >= time:
+                return outcome
+            delay(1)
+
+    def reliable_stats(self):
+        """
+        Return a dict of the reliable delivery counters: messages delivered
+        and failed, resends, repeated frames dropped and acknowledgements
+        sent, and the number of messages waiting for an acknowledgement
+        """
+        r = self._command(SPI_RELIABLE_QUERY)
+        data = self.read_packet(r)
+        stats = {}
+        for i, name in enumerate(('delivered', 'failed', 'retransmits', 'duplicates', 'acks_sent')):
+            stats[name] = _u32(data, 4*i)
+        stats['waiting'] = data[20]
+        return stats
+
     def send(self, message):
-        # Convert the message to bytes
-        message = bytearray(message)
+        """
+        Queue a message to be sent. Return its sequence number, which
+        wait_sent() takes. The radio sends it in the background, in several
+        frames if it is too long for one and the link layer is enabled.
+        """
+        r = self._command(SPI_SEND_CMD, bytearray(message))
+        if r[0] == SPI_QUEUE_FULL:
+            raise RuntimeError("Transmit queue is full")
+        return _u32(self.read_packet(r), 0)
 
-        # Calculate the checksum
-        chk = 0
-        for c in message:
-            chk ^= c
+    def tx_status(self):
+        """
+        Return a dict of the transmit queue counters: messages queued,
+        completed, sent and failed, sends refused because the queue was
+        full, and the number still waiting
+        """
+        r = self._command(SPI_TX_QUERY)
+        data = self.read_packet(r)
+        status = {}
+        for i, name in enumerate(('queued', 'completed', 'sent', 'failed', 'full')):
+            status[name] = _u32(data, 4*i)
+        status['waiting'] = data[20]
+        return status
+
+    def wait_sent(self, seq, timeout=1000):
+        """
+        Wait for up to timeout ms for message seq, as returned by send(),
+        to be handed to the radio. Return True if it was.
+        """
+        time = millis() + timeout
+        while (self.tx_status()['completed'] - seq - 1) & 0x80000000:
+            if millis() >= time:
+                return False
+            delay(1)
+        return True
+
+    def send_many(self, messages):
+        """
+        Send a list of messages in a single transaction.
+        Return a list of booleans, True for each message that was queued.
+        """
+        if not messages:
+            return []
+        payload = bytearray()
+        for message in messages:
+            message = bytearray(message)
+            payload.append(len(message))
+            payload.extend(message)
+        if len(payload) > SPI_IOBUF_SIZE - 4:
+            raise ValueError("Messages too long to send at once")
+
+        r = self._command(SPI_SEND_MANY_CMD, payload)
+        bitmap = self.read_packet(r)
+        return [bool(bitmap[i // 8] & (1 << (i % 8))) for i in range(len(messages))]
+
+    def stats(self):
+        """
+        Return a dict of the radio's performance counters, counted since
+        startup or the last reset_stats(). Counters added by newer firmware
+        are named by index.
+        """
+        r = self._command(SPI_STATS_QUERY)
+        data = self.read_packet(r)
+        stats = {}
+        for i in range(len(data) // 4):
+            value = _u32(data, 4*i)
+            name = STATS_FIELDS[i] if i < len(STATS_FIELDS) else 'counter_%d' % i
+            stats[name] = value
+        return stats
+
+    def reset_stats(self):
+        """
+        Zero the radio's performance counters
+        """
+        r = self._command(SPI_STATS_RESET)
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def latency(self):
+        """
+        Return the radio's command latency histograms, as a dict from
+        command opcode to a tuple of (largest latency in us, list of
+        counts for each bucket in LATENCY_BUCKETS_US).
+        """
+        r = self._command(SPI_LATENCY_QUERY)
+        histograms = {}
+        for cmd in self.read_packet(r):
+            r = self._command(SPI_LATENCY_QUERY, [cmd])
+            if r[0] == SPI_OUT_OF_RANGE:
+                continue
+            data = self.read_packet(r)
+            values = [data[i] | data[i+1] << 8 for i in range(0, len(data), 2)]
+            histograms[cmd] = (values[0], values[1:])
+        return histograms
+
+    def reset_latency(self):
+        """
+        Empty the radio's command latency histograms
+        """
+        r = self._command(SPI_LATENCY_RESET)
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def trace_enable(self, enable=True):
+        """
+        Pause or resume the radio's event trace. Only available in firmware
+        built with PYB_RADIO_TRACE.
+        """
+        r = self._command(SPI_TRACE_ENABLE if enable else SPI_TRACE_DISABLE)
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+
+    def trace_dump(self):
+        """
+        Pause the event trace and read out every record it holds, oldest
+        first. Returns the raw records, which tools/trace_decode.py turns
+        into a timeline. Recording stays paused until trace_enable().
+        """
+        self.trace_enable(False)
+        records = bytearray()
+        start = 0
+        while True:
+            payload = [start & 0xff, (start >> 8) & 0xff, (start >> 16) & 0xff, (start >> 24) & 0xff]
+            r = self._command(SPI_TRACE_QUERY, payload, SPI_IOBUF_SIZE)
+            data = self.read_packet(r)
+            first = _u32(data, 0)
+            end = _u32(data, 4)
+            records.extend(data[8:])
+            start = first + (len(data) - 8) // 8
+            if len(data) == 8 or start >= end:
+                return bytes(records)
+
+    def set_rx_metadata(self, enable):
+        """
+        Turn on or off the RSSI and receive time of each message. While on,
+        receive and receive_many return RxMessage tuples instead of strings.
+        """
+        r = self._command(SPI_RX_META_ENABLE if enable else SPI_RX_META_DISABLE)
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
+        self.rx_meta = bool(enable)
+
+    def _message(self, meta, data):
+        message = bytes(data).decode()
+        if not self.rx_meta:
+            return message
+        rssi = meta[0] - 256 if meta[0] > 127 else meta[0]
+        time = _u32(meta, 1)
+        return RxMessage(message, rssi, time, meta[5])
+
+    def set_stream(self, enable):
+        """
+        Turn sniffing on or off. While on, the radio queues every frame it
+        hears, bypassing the link layer and the receive filter, and every
+        SPI transaction reads the queued messages in a single stream frame
+        with read_stream. Other commands still work in between.
+        """
+        r = self._command(SPI_STREAM_ENABLE if enable else SPI_STREAM_DISABLE)
+        if r[0] != SPI_SUCCESS:
+            raise RuntimeError("Radio Error. Status Code 0x%x" % r[0])
 
-        # Compile the message
-        self._write([SPI_SEND_CMD, len(message)] + list(message) + [chk])
+    def read_stream(self):
+        """
+        Read one stream frame while sniffing. Return the number of messages
+        the radio dropped since the last frame because its queue was full,
+        the number still queued, and a list of RxMessage holding the raw
+        bytes of each message. An empty list comes back if the radio was
+        busy.
+        """
+        header = bytearray(2)
+        self.slave_select.value(0)
+        self.spi.readinto(header, 0x00)
+        if header[0] != SPI_STREAM_FRAME:
+            self.slave_select.value(1)
+            return 0, 0, []
+        # Reading the whole frame in the same transaction takes it off the queue
+        data = bytearray(header[1] + 3)
+        data[0:2] = header
+        self.spi.readinto(memoryview(data)[2:], 0x00)
+        self.slave_select.value(1)
+
+        frame = self._unpack(data)
+        dropped = frame[0] | frame[1] << 8
+        messages = []
+        i = 3
+        while i < len(frame):
+            length = frame[i]
+            meta = frame[i+1:i+1+RX_META_SIZE]
+            rssi = meta[0] - 256 if meta[0] > 127 else meta[0]
+            time = _u32(meta, 1)
+            start = i + 1 + RX_META_SIZE
+            messages.append(RxMessage(bytes(frame[start:start+length]), rssi, time, meta[5]))
+            i = start + length
+        return dropped, frame[2], messages
+
+    def stream_status(self):
+        """
+        Return a dict of whether sniffing is on, and the number of stream
+        frames read, messages in them and messages dropped while sniffing
+        """
+        r = self._command(SPI_STREAM_QUERY)
+        data = self.read_packet(r)
+        status = {'enabled': bool(data[0])}
+        for i, name in enumerate(('frames', 'messages', 'dropped')):
+            j = 1 + 4*i
+            status[name] = _u32(data, j)
+        return status
 
     def receive(self):
         """
         Receive a message
         """
-        r = self._write([SPI_RECV_CMD])
+        r = self._command(SPI_RECV_CMD, reply_len=SPI_IOBUF_SIZE)
         data = self.read_packet(r)
         if data is not None:
-            return bytes(data).decode()
+            if self.rx_meta:
+                return self._message(data[:RX_META_SIZE], data[RX_META_SIZE:])
+            return self._message(None, data)
         return data
 
-    def _write(self, data):
+    def receive_many(self, max_bytes=SPI_IOBUF_SIZE):
+        """
+        Receive as many waiting messages as fit in a reply of max_bytes
+        bytes, in a single transaction. Return a list of messages, which
+        is empty if none are waiting.
+        """
+        if not 4 <= max_bytes <= SPI_IOBUF_SIZE:
+            raise ValueError("max_bytes must be between 4 and %d" % SPI_IOBUF_SIZE)
+        r = self._command(SPI_RECV_MANY_CMD, [max_bytes], max_bytes)
+        data = self.read_packet(r)
+        messages = []
+        if data is None:
+            return messages
+        meta = RX_META_SIZE if self.rx_meta else 0
+        i = 0
+        while i < len(data):
+            length = data[i]
+            start = i + 1 + meta
+            messages.append(self._message(data[i+1:start], data[start:start+length]))
+            i = start + length
+        return messages
+
+    def wait(self, timeout=1000):
+        """
+        Wait for up to timeout ms for the radio to raise data ready.
+        Return True if it did. Requires the data_ready pin.
+        """
+        if self.data_ready is None:
+            raise RuntimeError("No data ready pin")
+        time = millis() + timeout
+        while not self.data_ready.value():
+            if millis() >= time:
+                return False
+        return True
+
+    def on_receive(self, callback):
+        """
+        Call callback with each message as it arrives, driven by the data
+        ready interrupt, so no SPI traffic is needed while the link is idle.
+        Pass None to stop. Requires the data_ready pin.
+        """
+        if self.data_ready is None:
+            raise RuntimeError("No data ready pin")
+        self._callback = callback
+        if callback is None:
+            self.data_ready.irq(handler=None)
+            return
+        self.data_ready.irq(trigger=Pin.IRQ_RISING, handler=self._data_ready_irq)
+        # Pick up anything that arrived before the interrupt was set up
+        self._drain(None)
+
+    def _data_ready_irq(self, pin):
+        micropython.schedule(self._drain, None)
+
+    def _drain(self, arg):
+        # Don't interrupt a transaction in progress, finish it first
+        if self._in_write:
+            self._drain_pending = True
+            return
+        while self._callback is not None and self.data_ready.value():
+            messages = self.receive_many()
+            if not messages:
+                break
+            for message in messages:
+                self._callback(message)
+
+    def _command(self, cmd, payload=None, reply_len=64):
+        """
+        Send command cmd and return its reply. A payload, a sequence of
+        bytes, is sent after its length and followed by its XOR checksum,
+        otherwise cmd is sent alone.
+        """
+        if payload is None:
+            return self._write([cmd], reply_len)
+        chk = 0
+        for c in payload:
+            chk ^= c
+        return self._write([cmd, len(payload)] + list(payload) + [chk], reply_len)
+
+    def _write(self, data, reply_len=64):
+        self._in_write = True
+        try:
+            return self._transfer(data, reply_len)
+        finally:
+            self._in_write = False
+            if self._drain_pending:
+                self._drain_pending = False
+                micropython.schedule(self._drain, None)
+
+    def _transfer(self, data, reply_len):
+        """
+        Write a command and read its reply. reply_len is only used by the
+        legacy protocol, the framed protocol reads exactly the reply.
+        """
         data = bytearray(data)
         resp = bytearray(len(data))
 
@@ -183,6 +919,14 @@ class Radio:
             self.spi.write_readinto(data, resp)
         self.slave_select.value(1)
 
+        # Wait until the radio says the reply is ready, falling back to
+        # polling below if it doesn't say so in time
+        if self.data_ready is not None:
+            self.wait(10)
+
+        if self.framed:
+            return self._read_framed()
+
         # Wait until the radio is ready to respond
         self.slave_select.value(0)
         resp = self.spi.read(1, 0x00)[0]
@@ -193,7 +937,7 @@ class Radio:
             resp = self.spi.read(1, 0x00)[0]
 
         # Read the response from the radio
-        data = bytearray(64)
+        data = bytearray(reply_len)
         self.spi.readinto(data, 0x00)
         self.slave_select.value(1)
 
@@ -203,6 +947,27 @@ class Radio:
 
         return data
 
+    def _read_framed(self):
+        # Poll the status and length until the reply is ready
+        header = bytearray(2)
+        self.slave_select.value(0)
+        self.spi.readinto(header, 0x00)
+        while header[0] == SPI_PERIPH_BUSY:
+            self.slave_select.value(1)
+            udelay(100)
+            self.slave_select.value(0)
+            self.spi.readinto(header, 0x00)
+
+        # Then clock out exactly the data and checksum in the same transaction
+        if header[1] == 0:
+            self.slave_select.value(1)
+            return header
+        data = bytearray(header[1] + 3)
+        data[0:2] = header
+        self.spi.readinto(memoryview(data)[2:], 0x00)
+        self.slave_select.value(1)
+        return data
+
     def read_packet(self, packet):
         # Check for error codes
         status_code = packet[0]
@@ -212,6 +977,9 @@ class Radio:
         if status_code == SPI_NO_MESSAGE:
             return None
 
+        return self._unpack(packet)
+
+    def _unpack(self, packet):
         # Get the data out of the packet
         length = packet[1]
         if length == 0:
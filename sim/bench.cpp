@@ -0,0 +1,472 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Protocol throughput and latency benchmark.
+ *
+ * Replays command mixes against the simulated module through the same
+ * write/poll/read sequence that Radio._write uses, and reports commands per
+ * second, payload bytes per second and per-command latency percentiles as
+ * JSON on stdout. Runs use the legacy reply framing unless "framed" is given,
+ * in which case commands are issued with sim_command_framed. The radio runs
+ * at the given data rate, 1 Mbit/s by default, and the payload throughput
+ * the air allows at that rate is reported alongside, as is the throughput
+ * over simulated time. Frames are lost on the air with the given probability,
+ * 0 by default, which the reliable mix is meant to be run against. The
+ * send_small and coalesce mixes send the same very short packets, without
+ * and with coalescing, to compare the air throughput of the two.
+ *
+ * Usage: bench [commands per mix] [mix name|all] [legacy|framed] [1m|2m|250k]
+ *              [loss probability]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "mbed.h"
+#include "SPIRadioCmds.h"
+#include "SPISlaveExt.h"
+#include "RadioLink.h"
+#include "sim_api.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// How commands are issued, sim_command or sim_command_framed
+static int (*command)(const uint8_t *cmd, uint32_t len, uint8_t *reply, uint32_t reply_len) =
+    sim_command;
+
+/**
+ * Results of running one mix
+ */
+struct bench_result_t {
+    const char *name;
+    uint32_t commands;
+    uint64_t payload_bytes;
+    uint64_t spi_bytes;
+    uint64_t air_us;
+    uint64_t sim_us;
+    double seconds;
+    std::vector<uint32_t> latency_ns;
+};
+
+/**
+ * Build a framed command with a payload, as Radio.send does
+ */
+static uint32_t frame(uint8_t *buf, uint8_t cmd, const uint8_t *payload, uint8_t len) {
+    uint8_t chk = 0;
+    buf[0] = cmd;
+    buf[1] = len;
+    for (uint8_t i = 0; i < len; i += 1) {
+        buf[2+i] = payload[i];
+        chk ^= payload[i];
+    }
+    buf[2+len] = chk;
+    return len + 3;
+}
+
+/**
+ * Read a little endian uint32 from a reply
+ */
+static uint32_t get_u32(const uint8_t *buf) {
+    return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+/**
+ * A realistic short sensor reading
+ */
+static uint8_t random_payload(uint8_t *buf, uint8_t min_len, uint8_t max_len) {
+    uint8_t len = min_len + rand() % (max_len - min_len + 1);
+    for (uint8_t i = 0; i < len; i += 1)
+        buf[i] = 'A' + rand() % 26;
+    return len;
+}
+
+/**
+ * Time a single command
+ */
+static void timed_command(bench_result_t &result, const uint8_t *cmd, uint32_t len,
+        uint8_t *reply, uint32_t reply_len) {
+    bench_clock::time_point start = bench_clock::now();
+    command(cmd, len, reply, reply_len);
+    bench_clock::time_point end = bench_clock::now();
+    result.latency_ns.push_back((uint32_t)
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    result.commands += 1;
+}
+
+/**
+ * Empty the receive queue and the air between mixes
+ */
+static void drain(void) {
+    uint8_t cmd = SPI_RECV_CMD, reply[64];
+    do {
+        command(&cmd, 1, reply, sizeof(reply));
+    } while (reply[0] == SPI_SUCCESS);
+    while (sim_radio_take(reply, sizeof(reply)) >= 0);
+}
+
+/**
+ * Mostly sends of short packets, with the odd check for incoming messages
+ */
+static void mix_send_heavy(bench_result_t &result, uint32_t n) {
+    uint8_t payload[32], cmd[SPI_IOBUF_SIZE], reply[64];
+    for (uint32_t i = 0; i < n; i += 1) {
+        if (i % 10 == 9) {
+            cmd[0] = SPI_MSG_QUERY;
+            timed_command(result, cmd, 1, reply, sizeof(reply));
+            continue;
+        }
+        uint8_t len = random_payload(payload, 4, 29);
+        uint32_t cmd_len = frame(cmd, SPI_SEND_CMD, payload, len);
+        timed_command(result, cmd, cmd_len, reply, sizeof(reply));
+        result.payload_bytes += len;
+    }
+}
+
+/**
+ * A steady stream of incoming packets, each fetched with SPI_RECV_CMD
+ */
+static void mix_receive_heavy(bench_result_t &result, uint32_t n) {
+    uint8_t payload[32], cmd[1] = {SPI_RECV_CMD}, reply[64];
+    for (uint32_t i = 0; i < n; i += 1) {
+        uint8_t len = random_payload(payload, 4, 29);
+        sim_radio_deliver(payload, len, -60);
+        timed_command(result, cmd, 1, reply, sizeof(reply));
+        if (reply[0] == SPI_SUCCESS)
+            result.payload_bytes += reply[1];
+    }
+}
+
+/**
+ * The pyboard main loop: poll SPI_MSG_QUERY until something arrives, then
+ * fetch it. A packet arrives every eight polls.
+ */
+static void mix_query_poll(bench_result_t &result, uint32_t n) {
+    uint8_t payload[32], cmd[1], reply[64];
+    for (uint32_t i = 0; i < n; i += 1) {
+        if (i % 8 == 7) {
+            uint8_t len = random_payload(payload, 4, 29);
+            sim_radio_deliver(payload, len, -60);
+        }
+        cmd[0] = SPI_MSG_QUERY;
+        timed_command(result, cmd, 1, reply, sizeof(reply));
+        if (reply[0] != SPI_MESSAGE)
+            continue;
+        cmd[0] = SPI_RECV_CMD;
+        timed_command(result, cmd, 1, reply, sizeof(reply));
+        if (reply[0] == SPI_SUCCESS)
+            result.payload_bytes += reply[1];
+    }
+}
+
+/**
+ * Bursts of incoming packets, drained with SPI_RECV_MANY_CMD
+ */
+static void mix_receive_many(bench_result_t &result, uint32_t n) {
+    uint8_t payload[32], cmd[1] = {SPI_RECV_MANY_CMD}, reply[SPI_IOBUF_SIZE];
+    for (uint32_t i = 0; i < n; i += 1) {
+        // The module's main loop takes each frame off the radio as it comes
+        for (int j = 0; j < 8; j += 1) {
+            uint8_t len = random_payload(payload, 4, 29);
+            sim_radio_deliver(payload, len, -60);
+            sim_run();
+        }
+        timed_command(result, cmd, 1, reply, sizeof(reply));
+        if (reply[0] != SPI_SUCCESS)
+            continue;
+        for (uint32_t j = 0; j < reply[1]; j += reply[2+j] + 1)
+            result.payload_bytes += reply[2+j];
+    }
+}
+
+/**
+ * The same bursts as receive_many, sniffed in stream mode, where each
+ * transaction reads a whole stream frame without sending a command
+ */
+static void mix_stream(bench_result_t &result, uint32_t n) {
+    uint8_t payload[32], cmd[1] = {SPI_STREAM_ENABLE}, reply[SPI_IOBUF_SIZE];
+    command(cmd, 1, reply, sizeof(reply));
+    for (uint32_t i = 0; i < n; i += 1) {
+        // The module's main loop takes each frame off the radio as it comes
+        for (int j = 0; j < 8; j += 1) {
+            uint8_t len = random_payload(payload, 4, 29);
+            sim_radio_deliver(payload, len, -60);
+            sim_run();
+        }
+        bench_clock::time_point start = bench_clock::now();
+        sim_spi_transfer(NULL, reply, sizeof(reply));
+        sim_run();
+        bench_clock::time_point end = bench_clock::now();
+        result.latency_ns.push_back((uint32_t)
+                std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        result.commands += 1;
+        if (reply[0] != SPI_STREAM_FRAME)
+            continue;
+        for (uint32_t j = 3; j < reply[1]; j += reply[2+j] + 1 + 6)
+            result.payload_bytes += reply[2+j];
+    }
+    // Leave stream mode and what it left queued
+    cmd[0] = SPI_STREAM_DISABLE;
+    command(cmd, 1, reply, sizeof(reply));
+}
+
+/**
+ * Short packets sent eight at a time with SPI_SEND_MANY_CMD
+ */
+static void mix_send_many(bench_result_t &result, uint32_t n) {
+    uint8_t list[SPI_IOBUF_SIZE], cmd[SPI_IOBUF_SIZE], reply[64];
+    for (uint32_t i = 0; i < n; i += 1) {
+        uint32_t len = 0;
+        for (int j = 0; j < 8; j += 1) {
+            list[len] = random_payload(list+len+1, 4, 16);
+            result.payload_bytes += list[len];
+            len += list[len] + 1;
+        }
+        uint32_t cmd_len = frame(cmd, SPI_SEND_MANY_CMD, list, (uint8_t) len);
+        timed_command(result, cmd, cmd_len, reply, sizeof(reply));
+    }
+}
+
+/**
+ * Put a frame from the bench's peer node on the air
+ */
+static int peer_transmit(uint8_t *frame, int length) {
+    sim_radio_deliver(frame, (uint32_t) length, -60);
+    return MICROBIT_OK;
+}
+
+// Another node, for the module to send reliable messages to
+static RadioLink peer(peer_transmit);
+static const uint16_t PEER_NODE = 0x0002;
+
+/**
+ * Let a millisecond of simulated time pass: hand the peer the module's
+ * frames, let it acknowledge them and let the module resend. Return the
+ * number of message bytes the peer received.
+ */
+static uint32_t peer_step(void) {
+    uint8_t frame[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    const uint8_t *msg;
+    uint32_t now = (uint32_t) (sim_time_us() / 1000), bytes = 0;
+    int len;
+    while ((len = sim_radio_take(frame, sizeof(frame))) >= 0) {
+        len = peer.input(frame, (uint8_t) len, &msg, now);
+        if (len > 0)
+            bytes += len;
+    }
+    peer.poll(now);
+    sim_run();
+    sim_advance_us(1000);
+    return bytes;
+}
+
+/**
+ * Short packets sent reliably to the peer, counting only the bytes it
+ * receives, each once, until every message is delivered or given up on
+ */
+static void mix_reliable(bench_result_t &result, uint32_t n) {
+    uint8_t payload[2+LINK_RELIABLE_DATA], cmd[SPI_IOBUF_SIZE], reply[64];
+    uint8_t link_cmd[1] = {SPI_LINK_ENABLE};
+    command(link_cmd, 1, reply, sizeof(reply));
+    peer.enable(1);
+    peer.set_node_id(PEER_NODE);
+
+    payload[0] = (uint8_t) PEER_NODE;
+    payload[1] = (uint8_t) (PEER_NODE >> 8);
+    for (uint32_t i = 0; i < n; i += 1) {
+        uint8_t len = random_payload(payload+2, 4, LINK_RELIABLE_DATA);
+        uint32_t cmd_len = frame(cmd, SPI_RELIABLE_SEND, payload, len+2);
+        timed_command(result, cmd, cmd_len, reply, sizeof(reply));
+        while (reply[0] == SPI_QUEUE_FULL) {
+            result.payload_bytes += peer_step();
+            timed_command(result, cmd, cmd_len, reply, sizeof(reply));
+        }
+        result.payload_bytes += peer_step();
+    }
+    // Wait for the window to empty
+    cmd[0] = SPI_RELIABLE_QUERY;
+    do {
+        result.payload_bytes += peer_step();
+        command(cmd, 1, reply, sizeof(reply));
+    } while (reply[0] == SPI_SUCCESS && reply[2+20] != 0);
+
+    link_cmd[0] = SPI_LINK_DISABLE;
+    command(link_cmd, 1, reply, sizeof(reply));
+}
+
+/**
+ * Very short packets sent one at a time over the link layer, coalesced into
+ * shared frames or not, then waiting out the window for the last ones
+ */
+static void send_small(bench_result_t &result, uint32_t n, int coalesce) {
+    uint8_t payload[8], cmd[SPI_IOBUF_SIZE], reply[64];
+    uint8_t link_cmd[1] = {SPI_LINK_ENABLE};
+    command(link_cmd, 1, reply, sizeof(reply));
+    if (coalesce) {
+        link_cmd[0] = SPI_COALESCE_ENABLE;
+        command(link_cmd, 1, reply, sizeof(reply));
+    }
+
+    for (uint32_t i = 0; i < n; i += 1) {
+        uint8_t len = random_payload(payload, 4, 8);
+        uint32_t cmd_len = frame(cmd, SPI_SEND_CMD, payload, len);
+        timed_command(result, cmd, cmd_len, reply, sizeof(reply));
+        if (reply[0] == SPI_SUCCESS)
+            result.payload_bytes += len;
+        while (sim_radio_take(reply, sizeof(reply)) >= 0);
+    }
+    // Nothing polls the module now, so the last batch only goes out if the
+    // module wakes itself when the window closes
+    sim_advance_us(LINK_DEFAULT_COALESCE_US);
+    while (sim_radio_take(reply, sizeof(reply)) >= 0);
+    uint8_t query[1] = {SPI_TX_QUERY};
+    command(query, 1, reply, sizeof(reply));
+    uint32_t queued = get_u32(reply+2), completed = get_u32(reply+6);
+    if (queued != completed)
+        fprintf(stderr, "bench: %u messages still waiting after the coalescing window\n",
+                queued - completed);
+
+    link_cmd[0] = SPI_LINK_DISABLE;
+    command(link_cmd, 1, reply, sizeof(reply));
+}
+
+static void mix_send_small(bench_result_t &result, uint32_t n) {
+    send_small(result, n, 0);
+}
+
+static void mix_coalesce(bench_result_t &result, uint32_t n) {
+    send_small(result, n, 1);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(bench_result_t &result, uint32_t n);
+} mixes[] = {
+    {"send_heavy", mix_send_heavy},
+    {"receive_heavy", mix_receive_heavy},
+    {"query_poll", mix_query_poll},
+    {"receive_many", mix_receive_many},
+    {"stream", mix_stream},
+    {"send_many", mix_send_many},
+    {"reliable", mix_reliable},
+    {"send_small", mix_send_small},
+    {"coalesce", mix_coalesce},
+};
+
+static uint32_t percentile(std::vector<uint32_t> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = (size_t) (p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+static void report(bench_result_t &result, int first) {
+    std::sort(result.latency_ns.begin(), result.latency_ns.end());
+    printf("%s  {\"mix\": \"%s\", \"commands\": %u, \"seconds\": %.6f, "
+           "\"commands_per_sec\": %.1f, \"payload_bytes_per_sec\": %.1f, "
+           "\"spi_bytes_per_command\": %.1f, \"air_payload_bytes_per_sec\": %.1f, "
+           "\"sim_payload_bytes_per_sec\": %.1f, "
+           "\"latency_ns\": {\"p50\": %u, \"p99\": %u, \"max\": %u}}",
+           first ? "" : ",\n",
+           result.name, result.commands, result.seconds,
+           result.commands / result.seconds,
+           result.payload_bytes / result.seconds,
+           (double) result.spi_bytes / result.commands,
+           result.air_us ? result.payload_bytes * 1e6 / result.air_us : 0.0,
+           result.sim_us ? result.payload_bytes * 1e6 / result.sim_us : 0.0,
+           percentile(result.latency_ns, 0.50),
+           percentile(result.latency_ns, 0.99),
+           result.latency_ns.empty() ? 0 : result.latency_ns.back());
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 0) : 100000;
+    const char *only = argc > 2 && strcmp(argv[2], "all") != 0 ? argv[2] : NULL;
+    int first = 1;
+
+    sim_init();
+    srand(1);
+
+    if (argc > 3 && strcmp(argv[3], "framed") == 0) {
+        uint8_t cmd[4], reply[4], mode = SPI_PROTOCOL_FRAMED;
+        uint32_t len = frame(cmd, SPI_PROTOCOL_SET, &mode, 1);
+        sim_command(cmd, len, reply, 1);
+        if (reply[0] != SPI_SUCCESS) {
+            fprintf(stderr, "Unable to select the framed protocol\n");
+            return 1;
+        }
+        command = sim_command_framed;
+    }
+
+    if (argc > 4) {
+        uint8_t cmd[4], reply[4], rate;
+        if (strcmp(argv[4], "2m") == 0)
+            rate = SPI_RADIO_RATE_2MBIT;
+        else if (strcmp(argv[4], "250k") == 0)
+            rate = SPI_RADIO_RATE_250KBIT;
+        else
+            rate = SPI_RADIO_RATE_1MBIT;
+        uint32_t len = frame(cmd, SPI_RADIO_RATE_SET, &rate, 1);
+        command(cmd, len, reply, 4);
+        if (reply[0] != SPI_SUCCESS) {
+            fprintf(stderr, "Unable to set the data rate\n");
+            return 1;
+        }
+    }
+
+    if (argc > 5)
+        sim_radio_set_loss(strtod(argv[5], NULL), 1);
+
+    printf("[\n");
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i += 1) {
+        if (only && strcmp(only, mixes[i].name) != 0)
+            continue;
+        bench_result_t result;
+        result.name = mixes[i].name;
+        result.commands = 0;
+        result.payload_bytes = 0;
+        result.latency_ns.reserve(2 * n);
+
+        drain();
+        uint64_t spi_start = sim_spi_bytes();
+        uint64_t air_start = sim_radio_airtime_us();
+        uint64_t sim_start = sim_time_us();
+        bench_clock::time_point start = bench_clock::now();
+        mixes[i].run(result, n);
+        bench_clock::time_point end = bench_clock::now();
+        result.seconds = std::chrono::duration<double>(end - start).count();
+        result.spi_bytes = sim_spi_bytes() - spi_start;
+        result.air_us = sim_radio_airtime_us() - air_start;
+        result.sim_us = sim_time_us() - sim_start;
+
+        report(result, first);
+        first = 0;
+    }
+    printf("\n]\n");
+    return 0;
+}
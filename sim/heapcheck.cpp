@@ -0,0 +1,92 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Check that the steady state receive path makes no heap allocations.
+ *
+ * Delivers packets over the air and fetches them with SPI_RECV_CMD and
+ * SPI_RECV_MANY_CMD, including while the receive queue is overflowing, and
+ * fails if the heap was touched after a warm up period.
+ *
+ * Usage: heapcheck [packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mbed.h"
+#include "SPIRadioCmds.h"
+#include "SPISlaveExt.h"
+#include "sim_api.h"
+
+/**
+ * Deliver a burst of packets, then read them back
+ */
+static void receive_cycle(uint32_t i) {
+    uint8_t payload[32], reply[SPI_IOBUF_SIZE];
+    uint8_t recv = SPI_RECV_CMD, recv_many = SPI_RECV_MANY_CMD;
+
+    // Every fourth burst is big enough to overflow the queue
+    uint32_t burst = (i % 4 == 3) ? 16 : 3;
+    for (uint32_t j = 0; j < burst; j += 1) {
+        uint8_t len = 1 + (i + j) % sizeof(payload);
+        for (uint8_t k = 0; k < len; k += 1)
+            payload[k] = (uint8_t) (i + k);
+        sim_radio_deliver(payload, len, -60);
+        // Let the main loop take it off the radio, so that it is the
+        // module's own queue that overflows
+        sim_run();
+    }
+
+    if (i % 2) {
+        sim_command(&recv_many, 1, reply, sizeof(reply));
+    } else {
+        do {
+            sim_command(&recv, 1, reply, 64);
+        } while (reply[0] == SPI_SUCCESS);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 0) : 10000;
+
+    sim_init();
+
+    // Let anything allocated once on first use happen
+    for (uint32_t i = 0; i < 8; i += 1)
+        receive_cycle(i);
+
+    uint32_t before = sim_heap_allocations();
+    for (uint32_t i = 0; i < n; i += 1)
+        receive_cycle(i);
+    uint32_t allocations = sim_heap_allocations() - before;
+
+    printf("{\"cycles\": %u, \"allocations\": %u, \"live\": %u}\n",
+           n, allocations, sim_heap_live());
+    if (allocations != 0) {
+        fprintf(stderr, "heapcheck: receive path allocated %u times\n", allocations);
+        return 1;
+    }
+    return 0;
+}
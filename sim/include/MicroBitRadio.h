@@ -0,0 +1,2 @@
+// Forwarding header, the simulated DAL lives in sim_dal.h
+#include "sim_dal.h"
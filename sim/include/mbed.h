@@ -0,0 +1,93 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Host stand-in for the parts of mbed used by the firmware.
+ */
+
+#ifndef SIM_MBED_H
+#define SIM_MBED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "sim_nrf.h"
+
+typedef enum {
+    P0_0 = 0, P0_1, P0_2, P0_3, P0_4, P0_5, P0_6, P0_7,
+    P0_8, P0_9, P0_10, P0_11, P0_12, P0_13, P0_14, P0_15,
+    P0_16, P0_17, P0_18, P0_19, P0_20, P0_21, P0_22, P0_23,
+    P0_24, P0_25, P0_26, P0_27, P0_28, P0_29, P0_30, P0_31,
+    NC = -1
+} PinName;
+
+typedef struct {
+    NRF_SPIS_Type *spis;
+} spi_t;
+
+/**
+ * mbed SPISlave, bound to the simulated SPIS1 peripheral
+ */
+class SPISlave {
+    public:
+        SPISlave(PinName mosi, PinName miso, PinName sclk, PinName ssel);
+        void format(int bits, int mode = 0);
+        void frequency(int hz = 1000000);
+        int receive(void);
+        int read(void);
+        void reply(int value);
+
+    protected:
+        spi_t _spi;
+};
+
+/**
+ * mbed Timeout, firing in interrupt context once sim_advance_us takes
+ * simulated time past its deadline
+ */
+class Timeout {
+    public:
+        Timeout();
+        ~Timeout();
+        void attach_us(void (*fptr)(void), uint32_t t);
+        void detach(void);
+
+        // Simulation only: run the handlers of every timeout due by now
+        static void fire_due(uint64_t now);
+        // The time the next timeout is due, or UINT64_MAX if none are armed
+        static uint64_t next_due(void);
+
+    private:
+        void (*handler)(void);
+        uint64_t deadline;
+        Timeout *next;
+};
+
+// Low power wait for an event. Events in the simulation happen synchronously
+// so there is never anything to wait for.
+static inline void sleep(void) {}
+void wait_us(int us);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Host stand-in for the parts of microbit-dal used by the firmware.
+ *
+ * Only the interfaces the firmware touches are provided. The radio is backed
+ * by an in-memory medium (see sim_api.h) and the message bus dispatches
+ * events synchronously, standing in for the fiber scheduler.
+ */
+
+#ifndef SIM_DAL_H
+#define SIM_DAL_H
+
+#include "mbed.h"
+
+//
+// ErrorNo.h
+//
+enum ErrorCode {
+    MICROBIT_OK = 0,
+    MICROBIT_INVALID_PARAMETER = -1001,
+    MICROBIT_NOT_SUPPORTED = -1002,
+    MICROBIT_NO_RESOURCES = -1005,
+    MICROBIT_BUSY = -1006,
+    MICROBIT_CANCELLED = -1007,
+    MICROBIT_NO_DATA = -1012
+};
+
+//
+// ManagedString and PacketBuffer. Both allocate on the heap exactly as the
+// real ones do, so heap checks in the simulation see the same behaviour.
+//
+class PacketBuffer {
+    public:
+        PacketBuffer();
+        PacketBuffer(const uint8_t *data, int length, int rssi = 0);
+        PacketBuffer(const PacketBuffer &buffer);
+        ~PacketBuffer();
+        PacketBuffer &operator=(const PacketBuffer &buffer);
+        uint8_t *getBytes();
+        int length();
+        int getRSSI();
+
+    private:
+        uint8_t *data;
+        int len;
+        int rssi;
+};
+
+class ManagedString {
+    public:
+        ManagedString();
+        ManagedString(const char *str);
+        ManagedString(const int value);
+        ManagedString(PacketBuffer buffer);
+        ManagedString(const ManagedString &s);
+        ~ManagedString();
+        ManagedString &operator=(const ManagedString &s);
+        ManagedString operator+(const ManagedString &s);
+        const char *toCharArray() const;
+        int16_t length() const;
+
+    private:
+        char *str;
+        int16_t len;
+};
+
+//
+// System timer and fibers
+//
+int system_timer_init(int period);
+unsigned long system_timer_current_time();
+uint64_t system_timer_current_time_us();
+
+//
+// Components with work to do when the idle fiber runs. config.json asks
+// the DAL for six slots.
+//
+#define MICROBIT_IDLE_COMPONENTS            6
+
+class MicroBitComponent {
+    public:
+        virtual ~MicroBitComponent() {}
+        virtual void idleTick() {}
+};
+
+class MicroBitMessageBus;
+void scheduler_init(MicroBitMessageBus &messageBus);
+void schedule();
+void fiber_sleep(unsigned long t);
+void release_fiber(void);
+int fiber_wait_for_event(uint16_t id, uint16_t value);
+int fiber_add_idle_component(MicroBitComponent *component);
+int fiber_remove_idle_component(MicroBitComponent *component);
+
+/**
+ * Simulation only: run the idle components, in the order they were added,
+ * as the idle fiber does
+ */
+void sim_idle_tick(void);
+
+//
+// Events and the message bus
+//
+#define MICROBIT_ID_ANY                     0
+#define MICROBIT_ID_IO_P0                   7
+#define MICROBIT_ID_IO_P1                   8
+#define MICROBIT_ID_RADIO                   29
+#define MICROBIT_ID_NOTIFY                  1023
+#define MICROBIT_EVT_ANY                    0
+#define MICROBIT_RADIO_EVT_DATAGRAM         1
+
+#define MESSAGE_BUS_LISTENER_IMMEDIATE      0x0010
+#define MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY  0x0020
+
+enum MicroBitEventLaunchMode {
+    CREATE_ONLY,
+    CREATE_AND_FIRE
+};
+
+class MicroBitEvent {
+    public:
+        uint16_t source;
+        uint16_t value;
+        uint64_t timestamp;
+
+        MicroBitEvent(uint16_t source, uint16_t value, MicroBitEventLaunchMode mode = CREATE_AND_FIRE);
+        MicroBitEvent();
+        void fire();
+};
+
+class MicroBitMessageBus {
+    public:
+        MicroBitMessageBus();
+        int listen(int id, int value, void (*handler)(MicroBitEvent), uint16_t flags = MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY);
+        int send(MicroBitEvent evt);
+
+    private:
+        struct {
+            int id;
+            int value;
+            void (*handler)(MicroBitEvent);
+        } listeners[8];
+        int listener_count;
+};
+
+//
+// Device information
+//
+const char *microbit_friendly_name();
+uint32_t microbit_serial_number();
+void microbit_reset();
+const char *microbit_dal_version();
+int microbit_random(int max);
+
+//
+// Peripherals that the module constructs but the firmware barely uses
+//
+class MicroBitStorage {
+    public:
+        MicroBitStorage() {}
+};
+
+class MicroBitThermometer {
+    public:
+        MicroBitThermometer(MicroBitStorage &) {}
+};
+
+class MicroBitSerial {
+    public:
+        MicroBitSerial(PinName tx, PinName rx) { (void) tx; (void) rx; }
+};
+
+enum PinCapability {
+    PIN_CAPABILITY_DIGITAL = 0x01,
+    PIN_CAPABILITY_ANALOG = 0x02,
+    PIN_CAPABILITY_STANDARD = PIN_CAPABILITY_DIGITAL | PIN_CAPABILITY_ANALOG
+};
+
+class MicroBitPin {
+    public:
+        int id;
+        PinName name;
+
+        MicroBitPin(int id, PinName name, PinCapability capability);
+        int setDigitalValue(int value);
+        int getDigitalValue();
+        int setAnalogValue(int value);
+
+    private:
+        int value;
+};
+
+//
+// BLE power levels, shared with the radio
+//
+#define MICROBIT_BLE_POWER_LEVELS           8
+extern const int8_t MICROBIT_BLE_POWER_LEVEL[MICROBIT_BLE_POWER_LEVELS];
+
+//
+// Radio
+//
+#define MICROBIT_RADIO_MAX_PACKET_SIZE      32
+#define MICROBIT_RADIO_HEADER_SIZE          4
+#define MICROBIT_RADIO_DEFAULT_GROUP        0
+#define MICROBIT_RADIO_BASE_ADDRESS         0x75626974
+#define MICROBIT_RADIO_DEFAULT_FREQUENCY    7
+#define MICROBIT_RADIO_DEFAULT_TX_POWER     6
+#define MICROBIT_RADIO_PROTOCOL_DATAGRAM    1
+#define MICROBIT_RADIO_MAXIMUM_RX_BUFFERS   4
+
+struct FrameBuffer {
+    uint8_t length;
+    uint8_t version;
+    uint8_t group;
+    uint8_t protocol;
+    uint8_t payload[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    FrameBuffer *next;
+    int rssi;
+
+    // The simulation takes frames from a fixed pool rather than the heap
+    static void *operator new(size_t size) noexcept;
+    static void operator delete(void *frame);
+};
+
+class MicroBitRadio;
+
+class MicroBitRadioDatagram {
+    public:
+        MicroBitRadioDatagram(MicroBitRadio &radio);
+        int recv(uint8_t *buf, int len);
+        PacketBuffer recv();
+        int send(uint8_t *buffer, int len);
+        int send(PacketBuffer data);
+        int send(ManagedString data);
+        void packetReceived();
+
+    private:
+        MicroBitRadio &radio;
+        FrameBuffer *rxQueue;
+};
+
+class MicroBitRadio : public MicroBitComponent {
+    public:
+        MicroBitRadioDatagram datagram;
+
+        MicroBitRadio();
+        int enable();
+        int disable();
+        int setGroup(uint8_t group);
+        int setFrequencyBand(int band);
+        int setTransmitPower(int power);
+        int getRSSI();
+        int setRSSI(int rssi);
+        int send(FrameBuffer *buffer);
+        FrameBuffer *recv();
+
+        // Called from the radio interrupt with a frame received intact
+        int queueRxBuf();
+        FrameBuffer *getRxBuf();
+
+        // Hands queued frames to the datagram layer, from the idle fiber
+        virtual void idleTick();
+
+        // Simulation only: a frame arrived over the air
+        int sim_receive(const uint8_t *data, int length, int rssi);
+        int sim_receive(const uint8_t *data, int length, int rssi, uint32_t base, uint8_t prefix);
+
+    private:
+        uint8_t group;
+        int rssi;
+        int enabled;
+        FrameBuffer *rxBuf;
+        FrameBuffer *rxQueue;
+        int queueDepth;
+};
+
+#endif
@@ -0,0 +1,257 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Register level model of the nRF51 peripherals used by the firmware.
+ *
+ * Plain registers are ordinary memory. Task registers, and registers whose
+ * writes have side effects, call back into the simulation when written.
+ * DMA pointer registers are widened to uintptr_t so the host can hold
+ * native pointers in them.
+ */
+
+#ifndef SIM_NRF_H
+#define SIM_NRF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A register with side effects on write
+ */
+struct sim_reg_t {
+    uint32_t value;
+    void (*on_write)(sim_reg_t *reg, uint32_t value);
+
+    sim_reg_t &operator=(uint32_t v) {
+        if (on_write)
+            on_write(this, v);
+        else
+            value = v;
+        return *this;
+    }
+    operator uint32_t() const { return value; }
+};
+
+//
+// SPIS
+//
+typedef struct {
+    sim_reg_t TASKS_ACQUIRE;
+    sim_reg_t TASKS_RELEASE;
+    uint32_t EVENTS_END;
+    uint32_t EVENTS_ACQUIRED;
+    uint32_t SHORTS;
+    sim_reg_t INTENSET;
+    sim_reg_t INTENCLR;
+    uint32_t SEMSTAT;
+    sim_reg_t STATUS;
+    uint32_t ENABLE;
+    uint32_t PSELSCK;
+    uint32_t PSELMISO;
+    uint32_t PSELMOSI;
+    uint32_t PSELCSN;
+    uintptr_t RXDPTR;
+    uint32_t MAXRX;
+    uint32_t AMOUNTRX;
+    uintptr_t TXDPTR;
+    uint32_t MAXTX;
+    uint32_t AMOUNTTX;
+    uint32_t CONFIG;
+    uint32_t DEF;
+    uint32_t ORC;
+} NRF_SPIS_Type;
+
+#define SPIS_SHORTS_END_ACQUIRE_Pos         (2UL)
+#define SPIS_SHORTS_END_ACQUIRE_Msk         (0x1UL << SPIS_SHORTS_END_ACQUIRE_Pos)
+#define SPIS_SHORTS_END_ACQUIRE_Disabled    (0UL)
+#define SPIS_SHORTS_END_ACQUIRE_Enabled     (1UL)
+
+#define SPIS_INTENSET_END_Pos               (1UL)
+#define SPIS_INTENSET_END_Msk               (0x1UL << SPIS_INTENSET_END_Pos)
+#define SPIS_INTENSET_ACQUIRED_Pos          (10UL)
+#define SPIS_INTENSET_ACQUIRED_Msk          (0x1UL << SPIS_INTENSET_ACQUIRED_Pos)
+#define SPIS_INTENCLR_END_Msk               SPIS_INTENSET_END_Msk
+#define SPIS_INTENCLR_ACQUIRED_Msk          SPIS_INTENSET_ACQUIRED_Msk
+
+#define SPIS_SEMSTAT_SEMSTAT_Free           (0UL)
+#define SPIS_SEMSTAT_SEMSTAT_CPU            (1UL)
+#define SPIS_SEMSTAT_SEMSTAT_SPIS           (2UL)
+#define SPIS_SEMSTAT_SEMSTAT_CPUPending     (3UL)
+
+#define SPIS_STATUS_OVERREAD_Msk            (0x1UL << 0)
+#define SPIS_STATUS_OVERFLOW_Msk            (0x1UL << 1)
+
+extern NRF_SPIS_Type sim_spis1;
+#define NRF_SPIS1 (&sim_spis1)
+
+//
+// RADIO
+//
+typedef struct {
+    sim_reg_t TASKS_TXEN;
+    sim_reg_t TASKS_RXEN;
+    sim_reg_t TASKS_START;
+    sim_reg_t TASKS_STOP;
+    sim_reg_t TASKS_DISABLE;
+    sim_reg_t TASKS_RSSISTART;
+    sim_reg_t TASKS_RSSISTOP;
+    uint32_t EVENTS_READY;
+    uint32_t EVENTS_ADDRESS;
+    uint32_t EVENTS_PAYLOAD;
+    uint32_t EVENTS_END;
+    uint32_t EVENTS_DISABLED;
+    uint32_t EVENTS_RSSIEND;
+    uint32_t SHORTS;
+    uint32_t INTENSET;
+    uint32_t INTENCLR;
+    uint32_t CRCSTATUS;
+    uint32_t RXMATCH;
+    uint32_t RXCRC;
+    uintptr_t PACKETPTR;
+    uint32_t FREQUENCY;
+    uint32_t TXPOWER;
+    uint32_t MODE;
+    uint32_t PCNF0;
+    uint32_t PCNF1;
+    uint32_t BASE0;
+    uint32_t BASE1;
+    uint32_t PREFIX0;
+    uint32_t PREFIX1;
+    uint32_t TXADDRESS;
+    uint32_t RXADDRESSES;
+    uint32_t CRCCNF;
+    uint32_t CRCPOLY;
+    uint32_t CRCINIT;
+    uint32_t RSSISAMPLE;
+    uint32_t STATE;
+    uint32_t POWER;
+} NRF_RADIO_Type;
+
+#define RADIO_STATE_STATE_Disabled          (0UL)
+#define RADIO_STATE_STATE_RxRu              (1UL)
+#define RADIO_STATE_STATE_RxIdle            (2UL)
+#define RADIO_STATE_STATE_Rx                (3UL)
+#define RADIO_STATE_STATE_RxDisable         (4UL)
+#define RADIO_STATE_STATE_TxRu              (9UL)
+#define RADIO_STATE_STATE_TxIdle            (10UL)
+#define RADIO_STATE_STATE_Tx                (11UL)
+#define RADIO_STATE_STATE_TxDisable         (12UL)
+
+#define RADIO_MODE_MODE_Nrf_1Mbit           (0x00UL)
+#define RADIO_MODE_MODE_Nrf_2Mbit           (0x01UL)
+#define RADIO_MODE_MODE_Nrf_250Kbit         (0x02UL)
+#define RADIO_MODE_MODE_Ble_1Mbit           (0x03UL)
+
+extern NRF_RADIO_Type sim_radio;
+#define NRF_RADIO (&sim_radio)
+
+//
+// TIMER, counting simulated time
+//
+typedef struct {
+    sim_reg_t TASKS_START;
+    sim_reg_t TASKS_STOP;
+    sim_reg_t TASKS_COUNT;
+    sim_reg_t TASKS_CLEAR;
+    sim_reg_t TASKS_SHUTDOWN;
+    sim_reg_t TASKS_CAPTURE[4];
+    uint32_t EVENTS_COMPARE[4];
+    uint32_t SHORTS;
+    uint32_t INTENSET;
+    uint32_t INTENCLR;
+    uint32_t MODE;
+    uint32_t BITMODE;
+    uint32_t PRESCALER;
+    uint32_t CC[4];
+    uint32_t POWER;
+} NRF_TIMER_Type;
+
+#define TIMER_MODE_MODE_Timer               (0UL)
+#define TIMER_MODE_MODE_Counter             (1UL)
+
+#define TIMER_BITMODE_BITMODE_16Bit         (0x00UL)
+#define TIMER_BITMODE_BITMODE_08Bit         (0x01UL)
+#define TIMER_BITMODE_BITMODE_24Bit         (0x02UL)
+#define TIMER_BITMODE_BITMODE_32Bit         (0x03UL)
+
+#define TIMER_SHORTS_COMPARE0_CLEAR_Msk     (0x1UL << 0)
+#define TIMER_INTENSET_COMPARE0_Msk         (0x1UL << 16)
+
+extern NRF_TIMER_Type sim_timer0;
+#define NRF_TIMER0 (&sim_timer0)
+extern NRF_TIMER_Type sim_timer1;
+#define NRF_TIMER1 (&sim_timer1)
+
+//
+// PPI. Event and task pointers are widened to uintptr_t, as the DMA
+// pointers are.
+//
+typedef struct {
+    uintptr_t EEP;
+    uintptr_t TEP;
+} PPI_CH_Type;
+
+typedef struct {
+    uint32_t CHEN;
+    sim_reg_t CHENSET;
+    sim_reg_t CHENCLR;
+    PPI_CH_Type CH[16];
+} NRF_PPI_Type;
+
+extern NRF_PPI_Type sim_ppi;
+#define NRF_PPI (&sim_ppi)
+
+/**
+ * Simulation only: a peripheral raised event, so trigger the tasks that
+ * enabled PPI channels connect it to
+ */
+void sim_ppi_event(uint32_t *event);
+
+//
+// NVIC
+//
+typedef enum {
+    RADIO_IRQn = 1,
+    SPI1_TWI1_IRQn = 4,
+    TIMER0_IRQn = 8,
+    TIMER1_IRQn = 9,
+    SIM_IRQn_COUNT = 32
+} IRQn_Type;
+
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_ClearPendingIRQ(IRQn_Type irq);
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority);
+
+/**
+ * Simulation only: raise an interrupt, running its handler now if it is
+ * enabled and interrupts are not masked, or leaving it pending until then
+ */
+void sim_irq_raise(IRQn_Type irq);
+
+void __disable_irq(void);
+void __enable_irq(void);
+
+#endif
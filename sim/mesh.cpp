@@ -0,0 +1,288 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Mesh flooding simulation.
+ *
+ * Puts the simulated module among other nodes running the link layer on the
+ * host, and floods messages through them with relaying on. Node 0 is the
+ * module, driven over SPI as the pyboard would, and the rest are RadioLink
+ * instances. Nodes stand in a line, hearing their neighbours either side, or
+ * in a square grid, hearing the four nodes around them. Frames sent in the
+ * same millisecond collide at a node that hears more than one of them, and
+ * are lost there, which is what the relay backoff is for. Messages start in
+ * turn from the module and from the node furthest from it. The results are
+ * printed as JSON: the share of messages that reached every node, repeats
+ * passed on to a pyboard, collisions, relays and the mean time a flood took
+ * to reach its last node.
+ *
+ * Usage: mesh [nodes] [line|grid] [backoff ms] [messages] [loss probability]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include "mbed.h"
+#include "SPIRadioCmds.h"
+#include "SPISlaveExt.h"
+#include "RadioLink.h"
+#include "sim_api.h"
+
+// A frame on the air, and the node that sent it
+struct air_frame_t {
+    uint32_t sender;
+    uint8_t length;
+    uint8_t data[MICROBIT_RADIO_MAX_PACKET_SIZE];
+};
+
+// The host's nodes, by index. Node 0 is the module, so has no link here.
+static std::vector<std::unique_ptr<RadioLink> > nodes;
+static std::vector<air_frame_t> air;
+// Node whose link layer is running, for mesh_transmit to tell them apart
+static uint32_t current;
+static uint32_t grid_side;
+static double loss;
+static uint32_t loss_state = 1;
+
+/**
+ * Put a frame from one of the host's nodes on the air
+ */
+static int mesh_transmit(uint8_t *frame, int length) {
+    air_frame_t f;
+    f.sender = current;
+    f.length = (uint8_t) length;
+    memcpy(f.data, frame, length);
+    air.push_back(f);
+    return MICROBIT_OK;
+}
+
+/**
+ * Whether node a hears node b
+ */
+static int in_range(uint32_t a, uint32_t b) {
+    if (a == b)
+        return 0;
+    if (grid_side == 0)
+        return a + 1 == b || b + 1 == a;
+    uint32_t ax = a % grid_side, ay = a / grid_side, bx = b % grid_side, by = b / grid_side;
+    return (ax == bx && (ay + 1 == by || by + 1 == ay)) ||
+           (ay == by && (ax + 1 == bx || bx + 1 == ax));
+}
+
+static int lost(void) {
+    loss_state ^= loss_state << 13;
+    loss_state ^= loss_state >> 17;
+    loss_state ^= loss_state << 5;
+    return (loss_state & 0xFFFF) < (uint32_t) (loss * 65536);
+}
+
+static uint32_t frame(uint8_t *buf, uint8_t cmd, const uint8_t *payload, uint8_t len) {
+    uint8_t chk = 0;
+    buf[0] = cmd;
+    buf[1] = len;
+    for (uint8_t i = 0; i < len; i += 1) {
+        buf[2+i] = payload[i];
+        chk ^= payload[i];
+    }
+    buf[2+len] = chk;
+    return len + 3;
+}
+
+// How many times each node passed each message on, and when it first did
+static std::vector<std::vector<uint32_t> > received;
+static std::vector<std::vector<uint64_t> > received_at;
+static uint64_t collisions;
+
+static void record(uint32_t node, const uint8_t *msg, int len) {
+    if (len < 2)
+        return;
+    uint32_t id = msg[0] | msg[1] << 8;
+    if (id >= received.size())
+        return;
+    if (received[id][node]++ == 0)
+        received_at[id][node] = sim_time_us();
+}
+
+/**
+ * Let a millisecond pass: put this millisecond's frames through the air,
+ * then let every node run. Return the number of frames that were sent.
+ */
+static uint32_t step(void) {
+    uint8_t f[MICROBIT_RADIO_MAX_PACKET_SIZE], reply[64];
+    const uint8_t *msg;
+    uint32_t now = (uint32_t) (sim_time_us() / 1000);
+    int len;
+
+    while ((len = sim_radio_take(f, sizeof(f))) >= 0) {
+        air_frame_t a;
+        a.sender = 0;
+        a.length = (uint8_t) len;
+        memcpy(a.data, f, len);
+        air.push_back(a);
+    }
+    uint32_t sent = air.size();
+
+    for (uint32_t r = 0; r < nodes.size(); r += 1) {
+        const air_frame_t *heard = NULL;
+        uint32_t count = 0;
+        for (size_t i = 0; i < air.size(); i += 1)
+            if (in_range(r, air[i].sender)) {
+                heard = &air[i];
+                count += 1;
+            }
+        if (count > 1)
+            collisions += 1;
+        if (count != 1 || lost())
+            continue;
+        if (r == 0) {
+            sim_radio_deliver(heard->data, heard->length, -60);
+            continue;
+        }
+        memcpy(f, heard->data, heard->length);
+        current = r;
+        len = nodes[r]->input(f, heard->length, &msg, now);
+        if (len >= 0)
+            record(r, msg, len);
+    }
+    air.clear();
+
+    for (uint32_t r = 1; r < nodes.size(); r += 1) {
+        current = r;
+        nodes[r]->poll(now);
+    }
+    sim_run();
+    // Read whatever reached the module's pyboard
+    uint8_t recv = SPI_RECV_CMD;
+    do {
+        sim_command(&recv, 1, reply, sizeof(reply));
+        if (reply[0] == SPI_SUCCESS)
+            record(0, reply+2, reply[1]);
+    } while (reply[0] == SPI_SUCCESS);
+    sim_advance_us(1000);
+    return sent;
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 0) : 8;
+    const char *topology = argc > 2 ? argv[2] : "line";
+    uint8_t backoff = argc > 3 ? (uint8_t) strtoul(argv[3], NULL, 0) : LINK_DEFAULT_BACKOFF_MS;
+    uint32_t messages = argc > 4 ? (uint32_t) strtoul(argv[4], NULL, 0) : 100;
+    loss = argc > 5 ? strtod(argv[5], NULL) : 0.0;
+    uint8_t cmd[16], reply[64];
+
+    if (n < 2)
+        n = 2;
+    uint8_t hops = (uint8_t) (n - 1);
+    if (strcmp(topology, "grid") == 0) {
+        grid_side = (uint32_t) ceil(sqrt((double) n));
+        n = grid_side * grid_side;
+        hops = (uint8_t) (2 * (grid_side - 1));
+    }
+
+    sim_init();
+    uint8_t id[2] = {1, 0};
+    sim_command(cmd, frame(cmd, SPI_LINK_ENABLE, id, 2), reply, sizeof(reply));
+    uint8_t relay[2] = {hops, backoff};
+    sim_command(cmd, frame(cmd, SPI_RELAY_ENABLE, relay, 2), reply, sizeof(reply));
+    if (reply[0] != SPI_SUCCESS) {
+        fprintf(stderr, "Unable to turn relaying on\n");
+        return 1;
+    }
+
+    nodes.resize(n);
+    for (uint32_t i = 1; i < n; i += 1) {
+        nodes[i].reset(new RadioLink(mesh_transmit));
+        nodes[i]->set_node_id((uint16_t) (i + 1));
+        nodes[i]->enable(1);
+        nodes[i]->set_relay(1, hops, backoff);
+    }
+    received.assign(messages, std::vector<uint32_t>(n, 0));
+    received_at.assign(messages, std::vector<uint64_t>(n, 0));
+
+    uint64_t frames = 0, flood_us = 0;
+    uint32_t complete = 0, repeats = 0;
+    for (uint32_t m = 0; m < messages; m += 1) {
+        uint8_t payload[12];
+        memset(payload, 'A' + m % 26, sizeof(payload));
+        payload[0] = (uint8_t) m;
+        payload[1] = (uint8_t) (m >> 8);
+        uint64_t start = sim_time_us();
+        uint32_t origin = m % 2 ? n - 1 : 0;
+        if (origin == 0)
+            sim_command(cmd, frame(cmd, SPI_SEND_CMD, payload, sizeof(payload)), reply,
+                    sizeof(reply));
+        else {
+            current = origin;
+            nodes[origin]->send(payload, sizeof(payload), (uint32_t) (start / 1000));
+        }
+        // The origin doesn't pass its own message to its pyboard
+        received[m][origin] = 1;
+        received_at[m][origin] = start;
+
+        // Run until every relay has had time to go out
+        uint32_t quiet = 0;
+        while (quiet <= (uint32_t) backoff + 2) {
+            uint32_t sent = step();
+            frames += sent;
+            quiet = sent ? 0 : quiet + 1;
+        }
+
+        uint64_t last = start;
+        uint32_t reached = 0;
+        for (uint32_t r = 0; r < n; r += 1) {
+            if (received[m][r] == 0)
+                continue;
+            reached += 1;
+            repeats += received[m][r] - 1;
+            if (received_at[m][r] > last)
+                last = received_at[m][r];
+        }
+        if (reached == n) {
+            complete += 1;
+            flood_us += last - start;
+        }
+    }
+
+    uint64_t relayed = 0;
+    for (uint32_t r = 1; r < n; r += 1)
+        relayed += nodes[r]->get_stats()->relayed;
+    uint8_t query = SPI_RELAY_QUERY;
+    sim_command(&query, 1, reply, sizeof(reply));
+    relayed += reply[5] | reply[6] << 8 | reply[7] << 16 | (uint32_t) reply[8] << 24;
+
+    printf("{\"nodes\": %u, \"topology\": \"%s\", \"hops\": %u, \"backoff_ms\": %u, "
+           "\"messages\": %u, \"loss\": %.3f, \"reached_all\": %.3f, \"repeats\": %u, "
+           "\"frames\": %llu, \"relayed\": %llu, \"collisions\": %llu, "
+           "\"mean_flood_ms\": %.2f}\n",
+           n, grid_side ? "grid" : "line", hops, backoff, messages, loss,
+           messages ? (double) complete / messages : 0.0, repeats,
+           (unsigned long long) frames, (unsigned long long) relayed,
+           (unsigned long long) collisions,
+           complete ? flood_us / 1000.0 / complete : 0.0);
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+/**
+ * Check that received messages keep their own metadata.
+ *
+ * Delivers frames that differ in signal strength, arrival time and address
+ * pipe, all before the firmware gets to handle any of them, as happens when
+ * frames arrive back to back. Then fills the radio driver's queue, delivers
+ * a frame it has no room for, and the same bytes again on another pipe once
+ * there is room. Reads the messages back with SPI_RECV_MANY_CMD and fails if
+ * any came back with the metadata of another, or the dropped frame's.
+ *
+ * Usage: metacheck
+ */
+
+#include <stdio.h>
+
+#include "mbed.h"
+#include "MicroBitRadio.h"
+#include "SPIRadioCmds.h"
+#include "SPISlaveExt.h"
+#include "sim_api.h"
+
+// A frame to deliver, and the metadata it should come back with
+struct frame_t {
+    uint8_t data;
+    int8_t rssi;
+    uint32_t gap_us;
+    uint8_t pipe;
+};
+
+static const frame_t frames[] = {
+    {'a', -40, 0, 0},
+    {'b', -75, 350, 3},
+    {'c', -52, 1200, 1},
+};
+
+// Fill the radio driver's queue
+static const frame_t queued[MICROBIT_RADIO_MAXIMUM_RX_BUFFERS] = {
+    {'0', -30, 100, 0},
+    {'1', -31, 100, 1},
+    {'2', -32, 100, 2},
+    {'3', -33, 100, 3},
+};
+
+// The driver has no room for the first, and receives the second into the
+// same buffer
+static const frame_t dropped = {'x', -60, 100, 2};
+static const frame_t repeat = {'x', -45, 500, 3};
+
+// Address prefixes of the pipes, where pipe 0 is the default radio group
+static const uint8_t prefixes[] = {MICROBIT_RADIO_DEFAULT_GROUP, 0x51, 0x52, 0x53};
+static const uint32_t PIPES = sizeof(prefixes) / sizeof(prefixes[0]);
+static const uint32_t FRAMES = sizeof(frames) / sizeof(frames[0]);
+static const uint32_t QUEUED = sizeof(queued) / sizeof(queued[0]);
+
+/**
+ * Deliver a frame after its gap, and return the time it arrived
+ */
+static uint32_t deliver(const frame_t *frame, int *result) {
+    sim_advance_us(frame->gap_us);
+    uint32_t sent = (uint32_t) sim_time_us();
+    *result = sim_radio_deliver_to(&frame->data, 1, frame->rssi, MICROBIT_RADIO_BASE_ADDRESS,
+            prefixes[frame->pipe]);
+    return sent;
+}
+
+/**
+ * Read the waiting messages back, adding them to received, and count those
+ * missing, unexpected or with the wrong metadata
+ */
+static int read_back(const frame_t *expect, const uint32_t *sent, uint32_t count,
+        uint32_t *total) {
+    uint8_t cmd = SPI_RECV_MANY_CMD, reply[SPI_IOBUF_SIZE];
+    int failures = 0;
+
+    sim_command(&cmd, 1, reply, sizeof(reply));
+    uint32_t received = 0;
+    for (uint32_t j = 2; reply[0] == SPI_SUCCESS && j < 2u + reply[1]; j += 7 + reply[j]) {
+        const uint8_t *meta = reply + j + 1;
+        int8_t rssi = (int8_t) meta[0];
+        uint32_t time = meta[1] | meta[2] << 8 | meta[3] << 16 | (uint32_t) meta[4] << 24;
+        uint8_t pipe = meta[5];
+        uint8_t data = meta[6];
+        received += 1;
+        for (uint32_t i = 0; i < count; i += 1) {
+            if (expect[i].data != data)
+                continue;
+            if (rssi != expect[i].rssi || time != sent[i] || pipe != expect[i].pipe) {
+                fprintf(stderr, "metacheck: '%c' came back with %d dBm at %u on pipe %u, "
+                        "sent with %d dBm at %u on pipe %u\n", data, rssi, time, pipe,
+                        expect[i].rssi, sent[i], expect[i].pipe);
+                failures += 1;
+            }
+        }
+    }
+    *total += received;
+    if (received != count) {
+        fprintf(stderr, "metacheck: %u messages came back, expected %u\n", received, count);
+        failures += 1;
+    }
+    return failures;
+}
+
+int main(void) {
+    uint8_t cmd = SPI_RX_META_ENABLE, reply[SPI_IOBUF_SIZE];
+    frame_t expect[QUEUED + 1];
+    uint32_t sent[QUEUED + 1];
+    uint32_t received = 0;
+    int failures = 0, result;
+
+    sim_init();
+    sim_command(&cmd, 1, reply, 1);
+    for (uint8_t pipe = 1; pipe < PIPES; pipe += 1) {
+        uint8_t set[5] = {SPI_PIPE_SET, 2, pipe, prefixes[pipe],
+            (uint8_t) (pipe ^ prefixes[pipe])};
+        sim_command(set, sizeof(set), reply, 1);
+    }
+
+    // Nothing runs the firmware's main loop between these
+    for (uint32_t i = 0; i < FRAMES; i += 1)
+        sent[i] = deliver(&frames[i], &result);
+    failures += read_back(frames, sent, FRAMES, &received);
+
+    // The driver drops a frame while its queue is full, and receives the
+    // next one into the same buffer
+    for (uint32_t i = 0; i < QUEUED; i += 1) {
+        expect[i] = queued[i];
+        sent[i] = deliver(&queued[i], &result);
+    }
+    deliver(&dropped, &result);
+    if (result != MICROBIT_NO_RESOURCES) {
+        fprintf(stderr, "metacheck: the radio driver took '%c' with its queue full\n",
+                dropped.data);
+        failures += 1;
+    }
+    sim_run();
+    expect[QUEUED] = repeat;
+    sent[QUEUED] = deliver(&repeat, &result);
+    failures += read_back(expect, sent, QUEUED + 1, &received);
+
+    printf("{\"messages\": %u, \"failures\": %d}\n", received, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mbed.h"
+#include "SPIRadioCmds.h"
+#include "NCSSPybRadio.h"
+#include "SPIRadio.h"
+#include "sim_api.h"
+
+// Firmware entry points, from main.cpp
+void setup(void);
+int service_spi(void);
+int service_tx(void);
+extern NCSSPybRadio module;
+
+// Give up on a command after this many busy polls
+static const int SIM_MAX_POLLS = 1000;
+
+// Set while sim_run is running the firmware
+static int sim_running;
+
+/**
+ * The transmit fiber, woken by PYB_RADIO_SPI_EVT_TX. Events raised while
+ * sim_run is going are left to it, as it sends everything queued before it
+ * returns. Events raised by a timeout as simulated time passes send at once.
+ */
+static void sim_tx_fiber(MicroBitEvent e) {
+    (void) e;
+    if (sim_running)
+        return;
+    sim_running = 1;
+    while (service_tx());
+    sim_running = 0;
+}
+
+void sim_init(void) {
+    static int initialised = 0;
+    if (initialised)
+        return;
+    setup();
+    module.messageBus.listen(PYB_RADIO_ID_SPI, PYB_RADIO_SPI_EVT_TX, sim_tx_fiber);
+    initialised = 1;
+}
+
+void sim_run(void) {
+    sim_running = 1;
+    // The main loop sleeps between passes, which lets the idle fiber take
+    // the frames the radio interrupt queued
+    sim_idle_tick();
+    service_spi();
+    // The transmit fiber sends everything queued before it sleeps
+    while (service_tx());
+    sim_running = 0;
+}
+
+/**
+ * Write the command, retrying while the module is busy. The firmware gets a
+ * chance to run between every attempt, as it would on hardware.
+ */
+static int write_command(const uint8_t *cmd, uint32_t len) {
+    uint8_t resp[256];
+    int polls = 0;
+
+    if (len > sizeof(resp))
+        return -1;
+
+    sim_spi_transfer(cmd, resp, len);
+    while (resp[0] == SPI_PERIPH_BUSY) {
+        if (++polls > SIM_MAX_POLLS)
+            return -1;
+        sim_run();
+        sim_spi_transfer(cmd, resp, len);
+    }
+    sim_run();
+    return polls;
+}
+
+int sim_command(const uint8_t *cmd, uint32_t len, uint8_t *reply, uint32_t reply_len) {
+    int polls = write_command(cmd, len);
+    if (polls < 0)
+        return -1;
+
+    // Wait until the radio is ready to respond, then read the reply in the
+    // same transaction
+    sim_spi_select();
+    sim_spi_exchange(NULL, reply, 1);
+    while (reply[0] == SPI_PERIPH_BUSY) {
+        sim_spi_deselect();
+        if (++polls > SIM_MAX_POLLS)
+            return -1;
+        sim_run();
+        sim_spi_select();
+        sim_spi_exchange(NULL, reply, 1);
+    }
+    if (reply_len > 1)
+        sim_spi_exchange(NULL, reply+1, reply_len-1);
+    sim_spi_deselect();
+
+    // Let the firmware see the end of the read
+    sim_run();
+
+    return polls;
+}
+
+int sim_command_framed(const uint8_t *cmd, uint32_t len, uint8_t *reply, uint32_t reply_len) {
+    uint32_t rest;
+    int polls = write_command(cmd, len);
+    if (polls < 0 || reply_len < 2)
+        return -1;
+
+    // Poll the header until the reply is ready
+    sim_spi_select();
+    sim_spi_exchange(NULL, reply, 2);
+    while (reply[0] == SPI_PERIPH_BUSY) {
+        sim_spi_deselect();
+        if (++polls > SIM_MAX_POLLS)
+            return -1;
+        sim_run();
+        sim_spi_select();
+        sim_spi_exchange(NULL, reply, 2);
+    }
+    // Then read exactly the data and checksum
+    rest = reply[1] ? reply[1] + 1 : 0;
+    if (rest > reply_len - 2)
+        rest = reply_len - 2;
+    sim_spi_exchange(NULL, reply+2, rest);
+    sim_spi_deselect();
+
+    // Let the firmware see the end of the read
+    sim_run();
+
+    return polls;
+}
+
+int sim_data_ready(void) {
+    return module.data_ready.getDigitalValue();
+}
@@ -0,0 +1,166 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * C interface to the host simulation of the radio module.
+ *
+ * The firmware is linked unmodified against simulated SPIS and RADIO
+ * peripherals. The host plays the part of the pyboard by clocking SPI
+ * transactions, and of other radios by delivering frames over the air.
+ * Firmware code only runs when the host calls into it, through sim_run()
+ * or as a side effect of an SPI transaction or a delivered frame raising an
+ * interrupt.
+ */
+
+#ifndef SIM_API_H
+#define SIM_API_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Run the firmware initialisation. Must be called once before anything else.
+ */
+void sim_init(void);
+
+/**
+ * Run one pass of the firmware main loop, after the idle fiber takes the
+ * frames received since the last pass off the radio.
+ */
+void sim_run(void);
+
+/**
+ * Assert chip select, clock len bytes in each direction, release chip select.
+ * Either buffer may be NULL. Returns the number of bytes clocked.
+ */
+uint32_t sim_spi_transfer(const uint8_t *mosi, uint8_t *miso, uint32_t len);
+
+/**
+ * The same, split into its parts so that a transaction can be clocked in
+ * pieces while chip select is held.
+ */
+void sim_spi_select(void);
+void sim_spi_exchange(const uint8_t *mosi, uint8_t *miso, uint32_t len);
+void sim_spi_deselect(void);
+
+/**
+ * Total number of bytes clocked over SPI since startup
+ */
+uint64_t sim_spi_bytes(void);
+
+/**
+ * Issue a command exactly as Radio._write in quokka_radio.py does: write the
+ * command, retrying while the module is busy, poll until the reply is ready
+ * and then read reply_len bytes of reply, status byte first.
+ *
+ * Returns the number of busy polls needed, or -1 if the module never answered.
+ */
+int sim_command(const uint8_t *cmd, uint32_t len, uint8_t *reply, uint32_t reply_len);
+
+/**
+ * Issue a command using SPI_PROTOCOL_FRAMED, which must already have been
+ * selected. The reply is read as a two byte header, polling while the module
+ * is busy, followed in the same transaction by exactly the rest of the reply.
+ * reply must hold at least reply_len bytes; a longer reply is truncated.
+ *
+ * Returns the number of busy polls needed, or -1 if the module never answered.
+ */
+int sim_command_framed(const uint8_t *cmd, uint32_t len, uint8_t *reply, uint32_t reply_len);
+
+/**
+ * Deliver a datagram over the air to the module. Returns MICROBIT_OK (0) if
+ * the radio accepted it. The radio interrupt queues it straight away, and
+ * the firmware handles it on the next sim_run, as it takes frames off the
+ * radio from the idle fiber.
+ */
+int sim_radio_deliver(const uint8_t *data, uint32_t len, int rssi);
+
+/**
+ * Deliver a datagram sent to the given radio address, made of a base address
+ * and a prefix. The radio only accepts it if one of the enabled logical
+ * addresses matches, and returns MICROBIT_NO_DATA otherwise.
+ */
+int sim_radio_deliver_to(const uint8_t *data, uint32_t len, int rssi, uint32_t base,
+        uint8_t prefix);
+
+/**
+ * Collect the next datagram transmitted by the module. Returns its length, or
+ * -1 if nothing has been sent.
+ */
+int sim_radio_take(uint8_t *data, uint32_t maxlen);
+
+/**
+ * Total time frames sent or received by the module have spent on the air,
+ * at the data rate the radio was set to at the time. Sending also advances
+ * simulated time by the airtime and the radio ramp up, as MicroBitRadio
+ * blocks until the frame is out.
+ */
+uint64_t sim_radio_airtime_us(void);
+
+/**
+ * Lose each frame sent or received by the module with the given probability,
+ * independently, chosen by a generator started from seed. A lost frame still
+ * takes its airtime. A lost frame sent by the module is never seen by
+ * sim_radio_take, and delivering a lost frame returns MICROBIT_NO_DATA as
+ * though it had gone to another address. 0 turns losses off.
+ */
+void sim_radio_set_loss(double probability, uint32_t seed);
+
+/**
+ * Number of frames lost since startup
+ */
+uint64_t sim_radio_lost(void);
+
+/**
+ * Set the strongest signal, in dBm, that an RSSI sample on a channel reads,
+ * for channel scans. Channels read -100dBm until set.
+ */
+void sim_radio_set_energy(uint8_t channel, int rssi);
+
+/**
+ * Level of the module's data ready line
+ */
+int sim_data_ready(void);
+
+/**
+ * Number of heap allocations made since startup, and the number of those
+ * not yet freed
+ */
+uint32_t sim_heap_allocations(void);
+uint32_t sim_heap_live(void);
+
+/**
+ * Simulated time
+ */
+void sim_advance_us(uint32_t us);
+uint64_t sim_time_us(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
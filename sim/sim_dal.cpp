@@ -0,0 +1,790 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dal.h"
+#include "sim_api.h"
+
+// The simulated clock, in microseconds
+static uint64_t sim_clock_us;
+
+// The message bus events are delivered to
+static MicroBitMessageBus *sim_bus;
+
+// The radio belonging to the simulated module
+static MicroBitRadio *sim_module_radio;
+
+// Frames transmitted by the module, waiting for the host to collect them
+static struct {
+    uint8_t length;
+    uint8_t data[MICROBIT_RADIO_MAX_PACKET_SIZE];
+} sim_tx_frames[64];
+static uint32_t sim_tx_head, sim_tx_tail;
+
+// Time the radio takes to ramp up before transmitting
+static const uint32_t SIM_RADIO_RAMP_US = 140;
+
+// Total time frames to or from the module have spent on the air
+static uint64_t sim_air_us;
+
+// Chance out of 65536 that a frame to or from the module is lost on the air,
+// the state of the generator deciding which, and the number lost
+static uint32_t sim_loss;
+static uint32_t sim_loss_state = 1;
+static uint64_t sim_lost;
+
+/**
+ * Decide whether the next frame is lost, with a xorshift generator so that
+ * runs are repeatable
+ */
+static int frame_lost(void) {
+    if (sim_loss == 0)
+        return 0;
+    sim_loss_state ^= sim_loss_state << 13;
+    sim_loss_state ^= sim_loss_state >> 17;
+    sim_loss_state ^= sim_loss_state << 5;
+    if ((sim_loss_state & 0xFFFF) >= sim_loss)
+        return 0;
+    sim_lost += 1;
+    return 1;
+}
+
+/**
+ * Time on air of a frame of the given length, in the packet format that
+ * MicroBitRadio configures: a one byte preamble, a five byte address, the
+ * length byte, the frame itself and a two byte CRC.
+ */
+static uint32_t frame_airtime_us(uint32_t frame_len) {
+    uint32_t bits = 8 * (1 + 5 + 1 + frame_len + 2);
+    switch (NRF_RADIO->MODE) {
+        case RADIO_MODE_MODE_Nrf_2Mbit:
+            return (bits + 1) / 2;
+        case RADIO_MODE_MODE_Nrf_250Kbit:
+            return bits * 4;
+        default:
+            return bits;
+    }
+}
+
+// Receive frame buffers. The DAL keeps at most MICROBIT_RADIO_MAXIMUM_RX_BUFFERS
+// frames waiting on the radio and as many again on the datagram layer, plus
+// the one being received into, allocated from the heap inside the radio
+// interrupt. The simulation uses a fixed pool instead, so that heap
+// accounting only sees allocations made on behalf of the firmware.
+static const int SIM_FRAME_POOL = 2 * MICROBIT_RADIO_MAXIMUM_RX_BUFFERS + 2;
+static FrameBuffer sim_frame_pool[SIM_FRAME_POOL];
+static uint8_t sim_frame_used[SIM_FRAME_POOL];
+
+void *FrameBuffer::operator new(size_t size) noexcept {
+    (void) size;
+    for (int i = 0; i < SIM_FRAME_POOL; i += 1) {
+        if (!sim_frame_used[i]) {
+            sim_frame_used[i] = 1;
+            return &sim_frame_pool[i];
+        }
+    }
+    return NULL;
+}
+
+void FrameBuffer::operator delete(void *frame) {
+    if (frame)
+        sim_frame_used[(FrameBuffer *) frame - sim_frame_pool] = 0;
+}
+
+//
+// PacketBuffer
+//
+PacketBuffer::PacketBuffer() : data(NULL), len(0), rssi(0) {
+}
+
+PacketBuffer::PacketBuffer(const uint8_t *data, int length, int rssi) : len(length), rssi(rssi) {
+    this->data = new uint8_t[length > 0 ? length : 1];
+    if (data)
+        memcpy(this->data, data, length);
+}
+
+PacketBuffer::PacketBuffer(const PacketBuffer &buffer) : PacketBuffer(buffer.data, buffer.len, buffer.rssi) {
+}
+
+PacketBuffer::~PacketBuffer() {
+    delete[] data;
+}
+
+PacketBuffer &PacketBuffer::operator=(const PacketBuffer &buffer) {
+    if (this == &buffer)
+        return *this;
+    delete[] data;
+    len = buffer.len;
+    rssi = buffer.rssi;
+    data = new uint8_t[len > 0 ? len : 1];
+    memcpy(data, buffer.data, len);
+    return *this;
+}
+
+uint8_t *PacketBuffer::getBytes() {
+    return data;
+}
+
+int PacketBuffer::length() {
+    return len;
+}
+
+int PacketBuffer::getRSSI() {
+    return rssi;
+}
+
+//
+// ManagedString
+//
+ManagedString::ManagedString() : ManagedString("") {
+}
+
+ManagedString::ManagedString(const char *s) {
+    len = (int16_t) strlen(s);
+    str = new char[len + 1];
+    memcpy(str, s, len + 1);
+}
+
+ManagedString::ManagedString(const int value) {
+    char buf[12];
+    snprintf(buf, sizeof(buf), "%d", value);
+    len = (int16_t) strlen(buf);
+    str = new char[len + 1];
+    memcpy(str, buf, len + 1);
+}
+
+ManagedString::ManagedString(PacketBuffer buffer) {
+    len = (int16_t) buffer.length();
+    str = new char[len + 1];
+    memcpy(str, buffer.getBytes(), len);
+    str[len] = 0;
+}
+
+ManagedString::ManagedString(const ManagedString &s) : ManagedString(s.str) {
+}
+
+ManagedString::~ManagedString() {
+    delete[] str;
+}
+
+ManagedString &ManagedString::operator=(const ManagedString &s) {
+    if (this == &s)
+        return *this;
+    delete[] str;
+    len = s.len;
+    str = new char[len + 1];
+    memcpy(str, s.str, len + 1);
+    return *this;
+}
+
+ManagedString ManagedString::operator+(const ManagedString &s) {
+    char *joined = new char[len + s.len + 1];
+    memcpy(joined, str, len);
+    memcpy(joined + len, s.str, s.len + 1);
+    ManagedString result(joined);
+    delete[] joined;
+    return result;
+}
+
+const char *ManagedString::toCharArray() const {
+    return str;
+}
+
+int16_t ManagedString::length() const {
+    return len;
+}
+
+//
+// System timer and fibers. The firmware main loop is driven by the host, so
+// the scheduler calls have nothing to do.
+//
+int system_timer_init(int period) {
+    (void) period;
+    return MICROBIT_OK;
+}
+
+unsigned long system_timer_current_time() {
+    return (unsigned long) (sim_clock_us / 1000);
+}
+
+uint64_t system_timer_current_time_us() {
+    return sim_clock_us;
+}
+
+void scheduler_init(MicroBitMessageBus &messageBus) {
+    (void) messageBus;
+}
+
+void schedule() {
+}
+
+// Armed timeouts, soonest first
+static Timeout *sim_timeouts;
+
+Timeout::Timeout() : handler(NULL), deadline(0), next(NULL) {
+}
+
+Timeout::~Timeout() {
+    detach();
+}
+
+void Timeout::attach_us(void (*fptr)(void), uint32_t t) {
+    detach();
+    handler = fptr;
+    deadline = sim_clock_us + t;
+    Timeout **p = &sim_timeouts;
+    while (*p != NULL && (*p)->deadline <= deadline)
+        p = &(*p)->next;
+    next = *p;
+    *p = this;
+}
+
+void Timeout::detach(void) {
+    for (Timeout **p = &sim_timeouts; *p != NULL; p = &(*p)->next) {
+        if (*p == this) {
+            *p = next;
+            break;
+        }
+    }
+    next = NULL;
+}
+
+void Timeout::fire_due(uint64_t now) {
+    while (sim_timeouts != NULL && sim_timeouts->deadline <= now) {
+        Timeout *t = sim_timeouts;
+        sim_timeouts = t->next;
+        t->next = NULL;
+        t->handler();
+    }
+}
+
+uint64_t Timeout::next_due(void) {
+    return sim_timeouts ? sim_timeouts->deadline : UINT64_MAX;
+}
+
+void fiber_sleep(unsigned long t) {
+    (void) t;
+}
+
+void release_fiber(void) {
+}
+
+int fiber_wait_for_event(uint16_t id, uint16_t value) {
+    (void) id;
+    (void) value;
+    return MICROBIT_OK;
+}
+
+// Components the idle fiber calls, in the order they were added, as the
+// DAL fills the first free slot
+static MicroBitComponent *sim_idle_components[MICROBIT_IDLE_COMPONENTS];
+
+int fiber_add_idle_component(MicroBitComponent *component) {
+    int free = -1;
+    for (int i = 0; i < MICROBIT_IDLE_COMPONENTS; i += 1) {
+        if (sim_idle_components[i] == component)
+            return MICROBIT_OK;
+        if (free < 0 && sim_idle_components[i] == NULL)
+            free = i;
+    }
+    if (free < 0)
+        return MICROBIT_NO_RESOURCES;
+    sim_idle_components[free] = component;
+    return MICROBIT_OK;
+}
+
+int fiber_remove_idle_component(MicroBitComponent *component) {
+    for (int i = 0; i < MICROBIT_IDLE_COMPONENTS; i += 1) {
+        if (sim_idle_components[i] == component) {
+            sim_idle_components[i] = NULL;
+            return MICROBIT_OK;
+        }
+    }
+    return MICROBIT_INVALID_PARAMETER;
+}
+
+void sim_idle_tick(void) {
+    for (int i = 0; i < MICROBIT_IDLE_COMPONENTS; i += 1) {
+        if (sim_idle_components[i] != NULL)
+            sim_idle_components[i]->idleTick();
+    }
+}
+
+//
+// Events and the message bus
+//
+MicroBitEvent::MicroBitEvent(uint16_t source, uint16_t value, MicroBitEventLaunchMode mode) :
+    source(source),
+    value(value),
+    timestamp(sim_clock_us)
+{
+    if (mode == CREATE_AND_FIRE)
+        fire();
+}
+
+MicroBitEvent::MicroBitEvent() : source(0), value(0), timestamp(sim_clock_us) {
+}
+
+void MicroBitEvent::fire() {
+    if (sim_bus)
+        sim_bus->send(*this);
+}
+
+MicroBitMessageBus::MicroBitMessageBus() : listener_count(0) {
+    sim_bus = this;
+}
+
+int MicroBitMessageBus::listen(int id, int value, void (*handler)(MicroBitEvent), uint16_t flags) {
+    (void) flags;
+    if (listener_count >= (int) (sizeof(listeners) / sizeof(listeners[0])))
+        return MICROBIT_NO_RESOURCES;
+    listeners[listener_count].id = id;
+    listeners[listener_count].value = value;
+    listeners[listener_count].handler = handler;
+    listener_count += 1;
+    return MICROBIT_OK;
+}
+
+int MicroBitMessageBus::send(MicroBitEvent evt) {
+    // Listeners run straight away, as if their fiber was scheduled
+    for (int i = 0; i < listener_count; i += 1) {
+        if ((listeners[i].id == MICROBIT_ID_ANY || listeners[i].id == evt.source) &&
+                (listeners[i].value == MICROBIT_EVT_ANY || listeners[i].value == evt.value))
+            listeners[i].handler(evt);
+    }
+    return MICROBIT_OK;
+}
+
+//
+// Device information
+//
+const char *microbit_friendly_name() {
+    return "simul";
+}
+
+uint32_t microbit_serial_number() {
+    return 0x51A0CAFE;
+}
+
+void microbit_reset() {
+}
+
+const char *microbit_dal_version() {
+    return "sim";
+}
+
+int microbit_random(int max) {
+    if (max <= 0)
+        return MICROBIT_INVALID_PARAMETER;
+    return rand() % max;
+}
+
+//
+// Pins
+//
+MicroBitPin::MicroBitPin(int id, PinName name, PinCapability capability) :
+    id(id),
+    name(name),
+    value(0)
+{
+    (void) capability;
+}
+
+int MicroBitPin::setDigitalValue(int value) {
+    this->value = value ? 1 : 0;
+    return MICROBIT_OK;
+}
+
+int MicroBitPin::getDigitalValue() {
+    return value ? 1 : 0;
+}
+
+int MicroBitPin::setAnalogValue(int value) {
+    this->value = value;
+    return MICROBIT_OK;
+}
+
+const int8_t MICROBIT_BLE_POWER_LEVEL[MICROBIT_BLE_POWER_LEVELS] = {-30, -20, -16, -12, -8, -4, 0, 4};
+
+//
+// Radio
+//
+MicroBitRadioDatagram::MicroBitRadioDatagram(MicroBitRadio &radio) :
+    radio(radio),
+    rxQueue(NULL)
+{
+}
+
+int MicroBitRadioDatagram::recv(uint8_t *buf, int len) {
+    if (buf == NULL || rxQueue == NULL || len < 0)
+        return MICROBIT_INVALID_PARAMETER;
+
+    FrameBuffer *p = rxQueue;
+    rxQueue = rxQueue->next;
+
+    int l = p->length - (MICROBIT_RADIO_HEADER_SIZE - 1);
+    if (l > len)
+        l = len;
+    memcpy(buf, p->payload, l);
+
+    delete p;
+    return l;
+}
+
+PacketBuffer MicroBitRadioDatagram::recv() {
+    if (rxQueue == NULL)
+        return PacketBuffer();
+
+    FrameBuffer *p = rxQueue;
+    rxQueue = rxQueue->next;
+
+    PacketBuffer packet(p->payload, p->length - (MICROBIT_RADIO_HEADER_SIZE - 1), p->rssi);
+
+    delete p;
+    return packet;
+}
+
+int MicroBitRadioDatagram::send(uint8_t *buffer, int len) {
+    if (buffer == NULL || len < 0 || len > MICROBIT_RADIO_MAX_PACKET_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
+    FrameBuffer buf;
+    buf.length = len + MICROBIT_RADIO_HEADER_SIZE - 1;
+    buf.version = 1;
+    buf.group = 0;
+    buf.protocol = MICROBIT_RADIO_PROTOCOL_DATAGRAM;
+    memcpy(buf.payload, buffer, len);
+
+    return radio.send(&buf);
+}
+
+int MicroBitRadioDatagram::send(PacketBuffer data) {
+    return send(data.getBytes(), data.length());
+}
+
+int MicroBitRadioDatagram::send(ManagedString data) {
+    return send((uint8_t *) data.toCharArray(), data.length());
+}
+
+void MicroBitRadioDatagram::packetReceived() {
+    FrameBuffer *packet = radio.recv();
+    int queueDepth = 0;
+
+    // We add to the tail of the queue to preserve causal ordering.
+    packet->next = NULL;
+
+    if (rxQueue == NULL) {
+        rxQueue = packet;
+    } else {
+        FrameBuffer *p = rxQueue;
+        while (p->next != NULL) {
+            p = p->next;
+            queueDepth++;
+        }
+
+        if (queueDepth >= MICROBIT_RADIO_MAXIMUM_RX_BUFFERS) {
+            delete packet;
+            return;
+        }
+
+        p->next = packet;
+    }
+
+    MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM);
+}
+
+MicroBitRadio::MicroBitRadio() :
+    datagram(*this),
+    group(MICROBIT_RADIO_DEFAULT_GROUP),
+    rssi(0),
+    enabled(0),
+    rxBuf(NULL),
+    rxQueue(NULL),
+    queueDepth(0)
+{
+    sim_module_radio = this;
+    NRF_RADIO->FREQUENCY = MICROBIT_RADIO_DEFAULT_FREQUENCY;
+    NRF_RADIO->TXPOWER = (uint8_t) MICROBIT_BLE_POWER_LEVEL[MICROBIT_RADIO_DEFAULT_TX_POWER];
+}
+
+int MicroBitRadio::enable() {
+    if (enabled)
+        return MICROBIT_OK;
+    NRF_RADIO->MODE = RADIO_MODE_MODE_Nrf_1Mbit;
+    NRF_RADIO->BASE0 = MICROBIT_RADIO_BASE_ADDRESS;
+    NRF_RADIO->PREFIX0 = group;
+    NRF_RADIO->TXADDRESS = 0;
+    NRF_RADIO->RXADDRESSES = 1;
+    if (rxBuf == NULL)
+        rxBuf = new FrameBuffer;
+    NRF_RADIO->PACKETPTR = (uintptr_t) rxBuf;
+    NRF_RADIO->STATE = RADIO_STATE_STATE_Rx;
+    NVIC_ClearPendingIRQ(RADIO_IRQn);
+    NVIC_EnableIRQ(RADIO_IRQn);
+    // Empty the receive queue from the idle fiber
+    fiber_add_idle_component(this);
+    enabled = 1;
+    return MICROBIT_OK;
+}
+
+int MicroBitRadio::disable() {
+    NVIC_DisableIRQ(RADIO_IRQn);
+    fiber_remove_idle_component(this);
+    NRF_RADIO->STATE = RADIO_STATE_STATE_Disabled;
+    enabled = 0;
+    return MICROBIT_OK;
+}
+
+int MicroBitRadio::setGroup(uint8_t group) {
+    this->group = group;
+    NRF_RADIO->PREFIX0 = group;
+    return MICROBIT_OK;
+}
+
+int MicroBitRadio::setFrequencyBand(int band) {
+    if (band < 0 || band > 100)
+        return MICROBIT_INVALID_PARAMETER;
+    NRF_RADIO->FREQUENCY = (uint32_t) band;
+    return MICROBIT_OK;
+}
+
+int MicroBitRadio::setTransmitPower(int power) {
+    if (power < 0 || power >= MICROBIT_BLE_POWER_LEVELS)
+        return MICROBIT_INVALID_PARAMETER;
+    NRF_RADIO->TXPOWER = (uint8_t) MICROBIT_BLE_POWER_LEVEL[power];
+    return MICROBIT_OK;
+}
+
+int MicroBitRadio::getRSSI() {
+    return rssi;
+}
+
+int MicroBitRadio::setRSSI(int rssi) {
+    this->rssi = rssi;
+    return MICROBIT_OK;
+}
+
+int MicroBitRadio::send(FrameBuffer *buffer) {
+    if (!enabled)
+        return MICROBIT_NOT_SUPPORTED;
+
+    // MicroBitRadio::send busy waits while the frame goes out
+    uint32_t airtime = frame_airtime_us(buffer->length);
+    sim_clock_us += SIM_RADIO_RAMP_US + airtime;
+    sim_air_us += airtime;
+    if (frame_lost())
+        return MICROBIT_OK;
+
+    // Put the frame on the air, dropping the oldest if the host isn't listening
+    uint32_t len = buffer->length - (MICROBIT_RADIO_HEADER_SIZE - 1);
+    if (sim_tx_head - sim_tx_tail >= sizeof(sim_tx_frames) / sizeof(sim_tx_frames[0]))
+        sim_tx_tail += 1;
+    uint32_t slot = sim_tx_head % (sizeof(sim_tx_frames) / sizeof(sim_tx_frames[0]));
+    sim_tx_frames[slot].length = (uint8_t) len;
+    memcpy(sim_tx_frames[slot].data, buffer->payload, len);
+    sim_tx_head += 1;
+
+    return MICROBIT_OK;
+}
+
+FrameBuffer *MicroBitRadio::recv() {
+    FrameBuffer *p = rxQueue;
+    if (p) {
+        rxQueue = p->next;
+        queueDepth -= 1;
+    }
+    return p;
+}
+
+int MicroBitRadio::queueRxBuf() {
+    // The RSSI is only kept for the latest frame, as in the DAL
+    rxBuf->rssi = getRSSI();
+    if (queueDepth >= MICROBIT_RADIO_MAXIMUM_RX_BUFFERS)
+        return MICROBIT_NO_RESOURCES;
+
+    FrameBuffer *newRxBuf = new FrameBuffer;
+    if (newRxBuf == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    rxBuf->next = NULL;
+    if (rxQueue == NULL)
+        rxQueue = rxBuf;
+    else {
+        FrameBuffer *p = rxQueue;
+        while (p->next != NULL)
+            p = p->next;
+        p->next = rxBuf;
+    }
+    queueDepth += 1;
+    rxBuf = newRxBuf;
+    return MICROBIT_OK;
+}
+
+FrameBuffer *MicroBitRadio::getRxBuf() {
+    return rxBuf;
+}
+
+void MicroBitRadio::idleTick() {
+    while (rxQueue) {
+        FrameBuffer *p = rxQueue;
+        if (p->protocol == MICROBIT_RADIO_PROTOCOL_DATAGRAM)
+            datagram.packetReceived();
+        // A frame nobody took is dropped
+        if (p == rxQueue) {
+            recv();
+            delete p;
+        }
+    }
+}
+
+/**
+ * RADIO interrupt, as the DAL handles it: a frame that arrived intact is
+ * queued, and the radio goes on listening into a fresh buffer
+ */
+extern "C" void RADIO_IRQHandler(void) {
+    if (NRF_RADIO->EVENTS_END) {
+        NRF_RADIO->EVENTS_END = 0;
+        if (NRF_RADIO->CRCSTATUS == 1 && sim_module_radio) {
+            sim_module_radio->setRSSI(-(int) NRF_RADIO->RSSISAMPLE);
+            sim_module_radio->queueRxBuf();
+            NRF_RADIO->PACKETPTR = (uintptr_t) sim_module_radio->getRxBuf();
+        } else if (sim_module_radio)
+            sim_module_radio->setRSSI(0);
+    }
+}
+
+int MicroBitRadio::sim_receive(const uint8_t *data, int length, int rssi) {
+    return sim_receive(data, length, rssi, NRF_RADIO->BASE0, group);
+}
+
+int MicroBitRadio::sim_receive(const uint8_t *data, int length, int rssi, uint32_t base,
+        uint8_t prefix) {
+    if (!enabled)
+        return MICROBIT_NOT_SUPPORTED;
+    if (length < 0 || length > MICROBIT_RADIO_MAX_PACKET_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
+    // Match the address against the enabled logical addresses, as the radio
+    // does before it raises any event
+    int pipe;
+    for (pipe = 0; pipe < 8; pipe += 1) {
+        if (!(NRF_RADIO->RXADDRESSES & (1 << pipe)))
+            continue;
+        uint32_t pipe_base = pipe == 0 ? NRF_RADIO->BASE0 : NRF_RADIO->BASE1;
+        uint32_t prefixes = pipe < 4 ? NRF_RADIO->PREFIX0 : NRF_RADIO->PREFIX1;
+        if (pipe_base == base && (uint8_t) (prefixes >> (8 * (pipe % 4))) == prefix)
+            break;
+    }
+    if (pipe == 8)
+        return MICROBIT_NO_DATA;
+    if (frame_lost()) {
+        sim_air_us += frame_airtime_us(length + MICROBIT_RADIO_HEADER_SIZE - 1);
+        return MICROBIT_NO_DATA;
+    }
+    NRF_RADIO->RXMATCH = (uint32_t) pipe;
+    NRF_RADIO->EVENTS_ADDRESS = 1;
+    sim_ppi_event(&NRF_RADIO->EVENTS_ADDRESS);
+
+    // The radio writes the frame into the buffer the driver left it
+    FrameBuffer *frame = (FrameBuffer *) NRF_RADIO->PACKETPTR;
+    if (frame == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    frame->length = length + MICROBIT_RADIO_HEADER_SIZE - 1;
+    frame->version = 1;
+    frame->group = prefix;
+    frame->protocol = MICROBIT_RADIO_PROTOCOL_DATAGRAM;
+    memcpy(frame->payload, data, length);
+    sim_air_us += frame_airtime_us(frame->length);
+    NRF_RADIO->RSSISAMPLE = (uint32_t) -rssi;
+    NRF_RADIO->CRCSTATUS = 1;
+    NRF_RADIO->EVENTS_END = 1;
+
+    // The interrupt queues it on the radio. The firmware only sees it once
+    // the idle fiber runs, from sim_run, so several frames can be waiting
+    // by then.
+    sim_irq_raise(RADIO_IRQn);
+    if (NRF_RADIO->PACKETPTR == (uintptr_t) frame && !NRF_RADIO->EVENTS_END)
+        return MICROBIT_NO_RESOURCES;
+    return MICROBIT_OK;
+}
+
+//
+// C API
+//
+void sim_advance_us(uint32_t us) {
+    uint64_t end = sim_clock_us + us;
+    // Timeouts fire at their own time on the way
+    while (Timeout::next_due() <= end) {
+        if (Timeout::next_due() > sim_clock_us)
+            sim_clock_us = Timeout::next_due();
+        Timeout::fire_due(sim_clock_us);
+    }
+    sim_clock_us = end;
+}
+
+uint64_t sim_time_us(void) {
+    return sim_clock_us;
+}
+
+int sim_radio_deliver(const uint8_t *data, uint32_t len, int rssi) {
+    if (sim_module_radio == NULL)
+        return MICROBIT_NOT_SUPPORTED;
+    return sim_module_radio->sim_receive(data, (int) len, rssi);
+}
+
+int sim_radio_deliver_to(const uint8_t *data, uint32_t len, int rssi, uint32_t base,
+        uint8_t prefix) {
+    if (sim_module_radio == NULL)
+        return MICROBIT_NOT_SUPPORTED;
+    return sim_module_radio->sim_receive(data, (int) len, rssi, base, prefix);
+}
+
+uint64_t sim_radio_airtime_us(void) {
+    return sim_air_us;
+}
+
+void sim_radio_set_loss(double probability, uint32_t seed) {
+    sim_loss = (uint32_t) (probability * 65536 + 0.5);
+    sim_loss_state = seed ? seed : 1;
+}
+
+uint64_t sim_radio_lost(void) {
+    return sim_lost;
+}
+
+int sim_radio_take(uint8_t *data, uint32_t maxlen) {
+    if (sim_tx_head == sim_tx_tail)
+        return -1;
+    uint32_t slot = sim_tx_tail % (sizeof(sim_tx_frames) / sizeof(sim_tx_frames[0]));
+    uint32_t len = sim_tx_frames[slot].length;
+    if (len > maxlen)
+        len = maxlen;
+    memcpy(data, sim_tx_frames[slot].data, len);
+    sim_tx_tail += 1;
+    return (int) len;
+}
@@ -0,0 +1,87 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+ * Heap accounting for the simulation. Every C++ allocation made by the
+ * firmware or the DAL stand-ins goes through these operators, so checks
+ * can confirm that a code path doesn't touch the heap.
+ */
+
+#include <stdlib.h>
+#include <new>
+
+#include "sim_api.h"
+
+static uint32_t heap_allocations;
+static uint32_t heap_live;
+
+static void *heap_alloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    heap_allocations += 1;
+    heap_live += 1;
+    return p;
+}
+
+static void heap_free(void *p) {
+    if (p == NULL)
+        return;
+    heap_live -= 1;
+    free(p);
+}
+
+void *operator new(size_t size) {
+    return heap_alloc(size);
+}
+
+void *operator new[](size_t size) {
+    return heap_alloc(size);
+}
+
+void operator delete(void *p) noexcept {
+    heap_free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    heap_free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept {
+    (void) size;
+    heap_free(p);
+}
+
+void operator delete[](void *p, size_t size) noexcept {
+    (void) size;
+    heap_free(p);
+}
+
+uint32_t sim_heap_allocations(void) {
+    return heap_allocations;
+}
+
+uint32_t sim_heap_live(void) {
+    return heap_live;
+}
@@ -0,0 +1,493 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+
+#include "mbed.h"
+#include "sim_api.h"
+
+// Interrupt handlers the firmware or the DAL may provide
+extern "C" void SPI1_TWI1_IRQHandler(void) __attribute__((weak));
+extern "C" void RADIO_IRQHandler(void) __attribute__((weak));
+extern "C" void TIMER0_IRQHandler(void) __attribute__((weak));
+
+static uint8_t irq_enabled[SIM_IRQn_COUNT];
+static uint8_t irq_pending[SIM_IRQn_COUNT];
+static uint8_t irq_masked;
+
+// State of the simulated SPI master
+static uint8_t spis_selected;
+static uint8_t spis_ignored;
+static uint32_t spis_clocked;
+// Every byte clocked since startup
+static uint64_t spi_total_clocked;
+
+/**
+ * SPIS semaphore tasks
+ */
+static void spis_acquire(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value)
+        return;
+    // If the SPIS is mid-transaction, the CPU has to wait its turn
+    if (sim_spis1.SEMSTAT == SPIS_SEMSTAT_SEMSTAT_SPIS) {
+        sim_spis1.SEMSTAT = SPIS_SEMSTAT_SEMSTAT_CPUPending;
+        return;
+    }
+    sim_spis1.SEMSTAT = SPIS_SEMSTAT_SEMSTAT_CPU;
+    sim_spis1.EVENTS_ACQUIRED = 1;
+}
+
+static void spis_release(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value)
+        return;
+    if (sim_spis1.SEMSTAT == SPIS_SEMSTAT_SEMSTAT_CPU)
+        sim_spis1.SEMSTAT = SPIS_SEMSTAT_SEMSTAT_Free;
+}
+
+static void spis_intenset(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    sim_spis1.INTENSET.value |= value;
+    sim_spis1.INTENCLR.value = sim_spis1.INTENSET.value;
+}
+
+static void spis_intenclr(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    sim_spis1.INTENSET.value &= ~value;
+    sim_spis1.INTENCLR.value = sim_spis1.INTENSET.value;
+}
+
+// Status bits are cleared by writing one
+static void spis_status(sim_reg_t *reg, uint32_t value) {
+    reg->value &= ~value;
+}
+
+NRF_SPIS_Type sim_spis1 = {
+    { 0, spis_acquire },
+    { 0, spis_release },
+    0, 0, 0,
+    { 0, spis_intenset },
+    { 0, spis_intenclr },
+    SPIS_SEMSTAT_SEMSTAT_CPU,
+    { 0, spis_status },
+    0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0,
+    0, 0, 0
+};
+
+/**
+ * RADIO tasks complete at once: the ramp up and down times are not modelled
+ */
+static void radio_rxen(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value)
+        return;
+    sim_radio.STATE = RADIO_STATE_STATE_RxIdle;
+    sim_radio.EVENTS_READY = 1;
+}
+
+static void radio_start(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (value && sim_radio.STATE == RADIO_STATE_STATE_RxIdle)
+        sim_radio.STATE = RADIO_STATE_STATE_Rx;
+}
+
+static void radio_disable(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value)
+        return;
+    sim_radio.STATE = RADIO_STATE_STATE_Disabled;
+    sim_radio.EVENTS_DISABLED = 1;
+}
+
+// Energy on each channel in -dBm, as RSSISAMPLE reports it, set with
+// sim_radio_set_energy. Channels default to a quiet noise floor.
+static uint8_t channel_energy[101];
+
+/**
+ * An RSSI sample completes at once, reading the energy on the channel the
+ * radio is tuned to
+ */
+static void radio_rssistart(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value || sim_radio.STATE != RADIO_STATE_STATE_Rx)
+        return;
+    uint8_t energy = sim_radio.FREQUENCY <= 100 ? channel_energy[sim_radio.FREQUENCY] : 0;
+    sim_radio.RSSISAMPLE = energy ? energy : 100;
+    sim_radio.EVENTS_RSSIEND = 1;
+}
+
+NRF_RADIO_Type sim_radio = {
+    { 0, NULL },
+    { 0, radio_rxen },
+    { 0, radio_start },
+    { 0, NULL },
+    { 0, radio_disable },
+    { 0, radio_rssistart },
+    { 0, NULL },
+    0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0
+};
+
+/**
+ * TIMER0, only as a counter of its COUNT task
+ */
+static uint8_t timer0_running;
+static uint32_t timer0_count;
+
+static void timer0_start(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (value)
+        timer0_running = 1;
+}
+
+static void timer0_stop(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (value)
+        timer0_running = 0;
+}
+
+static void timer0_clear(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (value)
+        timer0_count = 0;
+}
+
+static void timer0_tick(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value || !timer0_running || sim_timer0.MODE != TIMER_MODE_MODE_Counter)
+        return;
+    timer0_count += 1;
+    for (int i = 0; i < 4; i += 1) {
+        if (timer0_count != sim_timer0.CC[i])
+            continue;
+        sim_timer0.EVENTS_COMPARE[i] = 1;
+        if (sim_timer0.SHORTS & (TIMER_SHORTS_COMPARE0_CLEAR_Msk << i))
+            timer0_count = 0;
+        if (sim_timer0.INTENSET & (TIMER_INTENSET_COMPARE0_Msk << i))
+            sim_irq_raise(TIMER0_IRQn);
+    }
+}
+
+static void timer0_capture(sim_reg_t *reg, uint32_t value) {
+    if (value)
+        sim_timer0.CC[reg - sim_timer0.TASKS_CAPTURE] = timer0_count;
+}
+
+NRF_TIMER_Type sim_timer0 = {
+    { 0, timer0_start },
+    { 0, timer0_stop },
+    { 0, timer0_tick },
+    { 0, timer0_clear },
+    { 0, timer0_stop },
+    {
+        { 0, timer0_capture },
+        { 0, timer0_capture },
+        { 0, timer0_capture },
+        { 0, timer0_capture }
+    },
+    {0, 0, 0, 0},
+    0, 0, 0, 0, 0, 0,
+    {0, 0, 0, 0},
+    0
+};
+
+/**
+ * TIMER1, ticking at 16MHz >> PRESCALER of simulated time
+ */
+static uint8_t timer1_running;
+static uint64_t timer1_base_us;
+static uint64_t timer1_held;
+
+static uint64_t timer1_ticks(void) {
+    uint64_t ticks = timer1_held;
+    if (timer1_running)
+        ticks += ((sim_time_us() - timer1_base_us) * 16) >> sim_timer1.PRESCALER;
+    return ticks;
+}
+
+static void timer1_start(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value || timer1_running)
+        return;
+    timer1_base_us = sim_time_us();
+    timer1_running = 1;
+}
+
+static void timer1_stop(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value || !timer1_running)
+        return;
+    timer1_held = timer1_ticks();
+    timer1_running = 0;
+}
+
+static void timer1_clear(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    if (!value)
+        return;
+    timer1_held = 0;
+    timer1_base_us = sim_time_us();
+}
+
+static void timer1_capture(sim_reg_t *reg, uint32_t value) {
+    static const uint32_t masks[] = {0xFFFF, 0xFF, 0xFFFFFF, 0xFFFFFFFF};
+    if (!value)
+        return;
+    sim_timer1.CC[reg - sim_timer1.TASKS_CAPTURE] =
+        (uint32_t) timer1_ticks() & masks[sim_timer1.BITMODE & 3];
+}
+
+NRF_TIMER_Type sim_timer1 = {
+    { 0, timer1_start },
+    { 0, timer1_stop },
+    { 0, NULL },
+    { 0, timer1_clear },
+    { 0, timer1_stop },
+    {
+        { 0, timer1_capture },
+        { 0, timer1_capture },
+        { 0, timer1_capture },
+        { 0, timer1_capture }
+    },
+    {0, 0, 0, 0},
+    0, 0, 0, 0, 0, 0,
+    {0, 0, 0, 0},
+    0
+};
+
+/**
+ * PPI channel enables are set and cleared by writing ones
+ */
+static void ppi_chenset(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    sim_ppi.CHEN |= value;
+}
+
+static void ppi_chenclr(sim_reg_t *reg, uint32_t value) {
+    (void) reg;
+    sim_ppi.CHEN &= ~value;
+}
+
+NRF_PPI_Type sim_ppi = {
+    0,
+    { 0, ppi_chenset },
+    { 0, ppi_chenclr },
+    {}
+};
+
+void sim_ppi_event(uint32_t *event) {
+    for (int i = 0; i < 16; i += 1) {
+        if ((sim_ppi.CHEN & (1UL << i)) && sim_ppi.CH[i].EEP == (uintptr_t) event &&
+                sim_ppi.CH[i].TEP)
+            *(sim_reg_t *) sim_ppi.CH[i].TEP = 1;
+    }
+}
+
+/**
+ * NVIC
+ */
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    irq_enabled[irq] = 1;
+    if (irq_pending[irq])
+        sim_irq_raise(irq);
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    irq_enabled[irq] = 0;
+}
+
+void NVIC_ClearPendingIRQ(IRQn_Type irq) {
+    irq_pending[irq] = 0;
+}
+
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority) {
+    (void) irq;
+    (void) priority;
+}
+
+void __disable_irq(void) {
+    irq_masked = 1;
+}
+
+void __enable_irq(void) {
+    irq_masked = 0;
+    for (int irq = 0; irq < SIM_IRQn_COUNT; irq += 1) {
+        if (irq_pending[irq] && irq_enabled[irq])
+            sim_irq_raise((IRQn_Type) irq);
+    }
+}
+
+void sim_irq_raise(IRQn_Type irq) {
+    void (*handler)(void) = NULL;
+    switch (irq) {
+        case RADIO_IRQn:
+            handler = RADIO_IRQHandler;
+            break;
+        case SPI1_TWI1_IRQn:
+            handler = SPI1_TWI1_IRQHandler;
+            break;
+        case TIMER0_IRQn:
+            handler = TIMER0_IRQHandler;
+            break;
+        default:
+            break;
+    }
+    if (irq_masked || !irq_enabled[irq]) {
+        irq_pending[irq] = 1;
+        return;
+    }
+    irq_pending[irq] = 0;
+    if (handler)
+        handler();
+}
+
+/**
+ * Raise the SPIS interrupt if the firmware has asked for it
+ */
+static void spis_interrupt(void) {
+    if (irq_masked || !irq_enabled[SPI1_TWI1_IRQn])
+        return;
+    if ((sim_spis1.INTENSET.value & SPIS_INTENSET_END_Msk) && sim_spis1.EVENTS_END && SPI1_TWI1_IRQHandler)
+        SPI1_TWI1_IRQHandler();
+}
+
+/**
+ * mbed SPISlave
+ */
+SPISlave::SPISlave(PinName mosi, PinName miso, PinName sclk, PinName ssel) {
+    _spi.spis = NRF_SPIS1;
+    _spi.spis->PSELMOSI = mosi;
+    _spi.spis->PSELMISO = miso;
+    _spi.spis->PSELSCK = sclk;
+    _spi.spis->PSELCSN = ssel;
+    _spi.spis->ENABLE = 2;
+    _spi.spis->MAXRX = 1;
+    _spi.spis->MAXTX = 1;
+    _spi.spis->TASKS_RELEASE = 1;
+}
+
+void SPISlave::format(int bits, int mode) {
+    (void) bits;
+    _spi.spis->CONFIG = mode;
+}
+
+void SPISlave::frequency(int hz) {
+    (void) hz;
+}
+
+int SPISlave::receive(void) {
+    return _spi.spis->EVENTS_END ? 1 : 0;
+}
+
+int SPISlave::read(void) {
+    return *(uint8_t *) _spi.spis->RXDPTR;
+}
+
+void SPISlave::reply(int value) {
+    _spi.spis->TASKS_ACQUIRE = 1;
+    *(uint8_t *) _spi.spis->TXDPTR = (uint8_t) value;
+    _spi.spis->TASKS_RELEASE = 1;
+}
+
+void sim_radio_set_energy(uint8_t channel, int rssi) {
+    if (channel <= 100)
+        channel_energy[channel] = (uint8_t) -rssi;
+}
+
+void wait_us(int us) {
+    sim_advance_us(us);
+}
+
+/**
+ * SPI master side of the bus
+ */
+void sim_spi_select(void) {
+    spis_selected = 1;
+    spis_clocked = 0;
+    // If the CPU holds the semaphore, the whole transaction is answered
+    // with DEF and the incoming data is thrown away.
+    spis_ignored = sim_spis1.SEMSTAT == SPIS_SEMSTAT_SEMSTAT_CPU ||
+                   sim_spis1.SEMSTAT == SPIS_SEMSTAT_SEMSTAT_CPUPending;
+    if (!spis_ignored)
+        sim_spis1.SEMSTAT = SPIS_SEMSTAT_SEMSTAT_SPIS;
+}
+
+void sim_spi_exchange(const uint8_t *mosi, uint8_t *miso, uint32_t len) {
+    for (uint32_t i = 0; i < len; i += 1, spis_clocked += 1) {
+        uint8_t out;
+        if (spis_ignored)
+            out = (uint8_t) sim_spis1.DEF;
+        else if (spis_clocked < sim_spis1.MAXTX)
+            out = ((const uint8_t *) sim_spis1.TXDPTR)[spis_clocked];
+        else {
+            out = (uint8_t) sim_spis1.ORC;
+            sim_spis1.STATUS.value |= SPIS_STATUS_OVERREAD_Msk;
+        }
+        if (!spis_ignored) {
+            if (spis_clocked < sim_spis1.MAXRX)
+                ((uint8_t *) sim_spis1.RXDPTR)[spis_clocked] = mosi ? mosi[i] : 0;
+            else
+                sim_spis1.STATUS.value |= SPIS_STATUS_OVERFLOW_Msk;
+        }
+        if (miso)
+            miso[i] = out;
+    }
+    spi_total_clocked += len;
+}
+
+uint64_t sim_spi_bytes(void) {
+    return spi_total_clocked;
+}
+
+void sim_spi_deselect(void) {
+    spis_selected = 0;
+    if (spis_ignored)
+        return;
+
+    // Finish the transaction
+    sim_spis1.AMOUNTRX = spis_clocked < sim_spis1.MAXRX ? spis_clocked : sim_spis1.MAXRX;
+    sim_spis1.AMOUNTTX = spis_clocked < sim_spis1.MAXTX ? spis_clocked : sim_spis1.MAXTX;
+    sim_spis1.EVENTS_END = 1;
+
+    // Hand the semaphore on, following the END->ACQUIRE short if enabled
+    if (sim_spis1.SHORTS & SPIS_SHORTS_END_ACQUIRE_Msk ||
+            sim_spis1.SEMSTAT == SPIS_SEMSTAT_SEMSTAT_CPUPending) {
+        sim_spis1.SEMSTAT = SPIS_SEMSTAT_SEMSTAT_CPU;
+        sim_spis1.EVENTS_ACQUIRED = 1;
+    } else
+        sim_spis1.SEMSTAT = SPIS_SEMSTAT_SEMSTAT_Free;
+
+    spis_interrupt();
+}
+
+uint32_t sim_spi_transfer(const uint8_t *mosi, uint8_t *miso, uint32_t len) {
+    sim_spi_select();
+    sim_spi_exchange(mosi, miso, len);
+    sim_spi_deselect();
+    return len;
+}
@@ -0,0 +1,105 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mbed.h"
+#include "LatencyHistogram.h"
+
+/**
+ * Constructor: create empty histograms
+ */
+LatencyHistogram::LatencyHistogram() :
+    used(0)
+{
+}
+
+/**
+ * Run TIMER1 at 1MHz as a free running 16 bit counter
+ */
+void LatencyHistogram::start_timer(void) {
+    NRF_TIMER1->TASKS_STOP = 1;
+    NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer;
+    NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+    // 16MHz / 2^4
+    NRF_TIMER1->PRESCALER = 4;
+    NRF_TIMER1->TASKS_CLEAR = 1;
+    NRF_TIMER1->TASKS_START = 1;
+}
+
+/**
+ * Capture the current count
+ */
+uint16_t LatencyHistogram::now(uint8_t channel) {
+    NRF_TIMER1->TASKS_CAPTURE[channel] = 1;
+    return (uint16_t) NRF_TIMER1->CC[channel];
+}
+
+/**
+ * Add one latency to the histogram for cmd
+ */
+void LatencyHistogram::record(uint8_t cmd, uint16_t us) {
+    latency_slot_t *slot = (latency_slot_t *) find(cmd);
+    if (slot == NULL) {
+        if (used == PYB_RADIO_LATENCY_SLOTS)
+            return;
+        slot = &slots[used++];
+        memset(slot, 0, sizeof(latency_slot_t));
+        slot->cmd = cmd;
+    }
+
+    // Find the bucket, doubling in width from 16us
+    uint8_t bucket = 0;
+    for (uint16_t t = us >> 4; t != 0 && bucket < LATENCY_BUCKETS - 1; t >>= 1)
+        bucket += 1;
+
+    if (slot->counts[bucket] != 0xFFFF)
+        slot->counts[bucket] += 1;
+    if (us > slot->max)
+        slot->max = us;
+}
+
+/**
+ * Return the histogram for cmd, or NULL
+ */
+const latency_slot_t *LatencyHistogram::find(uint8_t cmd) {
+    for (uint8_t i = 0; i < used; i += 1)
+        if (slots[i].cmd == cmd)
+            return &slots[i];
+    return NULL;
+}
+
+/**
+ * List the opcodes that have histograms
+ */
+uint8_t LatencyHistogram::commands(uint8_t *out) {
+    for (uint8_t i = 0; i < used; i += 1)
+        out[i] = slots[i].cmd;
+    return used;
+}
+
+/**
+ * Empty all histograms
+ */
+void LatencyHistogram::clear(void) {
+    used = 0;
+}
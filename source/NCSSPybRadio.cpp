@@ -48,6 +48,51 @@ DEALINGS IN THE SOFTWARE.
 #pragma GCC diagnostic pop
 #endif
 
+// What the radio said about each frame as its address arrived, keyed on the
+// buffer it is received into. A frame that fails its CRC, or that the radio
+// driver has no room for, leaves the driver receiving into the same buffer,
+// so the next frame there replaces its record.
+typedef struct {
+    uintptr_t frame;
+    uint32_t time;
+    uint8_t pipe;
+} radio_rx_record_t;
+
+static volatile radio_rx_record_t rx_records[NCSS_RADIO_RX_INFO];
+// Record to reuse when every record is taken
+static uint8_t rx_record_next;
+
+/**
+ * TIMER0 interrupt, raised through PPI on every RADIO ADDRESS event. The
+ * radio driver only moves PACKETPTR on at END, a whole frame later, so
+ * PACKETPTR and RXMATCH still belong to the frame that is arriving.
+ */
+extern "C" void TIMER0_IRQHandler(void) {
+    NRF_TIMER0->EVENTS_COMPARE[0] = 0;
+    uintptr_t frame = NRF_RADIO->PACKETPTR;
+    if (frame == 0)
+        return;
+
+    int slot = -1;
+    for (int i = 0; i < NCSS_RADIO_RX_INFO; i += 1) {
+        if (rx_records[i].frame == frame) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 && rx_records[i].frame == 0)
+            slot = i;
+    }
+    if (slot < 0) {
+        slot = rx_record_next;
+        rx_record_next = (rx_record_next + 1) % NCSS_RADIO_RX_INFO;
+    }
+
+    volatile radio_rx_record_t *r = &rx_records[slot];
+    r->frame = frame;
+    r->time = (uint32_t) system_timer_current_time_us();
+    r->pipe = (uint8_t) NRF_RADIO->RXMATCH;
+}
+
 /**
   * Constructor.
   *
@@ -63,10 +108,18 @@ NCSSPybRadio::NCSSPybRadio() :
     messageBus(),
     thermometer(storage),
     led_io(MICROBIT_ID_IO_P0, P0_21, PIN_CAPABILITY_STANDARD),
+    data_ready(MICROBIT_ID_IO_P1, (PinName) PYB_RADIO_DATA_READY_PIN, PIN_CAPABILITY_DIGITAL),
     radio()
 {
     // Clear our status
     status = 0;
+
+    // Only receive on the group address, as MicroBitRadio does
+    rx_pipes = 0x01;
+    memset(pipe_prefix, 0, sizeof(pipe_prefix));
+    pipe_prefix[0] = MICROBIT_RADIO_DEFAULT_GROUP;
+    pipe_base = MICROBIT_RADIO_BASE_ADDRESS;
+    rate = RADIO_MODE_MODE_Nrf_1Mbit;
 }
 
 /**
@@ -91,6 +144,23 @@ void NCSSPybRadio::init()
     // Bring up fiber scheduler.
     scheduler_init(messageBus);
 
+    // Count each address the radio receives on TIMER0, interrupting on
+    // every one, so that frames are recorded without touching the radio
+    // driver's own interrupt
+    NRF_TIMER0->TASKS_STOP = 1;
+    NRF_TIMER0->MODE = TIMER_MODE_MODE_Counter;
+    NRF_TIMER0->BITMODE = TIMER_BITMODE_BITMODE_08Bit;
+    NRF_TIMER0->CC[0] = 1;
+    NRF_TIMER0->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Msk;
+    NRF_TIMER0->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+    NRF_TIMER0->TASKS_CLEAR = 1;
+    NRF_TIMER0->TASKS_START = 1;
+    NRF_PPI->CH[NCSS_RADIO_RX_PPI_CHANNEL].EEP = (uintptr_t) &NRF_RADIO->EVENTS_ADDRESS;
+    NRF_PPI->CH[NCSS_RADIO_RX_PPI_CHANNEL].TEP = (uintptr_t) &NRF_TIMER0->TASKS_COUNT;
+    NRF_PPI->CHENSET = 1UL << NCSS_RADIO_RX_PPI_CHANNEL;
+    NVIC_ClearPendingIRQ(TIMER0_IRQn);
+    NVIC_EnableIRQ(TIMER0_IRQn);
+
     status |= MODULE_INITIALIZED;
 }
 
@@ -132,3 +202,220 @@ uint8_t NCSSPybRadio::radio_power(void) {
     // Return value
     return txpower_mbl;
 }
+
+// Bitmap of the logical addresses being received on
+uint8_t NCSSPybRadio::radio_pipes(void) {
+    return (uint8_t) NRF_RADIO->RXADDRESSES;
+}
+
+// Address prefix of a logical address, 0 if out of range
+uint8_t NCSSPybRadio::radio_pipe_prefix(uint8_t pipe) {
+    if (pipe >= NCSS_RADIO_PIPES)
+        return 0;
+    uint32_t prefix = (pipe < 4) ? NRF_RADIO->PREFIX0 : NRF_RADIO->PREFIX1;
+    return (uint8_t) (prefix >> (8 * (pipe % 4)));
+}
+
+// Base address of logical addresses 1 to 7
+uint32_t NCSSPybRadio::radio_pipe_base(void) {
+    return NRF_RADIO->BASE1;
+}
+
+// Logical address the last packet was received on
+uint8_t NCSSPybRadio::radio_rx_pipe(void) {
+    return (uint8_t) NRF_RADIO->RXMATCH;
+}
+
+// Data rate, as a RADIO_MODE_MODE_* value
+uint8_t NCSSPybRadio::radio_rate(void) {
+    return (uint8_t) NRF_RADIO->MODE;
+}
+
+/**
+ * Set the over the air data rate
+ */
+int NCSSPybRadio::radio_set_rate(uint8_t mode) {
+    if (mode != RADIO_MODE_MODE_Nrf_1Mbit && mode != RADIO_MODE_MODE_Nrf_2Mbit &&
+            mode != RADIO_MODE_MODE_Nrf_250Kbit)
+        return MICROBIT_INVALID_PARAMETER;
+
+    rate = mode;
+    radio_restore_config();
+
+    return MICROBIT_OK;
+}
+
+/**
+ * Receive on logical address pipe, with the given address prefix
+ */
+int NCSSPybRadio::radio_set_pipe(uint8_t pipe, uint8_t prefix) {
+    if (pipe >= NCSS_RADIO_PIPES)
+        return MICROBIT_INVALID_PARAMETER;
+
+    pipe_prefix[pipe] = prefix;
+    rx_pipes |= 1 << pipe;
+    // Let the radio driver know about group changes, it puts the group into
+    // the frames it sends
+    if (pipe == 0)
+        radio.setGroup(prefix);
+    radio_restore_config();
+
+    return MICROBIT_OK;
+}
+
+/**
+ * Stop receiving on a logical address pipe
+ */
+int NCSSPybRadio::radio_clear_pipe(uint8_t pipe) {
+    if (pipe >= NCSS_RADIO_PIPES)
+        return MICROBIT_INVALID_PARAMETER;
+
+    rx_pipes &= ~(1 << pipe);
+    radio_restore_config();
+
+    return MICROBIT_OK;
+}
+
+/**
+ * Set the base address shared by pipes 1 to 7
+ */
+void NCSSPybRadio::radio_set_pipe_base(uint32_t base) {
+    pipe_base = base;
+    radio_restore_config();
+}
+
+/**
+ * Find what the radio recorded about a received frame
+ */
+int NCSSPybRadio::radio_rx_info(FrameBuffer *frame, radio_rx_info_t *info) {
+    info->rssi = (int8_t) frame->rssi;
+
+    // The interrupt may reuse a record while it is being read
+    __disable_irq();
+    for (int i = 0; i < NCSS_RADIO_RX_INFO; i += 1) {
+        volatile radio_rx_record_t *r = &rx_records[i];
+        if (r->frame != (uintptr_t) frame)
+            continue;
+        info->time = r->time;
+        info->pipe = r->pipe;
+        r->frame = 0;
+        __enable_irq();
+        return MICROBIT_OK;
+    }
+    __enable_irq();
+
+    info->time = (uint32_t) system_timer_current_time_us();
+    info->pipe = radio_rx_pipe();
+    return MICROBIT_NO_DATA;
+}
+
+// Time between RSSI samples while scanning. A sample takes the radio about
+// 9us to settle on.
+static const uint16_t RADIO_SCAN_SAMPLE_US = 16;
+
+/**
+ * Measure the energy on a range of channels
+ */
+int NCSSPybRadio::radio_scan(uint8_t first, uint8_t count, uint16_t dwell_us, uint8_t *energy) {
+    if (count == 0 || first > 100 || count > 101 - first ||
+            dwell_us > PYB_RADIO_SCAN_MAX_DWELL_US)
+        return MICROBIT_INVALID_PARAMETER;
+
+    uint8_t running = radio_enabled();
+    uint32_t frequency = NRF_RADIO->FREQUENCY;
+    uint32_t shorts = NRF_RADIO->SHORTS;
+    uint16_t samples = dwell_us / RADIO_SCAN_SAMPLE_US;
+    if (samples == 0)
+        samples = 1;
+    // Leave the channels that would take too long for the next scan
+    uint32_t fit = PYB_RADIO_SCAN_MAX_US / ((uint32_t) samples * RADIO_SCAN_SAMPLE_US);
+    if (fit == 0)
+        fit = 1;
+    if (count > fit)
+        count = (uint8_t) fit;
+
+    // Keep the radio driver from seeing frames heard on other channels, and
+    // keep the radio listening rather than stopping after a frame
+    NVIC_DisableIRQ(RADIO_IRQn);
+    NRF_RADIO->SHORTS = 0;
+
+    for (uint8_t i = 0; i < count; i += 1) {
+        // The frequency only takes effect when the radio is next enabled
+        if (radio_enabled()) {
+            NRF_RADIO->EVENTS_DISABLED = 0;
+            NRF_RADIO->TASKS_DISABLE = 1;
+            while (NRF_RADIO->EVENTS_DISABLED == 0);
+        }
+        NRF_RADIO->FREQUENCY = first + i;
+        NRF_RADIO->EVENTS_READY = 0;
+        NRF_RADIO->TASKS_RXEN = 1;
+        while (NRF_RADIO->EVENTS_READY == 0);
+        NRF_RADIO->TASKS_START = 1;
+
+        // Keep the strongest sample, the smallest RSSISAMPLE
+        uint8_t peak = 127;
+        for (uint16_t j = 0; j < samples; j += 1) {
+            NRF_RADIO->EVENTS_RSSIEND = 0;
+            NRF_RADIO->TASKS_RSSISTART = 1;
+            while (NRF_RADIO->EVENTS_RSSIEND == 0);
+            uint8_t sample = (uint8_t) (NRF_RADIO->RSSISAMPLE & 0x7F);
+            if (sample < peak)
+                peak = sample;
+            wait_us(RADIO_SCAN_SAMPLE_US);
+        }
+        energy[i] = peak;
+    }
+
+    // Put the radio back as it was
+    NRF_RADIO->EVENTS_DISABLED = 0;
+    NRF_RADIO->TASKS_DISABLE = 1;
+    while (NRF_RADIO->EVENTS_DISABLED == 0);
+    NRF_RADIO->FREQUENCY = frequency;
+    NRF_RADIO->SHORTS = shorts;
+    if (running) {
+        NRF_RADIO->EVENTS_READY = 0;
+        NRF_RADIO->TASKS_RXEN = 1;
+        while (NRF_RADIO->EVENTS_READY == 0);
+        NRF_RADIO->EVENTS_END = 0;
+        NRF_RADIO->TASKS_START = 1;
+        NVIC_ClearPendingIRQ(RADIO_IRQn);
+        NVIC_EnableIRQ(RADIO_IRQn);
+    }
+
+    return count;
+}
+
+/**
+ * Write the receive addresses and data rate back into the radio
+ */
+void NCSSPybRadio::radio_restore_config(void) {
+    // These only take effect when the radio is next enabled, so stop
+    // receiving while they are written, as MicroBitRadio::setFrequencyBand does
+    uint8_t running = radio_enabled();
+    if (running) {
+        NRF_RADIO->EVENTS_DISABLED = 0;
+        NRF_RADIO->TASKS_DISABLE = 1;
+        while (NRF_RADIO->EVENTS_DISABLED == 0);
+    }
+
+    NRF_RADIO->MODE = rate;
+    // Prefix 0 belongs to the radio driver, which sets it from the group
+    NRF_RADIO->PREFIX0 = (NRF_RADIO->PREFIX0 & 0xFF) |
+        (uint32_t) pipe_prefix[1] << 8 |
+        (uint32_t) pipe_prefix[2] << 16 |
+        (uint32_t) pipe_prefix[3] << 24;
+    NRF_RADIO->PREFIX1 = (uint32_t) pipe_prefix[4] |
+        (uint32_t) pipe_prefix[5] << 8 |
+        (uint32_t) pipe_prefix[6] << 16 |
+        (uint32_t) pipe_prefix[7] << 24;
+    NRF_RADIO->BASE1 = pipe_base;
+    NRF_RADIO->RXADDRESSES = rx_pipes;
+
+    if (running) {
+        NRF_RADIO->EVENTS_READY = 0;
+        NRF_RADIO->TASKS_RXEN = 1;
+        while (NRF_RADIO->EVENTS_READY == 0);
+        NRF_RADIO->EVENTS_END = 0;
+        NRF_RADIO->TASKS_START = 1;
+    }
+}
@@ -0,0 +1,82 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mbed.h"
+#include "MicroBitSystemTimer.h"
+#include "PybRadioTrace.h"
+
+#if PYB_RADIO_TRACE
+
+static trace_record_t trace_ring[PYB_RADIO_TRACE_DEPTH];
+// Free running sequence number of the next record, the slot is seq % depth
+static volatile uint32_t trace_next;
+static volatile uint8_t trace_enabled = 1;
+
+/**
+ * Add a record to the ring
+ */
+void trace_event(trace_event_t event, uint8_t arg, uint16_t data) {
+    if (!trace_enabled)
+        return;
+    uint32_t now = (uint32_t) system_timer_current_time_us();
+
+    __disable_irq();
+    trace_record_t *record = &trace_ring[trace_next % PYB_RADIO_TRACE_DEPTH];
+    record->time = now;
+    record->event = (uint8_t) event;
+    record->arg = arg;
+    record->data = data;
+    trace_next += 1;
+    __enable_irq();
+}
+
+/**
+ * Pause or resume recording
+ */
+void trace_enable(uint8_t enable) {
+    trace_enabled = enable;
+}
+
+/**
+ * Copy out records oldest first
+ */
+uint32_t trace_read(uint32_t from, trace_record_t *out, uint32_t max,
+        uint32_t *first, uint32_t *next) {
+    uint32_t n = 0;
+
+    __disable_irq();
+    uint32_t end = trace_next;
+    uint32_t oldest = end > PYB_RADIO_TRACE_DEPTH ? end - PYB_RADIO_TRACE_DEPTH : 0;
+    if (from < oldest || from > end)
+        from = oldest;
+    for (; n < max && from + n < end; n += 1)
+        out[n] = trace_ring[(from + n) % PYB_RADIO_TRACE_DEPTH];
+    __enable_irq();
+
+    *first = from;
+    *next = end;
+    return n;
+}
+
+#endif
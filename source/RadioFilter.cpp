@@ -0,0 +1,119 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mbed.h"
+#include "ErrorNo.h"
+#include "RadioFilter.h"
+
+/**
+ * Constructor: create an empty filter
+ */
+RadioFilter::RadioFilter() :
+    count(0),
+    accepted(0),
+    dropped(0)
+{
+}
+
+/**
+ * Add a rule matching packets that contain match at offset
+ */
+int RadioFilter::add(uint8_t offset, const uint8_t *match, uint8_t length) {
+    if (length == 0 || length > PYB_RADIO_FILTER_MATCH_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+    if (count >= PYB_RADIO_FILTER_RULES)
+        return MICROBIT_NO_RESOURCES;
+
+    filter_rule_t *r = &rules[count];
+    r->offset = offset;
+    r->length = length;
+    memcpy(r->match, match, length);
+    // Only publish the rule once it is complete, the radio event may run
+    // in between
+    count += 1;
+
+    return MICROBIT_OK;
+}
+
+/**
+ * Remove every rule
+ */
+void RadioFilter::clear(void) {
+    count = 0;
+}
+
+/**
+ * Check a received packet against the rules
+ */
+int RadioFilter::accept(const uint8_t *packet, uint8_t length) {
+    uint8_t n = count;
+    if (n == 0) {
+        accepted += 1;
+        return 1;
+    }
+    for (uint8_t i = 0; i < n; i += 1) {
+        const filter_rule_t *r = &rules[i];
+        if (r->offset + r->length > length)
+            continue;
+        // Most rules fail on the first byte, so check that before the rest
+        if (packet[r->offset] != r->match[0])
+            continue;
+        if (memcmp(packet + r->offset + 1, r->match + 1, r->length - 1) == 0) {
+            accepted += 1;
+            return 1;
+        }
+    }
+    dropped += 1;
+    return 0;
+}
+
+/**
+ * Number of rules in the table
+ */
+uint8_t RadioFilter::rule_count(void) {
+    return count;
+}
+
+/**
+ * Return rule i, or NULL if there is no such rule
+ */
+const filter_rule_t *RadioFilter::rule(uint8_t i) {
+    if (i >= count)
+        return NULL;
+    return &rules[i];
+}
+
+/**
+ * Number of packets accepted since startup
+ */
+uint32_t RadioFilter::accepted_count(void) {
+    return accepted;
+}
+
+/**
+ * Number of packets dropped since startup
+ */
+uint32_t RadioFilter::dropped_count(void) {
+    return dropped;
+}
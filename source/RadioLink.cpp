@@ -0,0 +1,726 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mbed.h"
+#include "ErrorNo.h"
+#include "RadioLink.h"
+
+/**
+ * Constructor: create a disabled link
+ */
+RadioLink::RadioLink(int (*transmit)(uint8_t *frame, int length)) :
+    transmit(transmit),
+    enabled(0),
+    node(0),
+    next_msg_id(0),
+    next_result(0),
+    ack_head(0),
+    ack_tail(0),
+    relaying(0),
+    ttl(LINK_DEFAULT_TTL),
+    backoff(LINK_DEFAULT_BACKOFF_MS),
+    next_flood_seq(0),
+    random_state(1),
+    coalescing(0),
+    coalesce_us(LINK_DEFAULT_COALESCE_US),
+    batch_length(0),
+    batch_pos(0)
+{
+    memset(reassembly, 0, sizeof(reassembly));
+    memset(peers, 0, sizeof(peers));
+    memset(unacked, 0, sizeof(unacked));
+    memset(results, 0, sizeof(results));
+    memset(seen, 0, sizeof(seen));
+    memset(relays, 0, sizeof(relays));
+    memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Turn the link layer on or off
+ */
+void RadioLink::enable(uint8_t on) {
+    enabled = on;
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_REASSEMBLY; i += 1)
+        reassembly[i].busy = 0;
+    // Reliable messages can't be acknowledged without the link header
+    if (!on) {
+        for (uint8_t i = 0; i < PYB_RADIO_LINK_WINDOW; i += 1)
+            if (unacked[i].busy)
+                finish(&unacked[i], LINK_FAILED);
+        ack_tail = ack_head;
+        set_relay(0, ttl, backoff);
+        set_coalesce(0, coalesce_us);
+    }
+}
+
+/**
+ * Whether the link layer is on
+ */
+uint8_t RadioLink::is_enabled(void) {
+    return enabled;
+}
+
+/**
+ * Set the node id put in the header of frames this node sends
+ */
+void RadioLink::set_node_id(uint16_t id) {
+    node = id;
+    // Neighbours pick different backoffs, even in a simulation
+    random_state = 0x9E3779B9 ^ id;
+}
+
+/**
+ * Node id put in the header of frames this node sends
+ */
+uint16_t RadioLink::node_id(void) {
+    return node;
+}
+
+/**
+ * Longest message that can currently be sent
+ */
+uint8_t RadioLink::max_message(void) {
+    if (!enabled)
+        return MICROBIT_RADIO_MAX_PACKET_SIZE;
+    return relaying ? LINK_FLOOD_DATA : PYB_RADIO_LINK_MAX_MESSAGE;
+}
+
+/**
+ * Send a message, in fragments if need be
+ */
+int RadioLink::send(const uint8_t *msg, uint8_t length, uint32_t now) {
+    uint8_t frame[MICROBIT_RADIO_MAX_PACKET_SIZE];
+
+    if (length > max_message())
+        return MICROBIT_INVALID_PARAMETER;
+    if (!enabled) {
+        memcpy(frame, msg, length);
+        return transmit(frame, length);
+    }
+    if (relaying)
+        return send_flood(msg, length, now);
+    if (length > LINK_DATA_SIZE)
+        return send_fragments(msg, length);
+
+    link_header_t *header = (link_header_t *) frame;
+    header->type = LINK_DATA;
+    header->src[0] = (uint8_t) node;
+    header->src[1] = (uint8_t) (node >> 8);
+    memcpy(frame + sizeof(link_header_t), msg, length);
+    return transmit(frame, sizeof(link_header_t) + length);
+}
+
+/**
+ * Split a message into LINK_FRAGMENT frames and send them in order
+ */
+int RadioLink::send_fragments(const uint8_t *msg, uint8_t length) {
+    uint8_t frame[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    link_header_t *header = (link_header_t *) frame;
+    link_fragment_t *fragment = (link_fragment_t *) (frame + sizeof(link_header_t));
+    uint8_t *data = frame + sizeof(link_header_t) + sizeof(link_fragment_t);
+
+    header->type = LINK_FRAGMENT;
+    header->src[0] = (uint8_t) node;
+    header->src[1] = (uint8_t) (node >> 8);
+    fragment->msg_id = next_msg_id++;
+    fragment->count = (length + LINK_FRAGMENT_DATA - 1) / LINK_FRAGMENT_DATA;
+
+    for (uint8_t i = 0; i < fragment->count; i += 1) {
+        uint8_t n = length - i * LINK_FRAGMENT_DATA;
+        if (n > LINK_FRAGMENT_DATA)
+            n = LINK_FRAGMENT_DATA;
+        fragment->index = i;
+        memcpy(data, msg + i * LINK_FRAGMENT_DATA, n);
+        int r = transmit(frame, (data - frame) + n);
+        if (r != MICROBIT_OK)
+            return r;
+    }
+    return MICROBIT_OK;
+}
+
+/**
+ * Handle a received frame
+ */
+int RadioLink::input(uint8_t *frame, uint8_t length, const uint8_t **msg, uint32_t now) {
+    *msg = frame;
+    batch_pos = batch_length = 0;
+    if (!enabled)
+        return length;
+
+    if (length < sizeof(link_header_t)) {
+        stats.invalid += 1;
+        return -1;
+    }
+    switch (frame[0] & LINK_TYPE_MASK) {
+        case LINK_DATA:
+            length -= sizeof(link_header_t);
+            memmove(frame, frame + sizeof(link_header_t), length);
+            return length;
+        case LINK_FRAGMENT:
+            return input_fragment(frame, length, msg, now);
+        case LINK_RELIABLE:
+            return input_reliable(frame, length, now);
+        case LINK_ACK:
+            input_ack(frame, length);
+            return -1;
+        case LINK_FLOOD:
+            return input_flood(frame, length, now);
+        case LINK_BATCH:
+            return input_batch(frame, length, msg);
+        default:
+            stats.invalid += 1;
+            return -1;
+    }
+}
+
+/**
+ * Find the reassembly of a message, or start one
+ */
+link_reassembly_t *RadioLink::find_reassembly(uint16_t src, uint8_t msg_id, uint32_t now) {
+    link_reassembly_t *slot = NULL, *oldest = NULL;
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_REASSEMBLY; i += 1) {
+        link_reassembly_t *r = &reassembly[i];
+        // Give up on messages that have taken too long
+        if (r->busy && now - r->started > PYB_RADIO_LINK_REASSEMBLY_MS) {
+            r->busy = 0;
+            stats.incomplete += 1;
+        }
+        if (!r->busy) {
+            if (slot == NULL)
+                slot = r;
+            continue;
+        }
+        if (r->src == src && r->msg_id == msg_id)
+            return r;
+        if (oldest == NULL || now - r->started > now - oldest->started)
+            oldest = r;
+    }
+    // Make room by dropping the message that has been waiting longest
+    if (slot == NULL) {
+        slot = oldest;
+        stats.incomplete += 1;
+    }
+    slot->busy = 1;
+    slot->src = src;
+    slot->msg_id = msg_id;
+    slot->count = 0;
+    slot->received = 0;
+    slot->length = 0;
+    slot->started = now;
+    return slot;
+}
+
+/**
+ * Store a fragment, and return the message if it was the last one missing
+ */
+int RadioLink::input_fragment(uint8_t *frame, uint8_t length, const uint8_t **msg,
+        uint32_t now) {
+    const uint8_t header_size = sizeof(link_header_t) + sizeof(link_fragment_t);
+    const link_header_t *header = (const link_header_t *) frame;
+    const link_fragment_t *fragment = (const link_fragment_t *) (frame + sizeof(link_header_t));
+    uint8_t n = length - header_size;
+
+    // Every fragment but the last must be full, and the message must fit
+    if (length <= header_size || fragment->count < 2 || fragment->count > LINK_MAX_FRAGMENTS ||
+            fragment->index >= fragment->count ||
+            (fragment->index < fragment->count - 1 && n != LINK_FRAGMENT_DATA) ||
+            fragment->index * LINK_FRAGMENT_DATA + n > PYB_RADIO_LINK_MAX_MESSAGE) {
+        stats.invalid += 1;
+        return -1;
+    }
+
+    uint16_t src = header->src[0] | header->src[1] << 8;
+    link_reassembly_t *r = find_reassembly(src, fragment->msg_id, now);
+    if (r->count == 0)
+        r->count = fragment->count;
+    else if (r->count != fragment->count) {
+        stats.invalid += 1;
+        return -1;
+    }
+
+    // Ignore repeats
+    uint16_t bit = 1 << fragment->index;
+    if (r->received & bit)
+        return -1;
+    memcpy(r->data + fragment->index * LINK_FRAGMENT_DATA, frame + header_size, n);
+    r->received |= bit;
+    if (fragment->index == fragment->count - 1)
+        r->length = fragment->index * LINK_FRAGMENT_DATA + n;
+
+    if (r->received != (uint16_t) ((1 << r->count) - 1))
+        return -1;
+    r->busy = 0;
+    stats.reassembled += 1;
+    *msg = r->data;
+    return r->length;
+}
+
+/**
+ * Find the sequence numbers kept for a node, or start keeping them in place
+ * of the least recently used node with nothing waiting to be acknowledged
+ */
+link_peer_t *RadioLink::find_peer(uint16_t node, uint32_t now) {
+    link_peer_t *slot = NULL;
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_PEERS; i += 1) {
+        link_peer_t *p = &peers[i];
+        if (p->in_use && p->node == node) {
+            p->last_used = now;
+            return p;
+        }
+        if (p->in_use) {
+            uint8_t waiting = 0;
+            for (uint8_t j = 0; j < PYB_RADIO_LINK_WINDOW; j += 1)
+                waiting |= unacked[j].busy && unacked[j].dst == p->node;
+            if (waiting)
+                continue;
+        }
+        if (slot == NULL || !p->in_use ||
+                (slot->in_use && now - p->last_used > now - slot->last_used))
+            slot = p;
+    }
+    // There are more peers than window entries, so one is always free
+    memset(slot, 0, sizeof(*slot));
+    slot->in_use = 1;
+    slot->node = node;
+    slot->last_used = now;
+    return slot;
+}
+
+/**
+ * Acknowledge a reliable frame, and pass its message on unless it is a repeat
+ */
+int RadioLink::input_reliable(uint8_t *frame, uint8_t length, uint32_t now) {
+    const uint8_t header_size = sizeof(link_header_t) + sizeof(link_reliable_t);
+    const link_header_t *header = (const link_header_t *) frame;
+    const link_reliable_t *reliable = (const link_reliable_t *) (frame + sizeof(link_header_t));
+
+    if (length < header_size) {
+        stats.invalid += 1;
+        return -1;
+    }
+    // Frames for other nodes are none of our business
+    if ((reliable->dst[0] | reliable->dst[1] << 8) != node)
+        return -1;
+
+    uint16_t src = header->src[0] | header->src[1] << 8;
+    uint8_t seq = reliable->seq;
+
+    // Acknowledge repeats too, the first acknowledgement may have been lost.
+    // If the ring is full the sender will try again.
+    if ((uint8_t) (ack_head - ack_tail) < PYB_RADIO_LINK_WINDOW) {
+        link_ack_t *ack = &acks[ack_head % PYB_RADIO_LINK_WINDOW];
+        ack->node = src;
+        ack->seq = seq;
+        ack_head += 1;
+    }
+
+    // Slide the window of recent sequence numbers forward, or look the frame
+    // up in it. A frame from too far back is taken as the sender starting over.
+    link_peer_t *peer = find_peer(src, now);
+    int8_t ahead = (int8_t) (seq - peer->rx_top);
+    if (!peer->rx_started || ahead > 0 || -ahead >= LINK_SEQ_WINDOW) {
+        peer->rx_seen = peer->rx_started && ahead > 0 && ahead < LINK_SEQ_WINDOW ?
+            peer->rx_seen << ahead : 0;
+        peer->rx_seen |= 1;
+        peer->rx_top = seq;
+        peer->rx_started = 1;
+    } else if (peer->rx_seen & (1UL << -ahead)) {
+        stats.duplicates += 1;
+        return -1;
+    } else
+        peer->rx_seen |= 1UL << -ahead;
+
+    length -= header_size;
+    memmove(frame, frame + header_size, length);
+    return length;
+}
+
+/**
+ * Retire the reliable message an acknowledgement is for
+ */
+void RadioLink::input_ack(const uint8_t *frame, uint8_t length) {
+    const link_header_t *header = (const link_header_t *) frame;
+    const link_reliable_t *reliable = (const link_reliable_t *) (frame + sizeof(link_header_t));
+
+    if (length < sizeof(link_header_t) + sizeof(link_reliable_t)) {
+        stats.invalid += 1;
+        return;
+    }
+    if ((reliable->dst[0] | reliable->dst[1] << 8) != node)
+        return;
+    uint16_t src = header->src[0] | header->src[1] << 8;
+    // Repeated acknowledgements find nothing left to retire
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_WINDOW; i += 1) {
+        link_unacked_t *entry = &unacked[i];
+        if (entry->busy && entry->dst == src && entry->seq == reliable->seq) {
+            finish(entry, LINK_DELIVERED);
+            return;
+        }
+    }
+}
+
+/**
+ * Free a window entry and remember how its message fared
+ */
+void RadioLink::finish(link_unacked_t *entry, link_outcome_t outcome) {
+    link_result_t *result = &results[next_result++ % LINK_RESULTS];
+    result->tag = entry->tag;
+    result->outcome = outcome;
+    if (outcome == LINK_DELIVERED)
+        stats.delivered += 1;
+    else
+        stats.failed += 1;
+    entry->busy = 0;
+}
+
+/**
+ * Number of reliable messages that can be sent before the window is full
+ */
+uint8_t RadioLink::window_free(void) {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_WINDOW; i += 1)
+        n += !unacked[i].busy;
+    return n;
+}
+
+/**
+ * Send a message reliably to a single node
+ */
+int RadioLink::send_reliable(uint16_t dst, const uint8_t *msg, uint8_t length, uint32_t tag,
+        uint32_t now) {
+    if (!enabled)
+        return MICROBIT_NOT_SUPPORTED;
+    if (length > LINK_RELIABLE_DATA)
+        return MICROBIT_INVALID_PARAMETER;
+
+    link_unacked_t *entry = NULL;
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_WINDOW && entry == NULL; i += 1)
+        if (!unacked[i].busy)
+            entry = &unacked[i];
+    if (entry == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    link_peer_t *peer = find_peer(dst, now);
+    link_header_t *header = (link_header_t *) entry->frame;
+    link_reliable_t *reliable = (link_reliable_t *) (entry->frame + sizeof(link_header_t));
+    header->type = LINK_RELIABLE;
+    header->src[0] = (uint8_t) node;
+    header->src[1] = (uint8_t) (node >> 8);
+    reliable->dst[0] = (uint8_t) dst;
+    reliable->dst[1] = (uint8_t) (dst >> 8);
+    reliable->seq = peer->tx_seq++;
+    memcpy(entry->frame + sizeof(link_header_t) + sizeof(link_reliable_t), msg, length);
+
+    entry->busy = 1;
+    entry->seq = reliable->seq;
+    entry->dst = dst;
+    entry->tries = 1;
+    entry->length = sizeof(link_header_t) + sizeof(link_reliable_t) + length;
+    entry->tag = tag;
+    entry->sent_at = now;
+    return transmit(entry->frame, entry->length);
+}
+
+/**
+ * Send acknowledgements and resend overdue reliable messages
+ */
+int RadioLink::poll(uint32_t now) {
+    uint8_t frame[sizeof(link_header_t) + sizeof(link_reliable_t)];
+    link_header_t *header = (link_header_t *) frame;
+    link_reliable_t *reliable = (link_reliable_t *) (frame + sizeof(link_header_t));
+    int sent = 0;
+
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_RELAY_QUEUE; i += 1) {
+        link_relay_t *r = &relays[i];
+        if (!r->busy || (int32_t) (now - r->due) < 0)
+            continue;
+        transmit(r->frame, r->length);
+        r->busy = 0;
+        stats.relayed += 1;
+        sent += 1;
+    }
+
+    while (ack_tail != ack_head) {
+        const link_ack_t *ack = &acks[ack_tail % PYB_RADIO_LINK_WINDOW];
+        header->type = LINK_ACK;
+        header->src[0] = (uint8_t) node;
+        header->src[1] = (uint8_t) (node >> 8);
+        reliable->dst[0] = (uint8_t) ack->node;
+        reliable->dst[1] = (uint8_t) (ack->node >> 8);
+        reliable->seq = ack->seq;
+        ack_tail += 1;
+        if (transmit(frame, sizeof(frame)) == MICROBIT_OK)
+            stats.acks_sent += 1;
+        sent += 1;
+    }
+
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_WINDOW; i += 1) {
+        link_unacked_t *entry = &unacked[i];
+        if (!entry->busy || now - entry->sent_at < PYB_RADIO_LINK_RETRY_MS)
+            continue;
+        if (entry->tries > PYB_RADIO_LINK_RETRIES) {
+            finish(entry, LINK_FAILED);
+            continue;
+        }
+        entry->tries += 1;
+        entry->sent_at = now;
+        stats.retransmits += 1;
+        transmit(entry->frame, entry->length);
+        sent += 1;
+    }
+    return sent;
+}
+
+/**
+ * Whether any acknowledgements are waiting to be sent
+ */
+uint8_t RadioLink::acks_waiting(void) {
+    return ack_head != ack_tail;
+}
+
+/**
+ * Outcome of a reliable message
+ */
+int RadioLink::outcome(uint32_t tag) {
+    for (uint8_t i = 0; i < PYB_RADIO_LINK_WINDOW; i += 1)
+        if (unacked[i].busy && unacked[i].tag == tag)
+            return LINK_PENDING;
+    // Look through the newest results first, in case a tag was reused
+    for (uint8_t i = 1; i <= LINK_RESULTS; i += 1) {
+        const link_result_t *result = &results[(uint8_t) (next_result - i) % LINK_RESULTS];
+        if (result->outcome != LINK_PENDING && result->tag == tag)
+            return result->outcome;
+    }
+    return -1;
+}
+
+/**
+ * Turn flooding and relaying on or off
+ */
+void RadioLink::set_relay(uint8_t on, uint8_t hops, uint8_t backoff_ms) {
+    relaying = on && enabled;
+    ttl = hops;
+    backoff = backoff_ms;
+    if (!relaying)
+        for (uint8_t i = 0; i < PYB_RADIO_LINK_RELAY_QUEUE; i += 1)
+            relays[i].busy = 0;
+}
+
+/**
+ * Whether relaying is on
+ */
+uint8_t RadioLink::relay_enabled(void) {
+    return relaying;
+}
+
+/**
+ * Hops flooded messages are sent to go
+ */
+uint8_t RadioLink::relay_ttl(void) {
+    return ttl;
+}
+
+/**
+ * Longest time in milliseconds a relay waits before sending
+ */
+uint8_t RadioLink::relay_backoff(void) {
+    return backoff;
+}
+
+/**
+ * Return 1 if a flooded message has been seen recently, and remember it
+ * otherwise. Each message has a single place in the cache, picked by a hash
+ * of its source and number, and pushes out whatever was there before.
+ */
+int RadioLink::check_seen(uint16_t src, uint8_t seq, uint32_t now) {
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    hash = (hash ^ (uint8_t) src) * 16777619UL;
+    hash = (hash ^ (uint8_t) (src >> 8)) * 16777619UL;
+    hash = (hash ^ seq) * 16777619UL;
+    link_seen_t *entry = &seen[hash & (PYB_RADIO_LINK_SEEN - 1)];
+    if (entry->valid && entry->src == src && entry->seq == seq &&
+            now - entry->seen_at < PYB_RADIO_LINK_SEEN_MS)
+        return 1;
+    entry->valid = 1;
+    entry->src = src;
+    entry->seq = seq;
+    entry->seen_at = now;
+    return 0;
+}
+
+/**
+ * Send a message to be relayed through the network
+ */
+int RadioLink::send_flood(const uint8_t *msg, uint8_t length, uint32_t now) {
+    uint8_t frame[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    link_header_t *header = (link_header_t *) frame;
+    link_flood_t *flood = (link_flood_t *) (frame + sizeof(link_header_t));
+
+    header->type = LINK_FLOOD;
+    header->src[0] = (uint8_t) node;
+    header->src[1] = (uint8_t) (node >> 8);
+    flood->seq = next_flood_seq++;
+    flood->ttl = ttl;
+    memcpy(frame + sizeof(link_header_t) + sizeof(link_flood_t), msg, length);
+    // Don't pass our own message on when a neighbour relays it back
+    check_seen(node, flood->seq, now);
+    return transmit(frame, sizeof(link_header_t) + sizeof(link_flood_t) + length);
+}
+
+/**
+ * Pass on a flooded message the first time it is seen, and queue it to be
+ * relayed if it has hops left
+ */
+int RadioLink::input_flood(uint8_t *frame, uint8_t length, uint32_t now) {
+    const uint8_t header_size = sizeof(link_header_t) + sizeof(link_flood_t);
+    const link_header_t *header = (const link_header_t *) frame;
+    const link_flood_t *flood = (const link_flood_t *) (frame + sizeof(link_header_t));
+
+    if (length < header_size) {
+        stats.invalid += 1;
+        return -1;
+    }
+    if (check_seen(header->src[0] | header->src[1] << 8, flood->seq, now)) {
+        stats.flood_duplicates += 1;
+        return -1;
+    }
+
+    if (relaying && flood->ttl > 1) {
+        link_relay_t *r = NULL;
+        for (uint8_t i = 0; i < PYB_RADIO_LINK_RELAY_QUEUE && r == NULL; i += 1)
+            if (!relays[i].busy)
+                r = &relays[i];
+        if (r != NULL) {
+            memcpy(r->frame, frame, length);
+            ((link_flood_t *) (r->frame + sizeof(link_header_t)))->ttl -= 1;
+            r->length = length;
+            r->due = now + next_random() % (backoff + 1);
+            r->busy = 1;
+        } else
+            stats.relay_dropped += 1;
+    } else if (relaying)
+        stats.ttl_expired += 1;
+
+    length -= header_size;
+    memmove(frame, frame + header_size, length);
+    return length;
+}
+
+/**
+ * Next number from a xorshift generator
+ */
+uint32_t RadioLink::next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/**
+ * Turn coalescing on or off
+ */
+void RadioLink::set_coalesce(uint8_t on, uint16_t window_us) {
+    coalescing = on && enabled;
+    coalesce_us = window_us;
+}
+
+/**
+ * Whether coalescing is on
+ */
+uint8_t RadioLink::coalesce_enabled(void) {
+    return coalescing;
+}
+
+/**
+ * Time in microseconds to hold a short message for others to join it
+ */
+uint16_t RadioLink::coalesce_window(void) {
+    return coalesce_us;
+}
+
+/**
+ * Send several messages in one frame
+ */
+int RadioLink::send_batch(const uint8_t *records, uint8_t length) {
+    uint8_t frame[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    link_header_t *header = (link_header_t *) frame;
+
+    if (!enabled)
+        return MICROBIT_NOT_SUPPORTED;
+    if (length > LINK_BATCH_DATA)
+        return MICROBIT_INVALID_PARAMETER;
+    header->type = LINK_BATCH;
+    header->src[0] = (uint8_t) node;
+    header->src[1] = (uint8_t) (node >> 8);
+    memcpy(frame + sizeof(link_header_t), records, length);
+
+    stats.batches_sent += 1;
+    for (uint8_t i = 0; i < length; i += records[i] + 1)
+        stats.batched_messages += 1;
+    return transmit(frame, sizeof(link_header_t) + length);
+}
+
+/**
+ * Check the records of a received batch, keep a copy, and hand out the first
+ */
+int RadioLink::input_batch(const uint8_t *frame, uint8_t length, const uint8_t **msg) {
+    const uint8_t *records = frame + sizeof(link_header_t);
+    uint8_t count = 0, i = 0;
+
+    if (length > sizeof(link_header_t)) {
+        length -= sizeof(link_header_t);
+        while (i < length && records[i] != 0 && records[i] < length - i) {
+            i += records[i] + 1;
+            count += 1;
+        }
+    }
+    if (count < 2 || i != length) {
+        stats.invalid += 1;
+        return -1;
+    }
+    memcpy(batch, records, length);
+    batch_length = length;
+    stats.batches_received += 1;
+    return next_message(msg);
+}
+
+/**
+ * Hand out the next message of a received batch
+ */
+int RadioLink::next_message(const uint8_t **msg) {
+    if (batch_pos >= batch_length)
+        return -1;
+    uint8_t length = batch[batch_pos];
+    *msg = batch + batch_pos + 1;
+    batch_pos += length + 1;
+    return length;
+}
+
+/**
+ * Counters since startup
+ */
+const link_stats_t *RadioLink::get_stats(void) {
+    return &stats;
+}
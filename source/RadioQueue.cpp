@@ -0,0 +1,168 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2017 Sebastian Pauka
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mbed.h"
+#include "ErrorNo.h"
+#include "MicroBitSystemTimer.h"
+#include "RadioQueue.h"
+
+/**
+ * Constructor: create an empty queue in the given slots
+ */
+RadioQueue::RadioQueue(radio_msg_t *slots, uint8_t size) :
+    slots(slots),
+    size(size),
+    head(0),
+    tail(0),
+    msg_head(0),
+    msg_tail(0),
+    overflows(0)
+{
+}
+
+/**
+ * Copy a message into the back of the queue
+ */
+int RadioQueue::push(const uint8_t *msg, uint8_t length, uint8_t flags) {
+    // Check the message could ever fit
+    if (slots_for(length) > size)
+        return MICROBIT_INVALID_PARAMETER;
+
+    // If we are full, drop the message and remember that we did
+    radio_msg_t *slot = claim(length);
+    if (slot == NULL) {
+        drop();
+        return MICROBIT_NO_RESOURCES;
+    }
+
+    fill(msg, length);
+    slot->rssi = 0;
+    slot->time = (uint32_t) system_timer_current_time_us();
+    slot->pipe = 0;
+    slot->flags = flags;
+    commit(length);
+
+    return MICROBIT_OK;
+}
+
+/**
+ * Return the free slot at the back of the queue, or NULL if there is not
+ * room for length bytes
+ */
+radio_msg_t *RadioQueue::claim(uint8_t length) {
+    if ((uint8_t) (head - tail) + slots_for(length) > size)
+        return NULL;
+    return &slots[head & (size - 1)];
+}
+
+/**
+ * Copy a message into the claimed slots
+ */
+void RadioQueue::fill(const uint8_t *msg, uint8_t length) {
+    uint8_t slot = head;
+    do {
+        uint8_t n = length < RADIO_QUEUE_SLOT_SIZE ? length : RADIO_QUEUE_SLOT_SIZE;
+        memcpy(slots[slot & (size - 1)].data, msg, n);
+        msg += n;
+        length -= n;
+        slot += 1;
+    } while (length > 0);
+}
+
+/**
+ * Publish the claimed slots to the consumer
+ */
+void RadioQueue::commit(uint8_t length) {
+    slots[head & (size - 1)].length = length;
+    head += slots_for(length);
+    msg_head += 1;
+}
+
+/**
+ * Copy out a whole message
+ */
+uint8_t RadioQueue::read(const radio_msg_t *msg, uint8_t *buffer) {
+    uint8_t slot = msg - slots;
+    uint8_t length = msg->length;
+    for (uint16_t copied = 0; copied < length; copied += RADIO_QUEUE_SLOT_SIZE) {
+        uint8_t n = length - copied;
+        if (n > RADIO_QUEUE_SLOT_SIZE)
+            n = RADIO_QUEUE_SLOT_SIZE;
+        memcpy(buffer + copied, slots[slot & (size - 1)].data, n);
+        slot += 1;
+    }
+    return length;
+}
+
+/**
+ * Count a dropped message
+ */
+void RadioQueue::drop(void) {
+    overflows += 1;
+}
+
+/**
+ * Return the message at the front of the queue, or NULL if empty
+ */
+const radio_msg_t *RadioQueue::front(void) {
+    if (head == tail)
+        return NULL;
+    return &slots[tail & (size - 1)];
+}
+
+/**
+ * Return the message after msg
+ */
+const radio_msg_t *RadioQueue::next(const radio_msg_t *msg) {
+    // Count slots from the front of the queue
+    uint8_t offset = (uint8_t) ((msg - slots) - tail) & (size - 1);
+    offset += slots_for(msg->length);
+    if (offset >= (uint8_t) (head - tail))
+        return NULL;
+    return &slots[(tail + offset) & (size - 1)];
+}
+
+/**
+ * Discard the message at the front of the queue
+ */
+void RadioQueue::pop(void) {
+    if (head != tail) {
+        tail += slots_for(slots[tail & (size - 1)].length);
+        msg_tail += 1;
+    }
+}
+
+/**
+ * Number of messages waiting in the queue
+ */
+uint8_t RadioQueue::depth(void) {
+    return (uint8_t) (msg_head - msg_tail);
+}
+
+/**
+ * Number of messages dropped since startup
+ */
+uint32_t RadioQueue::overflow_count(void) {
+    return overflows;
+}
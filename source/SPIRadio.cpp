@@ -28,17 +28,82 @@ DEALINGS IN THE SOFTWARE.
 #include "SPISlaveExt.h"
 #include "SPIRadio.h"
 #include "SPIRadioCmds.h"
+#include "RadioQueue.h"
+#include "RadioFilter.h"
+#include "RadioLink.h"
+#include "LatencyHistogram.h"
+#include "PybRadioTrace.h"
 
 // We need access to the module/spi instances
 extern NCSSPybRadio module;
 extern SPISlaveExt spi;
 
-// Radio messages buffer
-extern uint8_t radio_buffer_len;
-extern uint8_t radio_buffer[SPI_IOBUF_SIZE];
+// Received radio messages
+extern RadioQueue rx_queue;
+// Subscriptions for received messages
+extern RadioFilter rx_filter;
+// Messages waiting to be sent, and how sending is going
+extern RadioQueue tx_queue;
+extern tx_status_t tx_status;
+// Framing and fragmentation of messages
+extern RadioLink radio_link;
+#if PYB_RADIO_LATENCY_HISTOGRAM
+// Command latencies
+extern LatencyHistogram latency;
+#endif
 // Version info prototype
 const char* version_info(void);
 
+// Framing of replies, set by the master
+static spi_protocol_t protocol = SPI_PROTOCOL_LEGACY;
+// Whether received messages are sent with their RSSI and time
+static uint8_t rx_meta = 0;
+// Size of that metadata
+static const uint8_t RX_META_SIZE = 6;
+
+/**
+ * State of the stream of received messages
+ */
+typedef struct {
+    uint8_t enabled;
+    // Length of the stream frame in place, 0 if the reply in place is not one
+    uint8_t length;
+    // Messages from the front of the queue in that frame
+    uint8_t count;
+    // Queue overflow count when it was built, and when the last frame the
+    // master read was built
+    uint32_t overflows;
+    uint32_t overflow_base;
+    // Frames read, messages in them, and messages dropped, while streaming
+    uint32_t frames;
+    uint32_t messages;
+    uint32_t dropped;
+} stream_state_t;
+static stream_state_t stream;
+
+// Time a channel scan listens on each channel unless told otherwise
+static const uint16_t SCAN_DEFAULT_DWELL_US = 1000;
+
+/**
+ * Counters for SPI_STATS_QUERY, alongside the ones kept by the SPI slave
+ */
+typedef struct {
+    uint32_t commands;
+    uint32_t checksum_fails;
+    uint32_t invalid_commands;
+    // Transmit counts at the last reset
+    uint32_t radio_sent_base;
+    // Queue overflow count at the last reset
+    uint32_t rx_dropped_base;
+    // Filter counts at the last reset
+    uint32_t filter_accepted_base;
+    uint32_t filter_dropped_base;
+} radio_stats_t;
+static radio_stats_t stats;
+
+// Number of counters in the SPI_STATS_QUERY reply
+static const uint8_t STATS_COUNT = 13;
+
 /**
  * Calculate string checksum
  */
@@ -65,34 +130,393 @@ uint8_t validate_packet(const uint8_t *io_buffer, const uint32_t length) {
     return io_buffer[1];
 }
 
+/**
+ * Fill in the header and checksum of a packet whose message has already
+ * been written into io_buffer+2.
+ */
+spi_op_status_t seal_packet(uint8_t *io_buffer, spi_radio_responses_t resp,
+        const uint32_t length) {
+    // Check that our message isn't too long
+    if (length > SPI_IOBUF_SIZE - 4)
+        return SPI_OP_INSUFFICIENT_BUFFER;
+
+    io_buffer[0] = (uint8_t) resp;
+    io_buffer[1] = (uint8_t) length;
+    io_buffer[length+2] = length ? calc_checksum(io_buffer+2, length) : 0;
+
+    return SPI_OP_SUCCESS;
+}
+
 spi_op_status_t craft_packet(uint8_t *io_buffer, spi_radio_responses_t resp,
         const uint8_t *msg, const uint32_t length) {
     // Check that our message isn't too long
     if (length > SPI_IOBUF_SIZE - 4)
         return SPI_OP_INSUFFICIENT_BUFFER;
 
-    // Calculate our checksum
-    uint8_t chksum = calc_checksum(msg, length);
-
     // Fill in our buffer
-    io_buffer[0] = (uint8_t) resp;
-    io_buffer[1] = (uint8_t) length;
     memcpy(io_buffer+2, msg, length);
-    io_buffer[length+2] = chksum;
+    return seal_packet(io_buffer, resp, length);
+}
 
-    return SPI_OP_SUCCESS;
+/**
+ * Write a little endian uint32
+ */
+static void put_u32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = (uint8_t) value;
+    buffer[1] = (uint8_t) (value >> 8);
+    buffer[2] = (uint8_t) (value >> 16);
+    buffer[3] = (uint8_t) (value >> 24);
+}
+
+/**
+ * Write the counters for SPI_STATS_QUERY, in the order documented in
+ * SPIRadioCmds.h. Return the length written.
+ */
+uint32_t pack_stats(uint8_t *buffer) {
+    spi_stats_t spi_stats;
+    spi.get_stats(&spi_stats);
+    uint32_t counters[STATS_COUNT] = {
+        stats.commands,
+        stats.checksum_fails,
+        stats.invalid_commands,
+        tx_status.sent - stats.radio_sent_base,
+        rx_queue.overflow_count() - stats.rx_dropped_base,
+        spi_stats.transactions,
+        spi_stats.busy,
+        spi_stats.dropped,
+        spi_stats.overflows,
+        spi_stats.overreads,
+        spi_stats.forced_releases,
+        rx_filter.accepted_count() - stats.filter_accepted_base,
+        rx_filter.dropped_count() - stats.filter_dropped_base
+    };
+    for (uint8_t i = 0; i < STATS_COUNT; i += 1)
+        put_u32(buffer + 4*i, counters[i]);
+    return 4 * STATS_COUNT;
+}
+
+/**
+ * Write the reply to SPI_LINK_QUERY: whether the link layer is on, the node
+ * id and the link counters. Return the length written.
+ */
+uint32_t pack_link(uint8_t *buffer) {
+    const link_stats_t *link_stats = radio_link.get_stats();
+    buffer[0] = radio_link.is_enabled();
+    buffer[1] = (uint8_t) radio_link.node_id();
+    buffer[2] = (uint8_t) (radio_link.node_id() >> 8);
+    put_u32(buffer+3, link_stats->reassembled);
+    put_u32(buffer+7, link_stats->incomplete);
+    put_u32(buffer+11, link_stats->invalid);
+    return 15;
+}
+
+/**
+ * Write the reply to SPI_RELIABLE_QUERY without a payload: the reliable
+ * delivery counters, then the number of messages waiting for an
+ * acknowledgement. Return the length written.
+ */
+uint32_t pack_reliable(uint8_t *buffer) {
+    const link_stats_t *link_stats = radio_link.get_stats();
+    put_u32(buffer, link_stats->delivered);
+    put_u32(buffer+4, link_stats->failed);
+    put_u32(buffer+8, link_stats->retransmits);
+    put_u32(buffer+12, link_stats->duplicates);
+    put_u32(buffer+16, link_stats->acks_sent);
+    buffer[20] = PYB_RADIO_LINK_WINDOW - radio_link.window_free();
+    return 21;
+}
+
+/**
+ * Write the reply to SPI_RELAY_QUERY: whether relaying is on, the hops and
+ * backoff, then the relay counters. Return the length written.
+ */
+uint32_t pack_relay(uint8_t *buffer) {
+    const link_stats_t *link_stats = radio_link.get_stats();
+    buffer[0] = radio_link.relay_enabled();
+    buffer[1] = radio_link.relay_ttl();
+    buffer[2] = radio_link.relay_backoff();
+    put_u32(buffer+3, link_stats->relayed);
+    put_u32(buffer+7, link_stats->flood_duplicates);
+    put_u32(buffer+11, link_stats->ttl_expired);
+    put_u32(buffer+15, link_stats->relay_dropped);
+    return 19;
+}
+
+/**
+ * Write the reply to SPI_COALESCE_QUERY: whether coalescing is on, the
+ * window, then the batch counters. Return the length written.
+ */
+uint32_t pack_coalesce(uint8_t *buffer) {
+    const link_stats_t *link_stats = radio_link.get_stats();
+    buffer[0] = radio_link.coalesce_enabled();
+    buffer[1] = (uint8_t) radio_link.coalesce_window();
+    buffer[2] = (uint8_t) (radio_link.coalesce_window() >> 8);
+    put_u32(buffer+3, link_stats->batches_sent);
+    put_u32(buffer+7, link_stats->batched_messages);
+    put_u32(buffer+11, link_stats->batches_received);
+    return 15;
+}
+
+/**
+ * Write the outcome of reliable message n, which is LINK_PENDING while it is
+ * still queued. Return SPI_OUT_OF_RANGE if the outcome is unknown.
+ */
+spi_radio_responses_t pack_outcome(uint8_t *buffer, uint32_t n) {
+    int outcome = radio_link.outcome(n);
+    if (n - tx_status.completed < tx_status.queued - tx_status.completed)
+        outcome = LINK_PENDING;
+    if (outcome < 0)
+        return SPI_OUT_OF_RANGE;
+    buffer[0] = (uint8_t) outcome;
+    return SPI_SUCCESS;
+}
+
+/**
+ * Write the reply to SPI_PIPE_QUERY: the bitmap of enabled pipes, the prefix
+ * of each pipe and the shared base address. Return the length written.
+ */
+uint32_t pack_pipes(uint8_t *buffer) {
+    buffer[0] = module.radio_pipes();
+    for (uint8_t i = 0; i < NCSS_RADIO_PIPES; i += 1)
+        buffer[1+i] = module.radio_pipe_prefix(i);
+    put_u32(buffer + 1 + NCSS_RADIO_PIPES, module.radio_pipe_base());
+    return 5 + NCSS_RADIO_PIPES;
+}
+
+/**
+ * Write the reply to SPI_FILTER_QUERY: the number of rules, then each rule
+ * as its offset, length and bytes. Return the length written.
+ */
+uint32_t pack_filter(uint8_t *buffer) {
+    uint8_t n = rx_filter.rule_count();
+    uint32_t len = 1;
+    buffer[0] = n;
+    for (uint8_t i = 0; i < n; i += 1) {
+        const filter_rule_t *r = rx_filter.rule(i);
+        buffer[len] = r->offset;
+        buffer[len+1] = r->length;
+        memcpy(buffer+len+2, r->match, r->length);
+        len += r->length + 2;
+    }
+    return len;
+}
+
+#if PYB_RADIO_LATENCY_HISTOGRAM
+/**
+ * Write the histogram for SPI_LATENCY_QUERY: the max then each bucket.
+ * Return the length written.
+ */
+uint32_t pack_latency(uint8_t *buffer, const latency_slot_t *slot) {
+    buffer[0] = (uint8_t) slot->max;
+    buffer[1] = (uint8_t) (slot->max >> 8);
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i += 1) {
+        buffer[2 + 2*i] = (uint8_t) slot->counts[i];
+        buffer[3 + 2*i] = (uint8_t) (slot->counts[i] >> 8);
+    }
+    return 2 + 2*LATENCY_BUCKETS;
+}
+#endif
+
+#if PYB_RADIO_TRACE
+/**
+ * Write the reply to SPI_TRACE_QUERY, starting from record from.
+ * Return the length written.
+ */
+uint32_t pack_trace(uint8_t *buffer, uint32_t from) {
+    uint32_t first, next;
+    uint32_t max = (SPI_IOBUF_SIZE - 4 - 8) / sizeof(trace_record_t);
+    uint32_t n = trace_read(from, (trace_record_t *) (buffer + 8), max, &first, &next);
+    put_u32(buffer, first);
+    put_u32(buffer + 4, next);
+    return 8 + n * sizeof(trace_record_t);
+}
+#endif
+
+/**
+ * Reply with a status and no data. In the framed protocol a zero length
+ * follows the status.
+ */
+spi_op_status_t reply_status(uint8_t *io_buffer, spi_radio_responses_t resp) {
+    io_buffer[0] = (uint8_t) resp;
+    if (protocol == SPI_PROTOCOL_FRAMED) {
+        io_buffer[1] = 0;
+        return spi.commit_reply(2);
+    }
+    return spi.commit_reply(1);
+}
+
+/**
+ * Write the metadata of a received message
+ */
+void put_meta(uint8_t *buffer, const radio_msg_t *msg) {
+    buffer[0] = (uint8_t) msg->rssi;
+    put_u32(buffer+1, msg->time);
+    buffer[5] = msg->pipe;
+}
+
+/**
+ * Write a received message, preceded by its metadata if that is enabled.
+ * Return the length written.
+ */
+uint32_t put_message(uint8_t *buffer, const radio_msg_t *msg) {
+    uint32_t len = 0;
+    if (rx_meta) {
+        put_meta(buffer, msg);
+        len = RX_META_SIZE;
+    }
+    return len + rx_queue.read(msg, buffer+len);
+}
+
+/**
+ * Pack as many queued messages as fit into a reply of at most max_reply
+ * bytes, straight into the reply buffer. Each message is prefixed with its length.
+ * Return the length of the packed message list.
+ */
+uint32_t pack_messages(uint8_t *io_buffer, uint32_t max_reply) {
+    const radio_msg_t *msg;
+    uint32_t len = 0;
+    // Leave room for the response, length and checksum
+    uint32_t max_len = max_reply - 3;
+    if (max_len > SPI_IOBUF_SIZE - 4)
+        max_len = SPI_IOBUF_SIZE - 4;
+
+    while ((msg = rx_queue.front()) != NULL) {
+        if (len + msg->length + (rx_meta ? RX_META_SIZE : 0) + 1 > max_len)
+            break;
+        io_buffer[2+len] = msg->length;
+        len += put_message(io_buffer+3+len, msg) + 1;
+        rx_queue.pop();
+    }
+    return len;
+}
+
+/**
+ * Write the data of a stream frame: the messages dropped since the last
+ * frame read, the messages left over, then as many queued messages as fit,
+ * each with its length and metadata. The messages stay queued until the
+ * master has read the frame. Return the length written.
+ */
+uint32_t pack_stream(uint8_t *buffer) {
+    const radio_msg_t *msg;
+    uint32_t len = 3;
+    uint8_t count = 0;
+
+    stream.overflows = rx_queue.overflow_count();
+    uint32_t dropped = stream.overflows - stream.overflow_base;
+    if (dropped > 0xFFFF)
+        dropped = 0xFFFF;
+    buffer[0] = (uint8_t) dropped;
+    buffer[1] = (uint8_t) (dropped >> 8);
+
+    for (msg = rx_queue.front(); msg != NULL; msg = rx_queue.next(msg)) {
+        if (len + 1 + RX_META_SIZE + msg->length > SPI_IOBUF_SIZE - 4)
+            break;
+        buffer[len] = msg->length;
+        put_meta(buffer+len+1, msg);
+        len += 1 + RX_META_SIZE + rx_queue.read(msg, buffer+len+1+RX_META_SIZE);
+        count += 1;
+    }
+    buffer[2] = rx_queue.depth() - count;
+    stream.count = count;
+    return len;
+}
+
+/**
+ * Write the reply to SPI_STREAM_QUERY: whether streaming is on, then the
+ * frame, message and drop counters. Return the length written.
+ */
+uint32_t pack_stream_status(uint8_t *buffer) {
+    buffer[0] = stream.enabled;
+    put_u32(buffer+1, stream.frames);
+    put_u32(buffer+5, stream.messages);
+    put_u32(buffer+9, stream.dropped);
+    return 13;
+}
+
+/**
+ * Queue a message to be sent by the transmit fiber.
+ * Return the status to reply with.
+ */
+spi_radio_responses_t queue_tx(const uint8_t *msg, uint8_t length, uint8_t flags = 0) {
+    if (length > radio_link.max_message())
+        return SPI_INVALID_LENGTH;
+    switch (tx_queue.push(msg, length, flags)) {
+        case MICROBIT_OK:
+            tx_status.queued += 1;
+            return SPI_SUCCESS;
+        case MICROBIT_NO_RESOURCES:
+            tx_status.full += 1;
+            return SPI_QUEUE_FULL;
+        default:
+            return SPI_INVALID_LENGTH;
+    }
+}
+
+/**
+ * Queue each message of a length prefixed list, recording which were queued
+ * in a bitmap. The list must already have been checked by count_messages.
+ * Return the length of the bitmap.
+ */
+uint32_t send_messages(const uint8_t *msgs, uint32_t length, uint8_t *bitmap) {
+    uint32_t i = 0, n = 0;
+    while (i < length) {
+        if ((n % 8) == 0)
+            bitmap[n/8] = 0;
+        if (queue_tx(msgs+i+1, msgs[i]) == SPI_SUCCESS)
+            bitmap[n/8] |= 1 << (n % 8);
+        i += msgs[i] + 1;
+        n += 1;
+    }
+    return (n + 7) / 8;
+}
+
+/**
+ * Write the reply to SPI_TX_QUERY: the transmit counters as little endian
+ * uint32s, then the number of messages waiting. Return the length written.
+ */
+uint32_t pack_tx_status(uint8_t *buffer) {
+    put_u32(buffer, tx_status.queued);
+    put_u32(buffer+4, tx_status.completed);
+    put_u32(buffer+8, tx_status.sent);
+    put_u32(buffer+12, tx_status.failed);
+    put_u32(buffer+16, tx_status.full);
+    buffer[20] = tx_queue.depth();
+    return 21;
+}
+
+/**
+ * Count the messages in a length prefixed list.
+ * Return 0 if the lengths don't add up to the length of the list.
+ */
+uint32_t count_messages(const uint8_t *msgs, uint32_t length) {
+    uint32_t i = 0, n = 0;
+    while (i < length) {
+        i += msgs[i] + 1;
+        n += 1;
+    }
+    if (i != length)
+        return 0;
+    return n;
 }
 
 // Loop over the command buffer and reply
-void spi_cmd_switch(spi_radio_cmds_t cmd, uint8_t *io_buffer, const uint32_t length) {
+void spi_cmd_switch(spi_radio_cmds_t cmd, const uint8_t *in_buffer, const uint32_t length,
+        uint8_t *out_buffer) {
     uint8_t check, response;
     uint32_t len;
     const char* version;
+    const radio_msg_t *msg;
+    uint32_t overflows;
+    uint16_t dwell;
+    int scanned;
+    uint8_t queue_info[5];
+    stats.commands += 1;
     // If the packet contains a payload, validate that the packet is not corrupt
     if (length > 1) {
-        check = validate_packet(io_buffer, length);
+        check = validate_packet(in_buffer, length);
         if (check == 0) {
-            spi.reply(SPI_CHECKSUM_FAIL);
+            stats.checksum_fails += 1;
+            reply_status(out_buffer, SPI_CHECKSUM_FAIL);
             return;
         }
     } else
@@ -101,105 +525,524 @@ void spi_cmd_switch(spi_radio_cmds_t cmd, uint8_t *io_buffer, const uint32_t len
     switch(cmd) {
         case SPI_NOOP:
             // NOOP
-            spi.reply(SPI_NOCMD);
+            reply_status(out_buffer, SPI_NOCMD);
             break;
         case SPI_VERSION:
             version = version_info();
             len = strlen(version_info())+1; // not forgetting 0 terminator
-            craft_packet(io_buffer, SPI_SUCCESS, (const uint8_t *)version, len);
-            spi.reply_buffer(io_buffer, len+3);
+            craft_packet(out_buffer, SPI_SUCCESS, (const uint8_t *)version, len);
+            spi.commit_reply(len+3);
             break;
         // Radio State
         case SPI_RADIO_STATE_ENABLE:
             module.radio.enable(); // TODO: Check success
-            spi.reply(SPI_SUCCESS);
+            // Enabling the radio resets its receive addresses
+            module.radio_restore_config();
+            reply_status(out_buffer, SPI_SUCCESS);
             break;
         case SPI_RADIO_STATE_DISABLE:
             module.radio.disable(); // TODO: Check success
-            spi.reply(SPI_SUCCESS);
+            reply_status(out_buffer, SPI_SUCCESS);
             break;
         case SPI_RADIO_STATE_QUERY:
             if (module.radio_enabled())
-                spi.reply(SPI_SUCCESS_AND_ENABLED);
+                reply_status(out_buffer, SPI_SUCCESS_AND_ENABLED);
             else
-                spi.reply(SPI_SUCCESS_AND_DISABLED);
+                reply_status(out_buffer, SPI_SUCCESS_AND_DISABLED);
             break;
         // Radio channel
         case SPI_RADIO_CHAN_SET:
             if (check != 1) { // length must be 1
-                spi.reply(SPI_INVALID_LENGTH);
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
                 break;
             }
-            if (io_buffer[2] > 100) { // Out of range
-                spi.reply(SPI_OUT_OF_RANGE);
+            if (in_buffer[2] > 100) { // Out of range
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
                 break;
             }
-            response = module.radio.setFrequencyBand(io_buffer[2]);
+            response = module.radio.setFrequencyBand(in_buffer[2]);
             if (response == MICROBIT_OK)
-                spi.reply(SPI_SUCCESS);
+                reply_status(out_buffer, SPI_SUCCESS);
             else
-                spi.reply(SPI_OTHER_FAIL);
+                reply_status(out_buffer, SPI_OTHER_FAIL);
             break;
         case SPI_RADIO_CHAN_QUERY:
             response = module.radio_channel();
-            craft_packet(io_buffer, SPI_SUCCESS, &response, 1);
-            spi.reply_buffer(io_buffer, 4);
+            craft_packet(out_buffer, SPI_SUCCESS, &response, 1);
+            spi.commit_reply(4);
             break;
         // Radio Power
         case SPI_RADIO_POWER_SET:
             if (check != 1) { // length must be 1
-                spi.reply(SPI_INVALID_LENGTH);
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
                 break;
             }
-            if (io_buffer[2] > 7) { // Out of range
-                spi.reply(SPI_OUT_OF_RANGE);
+            if (in_buffer[2] > 7) { // Out of range
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
                 break;
             }
-            response = module.radio.setTransmitPower(io_buffer[2]);
+            response = module.radio.setTransmitPower(in_buffer[2]);
             if (response == MICROBIT_OK)
-                spi.reply(SPI_SUCCESS);
+                reply_status(out_buffer, SPI_SUCCESS);
             else
-                spi.reply(SPI_OTHER_FAIL);
+                reply_status(out_buffer, SPI_OTHER_FAIL);
             break;
         case SPI_RADIO_POWER_QUERY:
             response = module.radio_power();
-            craft_packet(io_buffer, SPI_SUCCESS, &response, 1);
-            spi.reply_buffer(io_buffer, 4);
+            craft_packet(out_buffer, SPI_SUCCESS, &response, 1);
+            spi.commit_reply(4);
+            break;
+        // Radio Data Rate
+        case SPI_RADIO_RATE_SET:
+            if (check != 1) { // length must be 1
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            if (in_buffer[2] > SPI_RADIO_RATE_250KBIT) { // Out of range
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                break;
+            }
+            response = module.radio_set_rate(in_buffer[2]);
+            if (response == MICROBIT_OK)
+                reply_status(out_buffer, SPI_SUCCESS);
+            else
+                reply_status(out_buffer, SPI_OTHER_FAIL);
+            break;
+        case SPI_RADIO_RATE_QUERY:
+            response = module.radio_rate();
+            craft_packet(out_buffer, SPI_SUCCESS, &response, 1);
+            spi.commit_reply(4);
+            break;
+        // Streaming received messages
+        case SPI_STREAM_ENABLE:
+            if (!stream.enabled) {
+                stream.overflow_base = rx_queue.overflow_count();
+                stream.length = 0;
+            }
+            stream.enabled = 1;
+            spi.stream(1);
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_STREAM_DISABLE:
+            stream.enabled = 0;
+            spi.stream(0);
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_STREAM_QUERY:
+            len = pack_stream_status(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Channel energy scan
+        case SPI_RADIO_SCAN_CMD:
+            if (check != 2 && check != 4) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            dwell = check == 4 ? in_buffer[4] | in_buffer[5] << 8 : SCAN_DEFAULT_DWELL_US;
+            scanned = module.radio_scan(in_buffer[2], in_buffer[3], dwell, out_buffer+2);
+            if (scanned < 0) {
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                break;
+            }
+            seal_packet(out_buffer, SPI_SUCCESS, (uint8_t) scanned);
+            spi.commit_reply(scanned+3);
             break;
         // Message Queries
         case SPI_MSG_QUERY:
-            if (radio_buffer_len > 0)
-                spi.reply(SPI_MESSAGE);
-            else
-                spi.reply(SPI_NO_MESSAGE);
+            // Report the queue depth followed by the number of dropped messages
+            overflows = rx_queue.overflow_count();
+            queue_info[0] = rx_queue.depth();
+            queue_info[1] = (uint8_t) overflows;
+            queue_info[2] = (uint8_t) (overflows >> 8);
+            queue_info[3] = (uint8_t) (overflows >> 16);
+            queue_info[4] = (uint8_t) (overflows >> 24);
+            craft_packet(out_buffer, queue_info[0] > 0 ? SPI_MESSAGE : SPI_NO_MESSAGE,
+                    queue_info, sizeof(queue_info));
+            spi.commit_reply(sizeof(queue_info)+3);
             break;
         case SPI_SEND_CMD:
             if (check == 0) {
-                spi.reply(SPI_INVALID_LENGTH);
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
                 break;
             }
-            if (check > SPI_IOBUF_SIZE - 4) {
-                spi.reply(SPI_REPLY_OVERFLOW);
+            // Queue the message and reply with its sequence number straight
+            // away, rather than holding the master for the radio airtime
+            len = tx_status.queued;
+            response = queue_tx(in_buffer+2, check);
+            if (response != SPI_SUCCESS) {
+                reply_status(out_buffer, (spi_radio_responses_t) response);
                 break;
             }
-            module.radio.datagram.send(io_buffer+2, io_buffer[1]);
-            spi.reply(SPI_SUCCESS);
+            put_u32(out_buffer+2, len);
+            seal_packet(out_buffer, SPI_SUCCESS, 4);
+            spi.commit_reply(7);
+            break;
+        case SPI_SEND_MANY_CMD:
+            // Check the message list is well formed before sending any of it
+            if (check == 0 || count_messages(in_buffer+2, check) == 0) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            // Queue them all, then reply with which messages were queued
+            len = send_messages(in_buffer+2, check, out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
             break;
         case SPI_RECV_CMD:
             // Check if a message is available
-            if (radio_buffer_len == 0) {
-                spi.reply(SPI_NO_MESSAGE);
+            msg = rx_queue.front();
+            if (msg == NULL) {
+                reply_status(out_buffer, SPI_NO_MESSAGE);
                 break;
             }
             // If it is craft a packet
-            craft_packet(io_buffer, SPI_SUCCESS, radio_buffer, radio_buffer_len);
+            len = put_message(out_buffer+2, msg);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
             // Send the message to the pyboard
-            spi.reply_buffer(io_buffer, radio_buffer_len+3);
+            spi.commit_reply(len+3);
             // Mark the message as read
-            radio_buffer_len = 0;
+            rx_queue.pop();
+            break;
+        case SPI_RECV_MANY_CMD:
+            // An optional payload limits the size of the reply
+            if (check > 1) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            len = check ? in_buffer[2] : SPI_IOBUF_SIZE;
+            if (len < 4) {
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                break;
+            }
+            if (rx_queue.front() == NULL) {
+                reply_status(out_buffer, SPI_NO_MESSAGE);
+                break;
+            }
+            len = pack_messages(out_buffer, len);
+            // If even the first message wouldn't fit, leave it for SPI_RECV_CMD
+            if (len == 0) {
+                reply_status(out_buffer, SPI_REPLY_OVERFLOW);
+                break;
+            }
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Received message metadata
+        case SPI_RX_META_ENABLE:
+        case SPI_RX_META_DISABLE:
+            rx_meta = (cmd == SPI_RX_META_ENABLE);
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_RX_META_QUERY:
+            reply_status(out_buffer, rx_meta ? SPI_SUCCESS_AND_ENABLED : SPI_SUCCESS_AND_DISABLED);
+            break;
+        // Link layer
+        case SPI_LINK_ENABLE:
+            // An optional payload sets the node id
+            if (check != 0 && check != 2) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            if (check == 2)
+                radio_link.set_node_id(in_buffer[2] | in_buffer[3] << 8);
+            radio_link.enable(1);
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_LINK_DISABLE:
+            radio_link.enable(0);
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_LINK_QUERY:
+            len = pack_link(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Reliable delivery
+        case SPI_RELIABLE_SEND:
+            if (!radio_link.is_enabled()) {
+                reply_status(out_buffer, SPI_INVALID_COMMAND);
+                break;
+            }
+            if (check < 2 || check > 2 + LINK_RELIABLE_DATA) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            len = tx_status.queued;
+            response = queue_tx(in_buffer+2, check, RADIO_MSG_RELIABLE);
+            if (response != SPI_SUCCESS) {
+                reply_status(out_buffer, (spi_radio_responses_t) response);
+                break;
+            }
+            put_u32(out_buffer+2, len);
+            seal_packet(out_buffer, SPI_SUCCESS, 4);
+            spi.commit_reply(7);
+            break;
+        case SPI_RELIABLE_QUERY:
+            if (check == 0) {
+                len = pack_reliable(out_buffer+2);
+                seal_packet(out_buffer, SPI_SUCCESS, len);
+                spi.commit_reply(len+3);
+                break;
+            }
+            if (check != 4) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            response = pack_outcome(out_buffer+2, (uint32_t) in_buffer[2] | in_buffer[3] << 8 |
+                    in_buffer[4] << 16 | (uint32_t) in_buffer[5] << 24);
+            if (response != SPI_SUCCESS) {
+                reply_status(out_buffer, (spi_radio_responses_t) response);
+                break;
+            }
+            seal_packet(out_buffer, SPI_SUCCESS, 1);
+            spi.commit_reply(4);
+            break;
+        // Mesh relaying
+        case SPI_RELAY_ENABLE:
+            if (!radio_link.is_enabled()) {
+                reply_status(out_buffer, SPI_INVALID_COMMAND);
+                break;
+            }
+            if (check != 0 && check != 2) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            if (check == 2 && in_buffer[2] == 0) {
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                break;
+            }
+            if (check == 2)
+                radio_link.set_relay(1, in_buffer[2], in_buffer[3]);
+            else
+                radio_link.set_relay(1, radio_link.relay_ttl(), radio_link.relay_backoff());
+            reply_status(out_buffer, SPI_SUCCESS);
             break;
+        case SPI_RELAY_DISABLE:
+            radio_link.set_relay(0, radio_link.relay_ttl(), radio_link.relay_backoff());
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_RELAY_QUERY:
+            len = pack_relay(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Coalescing short messages
+        case SPI_COALESCE_ENABLE:
+            if (!radio_link.is_enabled()) {
+                reply_status(out_buffer, SPI_INVALID_COMMAND);
+                break;
+            }
+            if (check != 0 && check != 2) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            radio_link.set_coalesce(1, check == 2 ? in_buffer[2] | in_buffer[3] << 8 :
+                    radio_link.coalesce_window());
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_COALESCE_DISABLE:
+            radio_link.set_coalesce(0, radio_link.coalesce_window());
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_COALESCE_QUERY:
+            len = pack_coalesce(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Transmit queue
+        case SPI_TX_QUERY:
+            len = pack_tx_status(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Receive address pipes
+        case SPI_PIPE_SET:
+            if (check != 2 && check != 6) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            if (in_buffer[2] >= NCSS_RADIO_PIPES) {
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                break;
+            }
+            if (check == 6)
+                module.radio_set_pipe_base((uint32_t) in_buffer[4] | in_buffer[5] << 8 |
+                        in_buffer[6] << 16 | (uint32_t) in_buffer[7] << 24);
+            module.radio_set_pipe(in_buffer[2], in_buffer[3]);
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_PIPE_CLEAR:
+            if (check != 1) { // length must be 1
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            if (module.radio_clear_pipe(in_buffer[2]) == MICROBIT_OK)
+                reply_status(out_buffer, SPI_SUCCESS);
+            else
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
+            break;
+        case SPI_PIPE_QUERY:
+            len = pack_pipes(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Receive filter
+        case SPI_FILTER_ADD:
+            if (check < 2) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            switch (rx_filter.add(in_buffer[2], in_buffer+3, check-1)) {
+                case MICROBIT_OK:
+                    reply_status(out_buffer, SPI_SUCCESS);
+                    break;
+                case MICROBIT_NO_RESOURCES:
+                    reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                    break;
+                default:
+                    reply_status(out_buffer, SPI_INVALID_LENGTH);
+                    break;
+            }
+            break;
+        case SPI_FILTER_CLEAR:
+            rx_filter.clear();
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_FILTER_QUERY:
+            len = pack_filter(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        // Reply framing
+        case SPI_PROTOCOL_SET:
+            if (check != 1) { // length must be 1
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            if (in_buffer[2] > SPI_PROTOCOL_FRAMED) {
+                reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                break;
+            }
+            protocol = (spi_protocol_t) in_buffer[2];
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+        case SPI_PROTOCOL_QUERY:
+            response = protocol;
+            craft_packet(out_buffer, SPI_SUCCESS, &response, 1);
+            spi.commit_reply(4);
+            break;
+        // Performance counters
+        case SPI_STATS_QUERY:
+            len = pack_stats(out_buffer+2);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        case SPI_STATS_RESET:
+            memset(&stats, 0, sizeof(stats));
+            stats.rx_dropped_base = rx_queue.overflow_count();
+            stats.radio_sent_base = tx_status.sent;
+            stats.filter_accepted_base = rx_filter.accepted_count();
+            stats.filter_dropped_base = rx_filter.dropped_count();
+            spi.clear_stats();
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+#if PYB_RADIO_LATENCY_HISTOGRAM
+        // Command latency histograms
+        case SPI_LATENCY_QUERY:
+            if (check > 1) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            if (check == 0) {
+                len = latency.commands(out_buffer+2);
+            } else {
+                const latency_slot_t *slot = latency.find(in_buffer[2]);
+                if (slot == NULL) {
+                    reply_status(out_buffer, SPI_OUT_OF_RANGE);
+                    break;
+                }
+                len = pack_latency(out_buffer+2, slot);
+            }
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        case SPI_LATENCY_RESET:
+            latency.clear();
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+#endif
+#if PYB_RADIO_TRACE
+        // Event trace
+        case SPI_TRACE_QUERY:
+            if (check != 0 && check != 4) {
+                reply_status(out_buffer, SPI_INVALID_LENGTH);
+                break;
+            }
+            len = pack_trace(out_buffer+2, check ? (uint32_t) in_buffer[2] | in_buffer[3] << 8 |
+                    in_buffer[4] << 16 | (uint32_t) in_buffer[5] << 24 : 0);
+            seal_packet(out_buffer, SPI_SUCCESS, len);
+            spi.commit_reply(len+3);
+            break;
+        case SPI_TRACE_ENABLE:
+        case SPI_TRACE_DISABLE:
+            trace_enable(cmd == SPI_TRACE_ENABLE);
+            reply_status(out_buffer, SPI_SUCCESS);
+            break;
+#endif
         default:
-            spi.reply(SPI_INVALID_COMMAND);
+            stats.invalid_commands += 1;
+            reply_status(out_buffer, SPI_INVALID_COMMAND);
             break;
     }
 }
+
+/**
+ * Whether every transaction is answered with a stream frame
+ */
+uint8_t spi_streaming(void) {
+    return stream.enabled;
+}
+
+/**
+ * Rebuild the stream frame in place to take in newly received messages
+ */
+void spi_stream_refresh(void) {
+    if (!stream.enabled || stream.length == 0)
+        return;
+    // Leave it be if the master has started reading it, or a command
+    // has replaced it
+    if (spi.reclaim_reply() != SPI_OP_SUCCESS)
+        return;
+    uint8_t *out_buffer = spi.tx_view().data;
+    uint32_t len = pack_stream(out_buffer+2);
+    seal_packet(out_buffer, SPI_STREAM_FRAME, len);
+    spi.commit_reply(len+3);
+    stream.length = (uint8_t) (len+3);
+}
+
+/**
+ * Handle a transaction while streaming
+ */
+void spi_stream(const uint8_t *in_buffer, uint32_t length, uint8_t *out_buffer) {
+    // The master has the frame once it has clocked all of it out
+    if (stream.length != 0 && spi.reply_read() >= stream.length) {
+        for (uint8_t i = 0; i < stream.count; i += 1)
+            rx_queue.pop();
+        stream.frames += 1;
+        stream.messages += stream.count;
+        stream.dropped += stream.overflows - stream.overflow_base;
+        stream.overflow_base = stream.overflows;
+    }
+    stream.length = 0;
+
+    if (length > 0 && in_buffer[0] != SPI_NOOP) {
+        spi_cmd_switch((spi_radio_cmds_t) in_buffer[0], in_buffer, length, out_buffer);
+        return;
+    }
+
+    uint32_t len = pack_stream(out_buffer+2);
+    seal_packet(out_buffer, SPI_STREAM_FRAME, len);
+    spi.commit_reply(len+3);
+    stream.length = (uint8_t) (len+3);
+}
@@ -25,6 +25,22 @@ DEALINGS IN THE SOFTWARE.
 #include "mbed.h"
 #include "SPIRadioCmds.h"
 #include "SPISlaveExt.h"
+#include "LatencyHistogram.h"
+#include "PybRadioTrace.h"
+
+// Called at the end of each transaction, if attached
+static void (*spis_end_handler)(void) = NULL;
+
+// The instance that owns the SPIS interrupt
+static SPISlaveExt *spis_instance = NULL;
+
+/**
+ * SPIS interrupt. We only listen for END.
+ */
+extern "C" void SPI1_TWI1_IRQHandler(void) {
+    if (spis_instance)
+        spis_instance->end_irq();
+}
 
 /**
  * Constructor: initialize empty buffers and set up pins
@@ -32,14 +48,30 @@ DEALINGS IN THE SOFTWARE.
  * the RXD/TXD buffers with our own that can hold more bits
  */
 SPISlaveExt::SPISlaveExt(PinName mosi, PinName miso, PinName sclk, PinName ssel) :
-    SPISlave(mosi, miso, sclk, ssel)
+    SPISlave(mosi, miso, sclk, ssel),
+    double_buffered(0),
+    rxPending(NULL),
+    rxPendingLen(0),
+    busy(0),
+    arming(0),
+    replyWaiting(0),
+    streaming(0),
+    rxPendingRead(0)
+#if PYB_RADIO_LATENCY_HISTOGRAM
+    , cmdStart(0)
+#endif
 {
+    busyBuf[0] = SPI_PERIPH_BUSY;
+    idleBuf[0] = SPI_NOCMD;
+    clear_stats();
+    spis_instance = this;
+
     // At this point, we have an SPISlave object set up to recieve single bytes
     // per transaction. Let's overwrite this with a longer buffer.
     acquire_sem();
-    _spi.spis->TXDPTR = (uint32_t) outputBuf;
+    _spi.spis->TXDPTR = (uintptr_t) outputBuf;
     _spi.spis->MAXTX = SPI_IOBUF_SIZE;
-    _spi.spis->RXDPTR = (uint32_t) inputBuf;
+    _spi.spis->RXDPTR = (uintptr_t) inputBuf;
     _spi.spis->MAXRX = SPI_IOBUF_SIZE;
 
     // Set up overread and busy characters (used when semaphore is locked)
@@ -62,6 +94,7 @@ void SPISlaveExt::acquire_sem(void) {
     // Check we don't already hold the semaphore
     if (_spi.spis->SEMSTAT == 1)
         return;
+    TRACE(TRACE_SEM_ACQUIRE, (uint8_t) _spi.spis->SEMSTAT, 0);
     // Start the acquisition task
     _spi.spis->EVENTS_ACQUIRED = 0;
     _spi.spis->TASKS_ACQUIRE = 1;
@@ -75,6 +108,7 @@ void SPISlaveExt::acquire_sem(void) {
  * Release the semaphore, prepare for next operation
  */
 void SPISlaveExt::release_sem(void) {
+    TRACE(TRACE_SEM_RELEASE, 0, 0);
     _spi.spis->EVENTS_ACQUIRED = 0;
     _spi.spis->TASKS_RELEASE = 1;
     return;
@@ -84,6 +118,8 @@ void SPISlaveExt::release_sem(void) {
  * Return the number of available bytes in the buffer
  */
 int SPISlaveExt::receive(void) {
+    if (double_buffered)
+        return rxPendingLen;
     if (SPISlave::receive())
         return _spi.spis->AMOUNTRX;
     return 0;
@@ -93,23 +129,20 @@ int SPISlaveExt::receive(void) {
  * read multiple bytes into a buffer
  */
 spi_op_status_t SPISlaveExt::read_buffer(uint8_t *buffer, uint8_t maxLen, uint8_t release) {
-    int recv = receive();
-    // Check we have a new receive message and we can safely access the buffers
-    if (recv == 0 || _spi.spis->SEMSTAT != 1)
-        return SPI_OP_NOT_READY;
-    // Check that the input buffer is of sufficient length
-    if (maxLen < recv)
+    // Check that the input buffer is of sufficient length before taking the
+    // command, so it is still waiting if we fail
+    if (maxLen < receive())
         return SPI_OP_INSUFFICIENT_BUFFER;
 
-    // Copy output into buffers
-    memcpy(buffer, inputBuf, recv);
+    spi_view_t in = rx_view();
+    if (in.length == 0)
+        return SPI_OP_NOT_READY;
 
-    // Zero the input buffer and unset the receive bit
-    memset(inputBuf, 0x00, recv);
-    _spi.spis->EVENTS_END = 0;
+    // Copy output into buffers
+    memcpy(buffer, in.data, in.length);
 
     // Release the semaphore if we think we are done
-    if (release)
+    if (release && !double_buffered)
         release_sem();
 
     // Done
@@ -117,25 +150,80 @@ spi_op_status_t SPISlaveExt::read_buffer(uint8_t *buffer, uint8_t maxLen, uint8_
 }
 
 /**
- * prepare a response message
- * outBuffer is the response that we want to send
- * len is the length of the response
- * release tells us whether we are ready immediately after this operation.
- *   If we still want to oparate on this data then we should set this to 0,
- *   but we then MUST call release before the device will send this message.
+ * Take the waiting command in place. In single buffered mode the CPU keeps
+ * the semaphore until the reply is committed, in double buffered mode the
+ * command is already ours and the SPIS is receiving into the other buffer.
  */
-spi_op_status_t SPISlaveExt::reply_buffer(uint8_t *buffer, uint8_t len, uint8_t release) {
+spi_view_t SPISlaveExt::rx_view(void) {
+    spi_view_t view = {NULL, 0};
+    uint32_t recv = receive();
+
+    if (double_buffered) {
+        if (recv == 0)
+            return view;
+        view.data = rxPending;
+        view.length = recv;
+        rxPendingLen = 0;
+        return view;
+    }
+
+    // Check we have a new receive message and we can safely access the buffers
+    if (recv == 0 || _spi.spis->SEMSTAT != 1)
+        return view;
+    view.data = inputBuf;
+    view.length = recv;
+    busy = 1;
+
+    // Unset the receive bit
+    _spi.spis->EVENTS_END = 0;
+
+    // Listen for the next transaction
+    if (spis_end_handler)
+        _spi.spis->INTENSET = SPIS_INTENSET_END_Msk;
+
+    return view;
+}
+
+/**
+ * The transmit buffer, to build a reply in place
+ */
+spi_view_t SPISlaveExt::tx_view(void) {
+    spi_view_t view = {outputBuf, SPI_IOBUF_SIZE};
+    return view;
+}
+
+/**
+ * Send the first len bytes of the transmit buffer
+ */
+spi_op_status_t SPISlaveExt::commit_reply(uint8_t len, uint8_t release) {
     // Check that the length of the message is valid
     if (len == 0 || len > SPI_IOBUF_SIZE)
         return SPI_OP_INSUFFICIENT_BUFFER;
 
+    // In double buffered mode the SPIS is showing busyBuf, so the output
+    // buffer is ours and we only take the semaphore to swap it in
+    if (double_buffered) {
+        // Stop the interrupt releasing the semaphore out from under us if a
+        // transaction ends while we wait for it
+        arming = 1;
+        acquire_sem();
+        _spi.spis->TXDPTR = (uintptr_t) outputBuf;
+        _spi.spis->MAXTX = len;
+        busy = 0;
+        replyWaiting = 1;
+        if (release) {
+            release_sem();
+            arming = 0;
+        }
+        return SPI_OP_SUCCESS;
+    }
+
     // Make sure we can safely access the buffers
     if (_spi.spis->SEMSTAT != 1)
         return SPI_OP_NOT_READY;
-
-    // copy output into buffer and set up sender
-    memcpy(outputBuf, buffer, len);
     _spi.spis->MAXTX = len;
+    busy = 0;
+    replyWaiting = 1;
 
     // if we are ready to release the semaphore do it
     if (release)
@@ -145,6 +233,30 @@ spi_op_status_t SPISlaveExt::reply_buffer(uint8_t *buffer, uint8_t len, uint8_t
     return SPI_OP_SUCCESS;
 }
 
+/**
+ * prepare a response message
+ * outBuffer is the response that we want to send
+ * len is the length of the response
+ * release tells us whether we are ready immediately after this operation.
+ *   If we still want to oparate on this data then we should set this to 0,
+ *   but we then MUST call release before the device will send this message.
+ */
+spi_op_status_t SPISlaveExt::reply_buffer(uint8_t *buffer, uint8_t len, uint8_t release) {
+    // Check that the length of the message is valid
+    if (len == 0 || len > SPI_IOBUF_SIZE)
+        return SPI_OP_INSUFFICIENT_BUFFER;
+
+    // Make sure we can safely access the buffers. In double buffered mode
+    // the output buffer is not in use by the SPIS until the reply is armed.
+    if (!double_buffered && _spi.spis->SEMSTAT != 1)
+        return SPI_OP_NOT_READY;
+
+    // copy output into buffer, unless it was built there already
+    if (buffer != outputBuf)
+        memcpy(outputBuf, buffer, len);
+    return commit_reply(len, release);
+}
+
 /**
  * Single byte response shortcut
  */
@@ -155,6 +267,223 @@ spi_op_status_t SPISlaveExt::reply(int d) {
     return reply_buffer(&byte, 1, 1);
 }
 
+/**
+ * Call handler from interrupt context at the end of each transaction
+ */
+void SPISlaveExt::attach(void (*handler)(void)) {
+    spis_end_handler = handler;
+
+    NVIC_ClearPendingIRQ(SPI1_TWI1_IRQn);
+    NVIC_EnableIRQ(SPI1_TWI1_IRQn);
+    // If a transaction is already waiting, handler will be called straight away
+    _spi.spis->INTENSET = SPIS_INTENSET_END_Msk;
+}
+
+/**
+ * Enable or disable double buffered operation
+ */
+void SPISlaveExt::double_buffer(uint8_t enable) {
+    acquire_sem();
+    double_buffered = enable;
+    rxPendingLen = 0;
+    busy = 0;
+    replyWaiting = 0;
+    _spi.spis->RXDPTR = (uintptr_t) inputBuf;
+    _spi.spis->MAXRX = SPI_IOBUF_SIZE;
+    if (enable) {
+        // Buffers are swapped in the interrupt, so it must be on
+        _spi.spis->TXDPTR = (uintptr_t) idleBuf;
+        _spi.spis->MAXTX = 1;
+        _spi.spis->EVENTS_END = 0;
+        NVIC_ClearPendingIRQ(SPI1_TWI1_IRQn);
+        NVIC_EnableIRQ(SPI1_TWI1_IRQn);
+        _spi.spis->INTENSET = SPIS_INTENSET_END_Msk;
+    } else {
+        _spi.spis->TXDPTR = (uintptr_t) outputBuf;
+        outputBuf[0] = SPI_NOCMD;
+        _spi.spis->MAXTX = 1;
+        if (!spis_end_handler)
+            _spi.spis->INTENCLR = SPIS_INTENCLR_END_Msk;
+    }
+    release_sem();
+}
+
+/**
+ * Handle the end of a transaction in double buffered mode. This runs in the
+ * SPIS interrupt, holding the semaphore through the END->ACQUIRE short.
+ * Return 1 if a new command was handed to the CPU.
+ */
+uint8_t SPISlaveExt::swap_buffers(void) {
+    uint8_t accepted = 0;
+    uint8_t *rx = (uint8_t *) _spi.spis->RXDPTR;
+    uint32_t len = _spi.spis->AMOUNTRX;
+
+    // The master was shown SPI_PERIPH_BUSY for the whole transaction
+    if (len > 0 && busy)
+        stats.busy += 1;
+
+    if (len > 0 && (rx[0] != SPI_NOOP || streaming)) {
+        // A new command. If we are still busy, the master was shown BUSY
+        // and will send it again, so it is dropped.
+        if (busy) {
+            if (rx[0] != SPI_NOOP)
+                stats.dropped += 1;
+        } else {
+            rxPending = rx;
+            rxPendingLen = len;
+            rxPendingRead = _spi.spis->TXDPTR == (uintptr_t) outputBuf ?
+                _spi.spis->AMOUNTTX : 0;
+            _spi.spis->RXDPTR = (uintptr_t) (rx == inputBuf ? inputBuf2 : inputBuf);
+            _spi.spis->TXDPTR = (uintptr_t) busyBuf;
+            _spi.spis->MAXTX = 1;
+            busy = 1;
+            accepted = 1;
+        }
+    } else if (len > 0 && !busy) {
+        // The master has read the last reply
+        _spi.spis->TXDPTR = (uintptr_t) idleBuf;
+        _spi.spis->MAXTX = 1;
+    }
+    // Otherwise the master is polling for a reply that isn't ready yet
+
+    _spi.spis->EVENTS_END = 0;
+    if (!arming)
+        release_sem();
+    return accepted;
+}
+
+/**
+ * Handle the end of a transaction, called from the SPIS interrupt
+ */
+void SPISlaveExt::end_irq(void) {
+    if (!_spi.spis->EVENTS_END || !(_spi.spis->INTENSET & SPIS_INTENSET_END_Msk))
+        return;
+    // Whatever the master clocked out, any reply that was waiting is gone
+    replyWaiting = 0;
+
+#if PYB_RADIO_LATENCY_HISTOGRAM
+    uint16_t end_time = LatencyHistogram::now(LATENCY_CC_IRQ);
+#endif
+
+    uint32_t status = _spi.spis->STATUS;
+    stats.transactions += 1;
+    if (status & SPIS_STATUS_OVERFLOW_Msk)
+        stats.overflows += 1;
+    if (status & SPIS_STATUS_OVERREAD_Msk)
+        stats.overreads += 1;
+    // Write one to clear
+    _spi.spis->STATUS = status;
+
+    TRACE(TRACE_SPIS_END, ((uint8_t *) _spi.spis->RXDPTR)[0], (uint16_t) _spi.spis->AMOUNTRX);
+
+    uint8_t accepted = 1;
+    if (double_buffered) {
+        accepted = swap_buffers();
+    } else {
+        // Mask until the transaction has been read, the event stays set till then
+        _spi.spis->INTENCLR = SPIS_INTENCLR_END_Msk;
+    }
+#if PYB_RADIO_LATENCY_HISTOGRAM
+    if (accepted)
+        cmdStart = end_time;
+#else
+    (void) accepted;
+#endif
+    if (spis_end_handler)
+        spis_end_handler();
+}
+
+#if PYB_RADIO_LATENCY_HISTOGRAM
+/**
+ * TIMER1 count when the current command's transaction ended
+ */
+uint16_t SPISlaveExt::command_start(void) {
+    return cmdStart;
+}
+#endif
+
+/**
+ * Enable or disable handing polls to the CPU
+ */
+void SPISlaveExt::stream(uint8_t enable) {
+    streaming = enable;
+}
+
+/**
+ * Take back the reply in place, if no transaction has read it
+ */
+spi_op_status_t SPISlaveExt::reclaim_reply(void) {
+    if (busy || !replyWaiting)
+        return SPI_OP_NOT_READY;
+
+    if (double_buffered) {
+        // As in commit_reply, keep the semaphore once we have it
+        arming = 1;
+        acquire_sem();
+        // A transaction that ended while we waited has taken the reply
+        if (busy || !replyWaiting) {
+            release_sem();
+            arming = 0;
+            return SPI_OP_NOT_READY;
+        }
+        return SPI_OP_SUCCESS;
+    }
+
+    if (_spi.spis->EVENTS_END)
+        return SPI_OP_NOT_READY;
+    acquire_sem();
+    // A transaction that ended while we waited keeps the semaphore until
+    // the CPU has handled it
+    if (_spi.spis->EVENTS_END)
+        return SPI_OP_NOT_READY;
+    return SPI_OP_SUCCESS;
+}
+
+/**
+ * Bytes of the last reply read along with the waiting command. In single
+ * buffered mode the SPIS still holds the count, as the CPU holds the
+ * semaphore until the reply is committed.
+ */
+uint32_t SPISlaveExt::reply_read(void) {
+    if (double_buffered)
+        return rxPendingRead;
+    return _spi.spis->AMOUNTTX;
+}
+
+/**
+ * Return 1 if a reply is waiting to be read by the master
+ */
+uint8_t SPISlaveExt::reply_waiting(void) {
+    return replyWaiting;
+}
+
+/**
+ * Return 1 if no command is waiting for, or being handled by, the CPU
+ */
+uint8_t SPISlaveExt::idle(void) {
+    if (busy)
+        return 0;
+    return double_buffered || !_spi.spis->EVENTS_END;
+}
+
+/**
+ * Copy out the counters
+ */
+void SPISlaveExt::get_stats(spi_stats_t *out) {
+    __disable_irq();
+    memcpy(out, (const void *) &stats, sizeof(spi_stats_t));
+    __enable_irq();
+}
+
+/**
+ * Zero the counters
+ */
+void SPISlaveExt::clear_stats(void) {
+    __disable_irq();
+    memset((void *) &stats, 0, sizeof(spi_stats_t));
+    __enable_irq();
+}
+
 /**
  * Return the semaphore state
  */
@@ -169,11 +498,30 @@ spi_op_status_t SPISlaveExt::release(void) {
     // Check we actually hold the semaphore
     if (_spi.spis->SEMSTAT != 1)
         return SPI_OP_OTHER_FAIL;
+    // In double buffered mode, the semaphore is only ours while we put a
+    // reply in place. Otherwise the interrupt is about to deal with it.
+    if (double_buffered) {
+        if (!arming)
+            return SPI_OP_NOT_READY;
+        arming = 0;
+    }
     // Release and succeed :)
     release_sem();
     return SPI_OP_SUCCESS;
 }
 
+/**
+ * Release a semaphore left held with no command waiting
+ */
+spi_op_status_t SPISlaveExt::force_release(void) {
+    if (receive() != 0)
+        return SPI_OP_NOT_READY;
+    spi_op_status_t status = release();
+    if (status == SPI_OP_SUCCESS)
+        stats.forced_releases += 1;
+    return status;
+}
+
 /**
  * do the actual reading and writing
  */
@@ -228,5 +576,3 @@ spi_op_status_t SPISlaveExt::release(void) {
     //_spi.spis->EVENTS_ACQUIRED = 0;
     //_spi.spis->TASKS_RELEASE = 1;
 //}
-
-
@@ -27,6 +27,11 @@ DEALINGS IN THE SOFTWARE.
 #include "NCSSPybRadio.h"
 #include "SPIRadio.h"
 #include "SPISlaveExt.h"
+#include "RadioQueue.h"
+#include "RadioFilter.h"
+#include "RadioLink.h"
+#include "LatencyHistogram.h"
+#include "PybRadioTrace.h"
 
 #include YOTTA_BUILD_INFO_HEADER
 #define STRINGIFY(x) #x
@@ -45,33 +50,172 @@ SPISlaveExt spi(P0_22, P0_23, P0_21, P0_24); // MOSI, MISO, SCLK, CS
 // For the test board
 //SPISlaveExt spi(P0_13, P0_12, P0_9, P0_8); // MOSI, MISO, SCLK, CS
 
-// Allocate space for a message buffer
-uint8_t radio_buffer_len;
-uint8_t radio_buffer[SPI_IOBUF_SIZE];
-uint8_t io_buffer[SPI_IOBUF_SIZE];
 
-void onRadioMsg(MicroBitEvent e) {
-    ManagedString s = module.radio.datagram.recv();
+// Queue of received radio messages waiting for the pyboard
+static radio_msg_t rx_slots[PYB_RADIO_RX_QUEUE_DEPTH];
+RadioQueue rx_queue(rx_slots, PYB_RADIO_RX_QUEUE_DEPTH);
 
-    // Save the data to the radio buffer
-    // Note: we sholdn't have concurrency issues here
-    // as this should only run at the end of the main event
-    // loop.
-    memcpy(radio_buffer, s.toCharArray(), s.length()+1);
-    radio_buffer_len = s.length();
+// Queue of messages from the pyboard waiting to be sent
+static radio_msg_t tx_slots[PYB_RADIO_TX_QUEUE_DEPTH];
+RadioQueue tx_queue(tx_slots, PYB_RADIO_TX_QUEUE_DEPTH);
+tx_status_t tx_status;
+// Messages longer than a slot, copied out of tx_queue to be sent
+static uint8_t tx_buffer[PYB_RADIO_LINK_MAX_MESSAGE];
+
+/**
+ * Put a link layer frame on the air
+ */
+static int radio_transmit(uint8_t *frame, int length) {
+    return module.radio.datagram.send(frame, length);
+}
+
+// Framing and fragmentation of messages
+RadioLink radio_link(radio_transmit);
+
+// Subscriptions that received messages must match to be queued
+RadioFilter rx_filter;
+
+#if PYB_RADIO_LATENCY_HISTOGRAM
+// How long each command takes to handle
+LatencyHistogram latency;
+#endif
+
+/**
+ * Drive the data ready line: high while a reply is waiting to be read, or
+ * while messages are queued and the pyboard is not already busy with a
+ * command. While streaming there is always a frame waiting, so the line only
+ * says whether messages are queued. Called from both the SPIS interrupt and
+ * the fibers.
+ */
+void update_data_ready(void) {
+    __disable_irq();
+    int ready = spi_streaming() ? rx_queue.depth() > 0 :
+        spi.reply_waiting() || (spi.idle() && rx_queue.depth() > 0);
+    module.data_ready.setDigitalValue(ready);
+    __enable_irq();
+}
+
+/**
+ * Queue a received message for the pyboard, if it passes the filter or the
+ * module is streaming. slot is
+ * the claimed slot already holding the message, or NULL if the message is
+ * elsewhere and has to be copied in across as many slots as it needs. info
+ * is what the radio recorded about the frame the message came in.
+ */
+static void queue_received(const uint8_t *msg, uint8_t len, radio_msg_t *slot,
+        const radio_rx_info_t *info) {
+    // Leave the slot unclaimed if the pyboard isn't interested
+    if (!spi_streaming() && !rx_filter.accept(msg, len)) {
+        TRACE(TRACE_RADIO_FILTERED, len, 0);
+        return;
+    }
+    if (slot == NULL) {
+        slot = rx_queue.claim(len);
+        if (slot)
+            rx_queue.fill(msg, len);
+    }
+    if (slot) {
+        slot->rssi = info->rssi;
+        slot->time = info->time;
+        slot->pipe = info->pipe;
+        slot->flags = 0;
+        rx_queue.commit(len);
+    } else
+        rx_queue.drop();
+    TRACE(TRACE_RADIO_RX, len, rx_queue.depth());
+}
+
+/**
+ * Handle a frame taken off the radio
+ */
+static void onRadioMsg(FrameBuffer *packet) {
+    // Other frames may have arrived since this one, so look up its own
+    // signal strength, time and address rather than asking the radio
+    radio_rx_info_t info;
+    module.radio_rx_info(packet, &info);
+    int len = packet->length - (MICROBIT_RADIO_HEADER_SIZE - 1);
+    if (packet->protocol != MICROBIT_RADIO_PROTOCOL_DATAGRAM || len < 0)
+        return;
+    if (len > RADIO_QUEUE_SLOT_SIZE)
+        len = RADIO_QUEUE_SLOT_SIZE;
+    // Copy straight into the queue, so that nothing is allocated per
+    // message. If the queue is full the message is still handled, and is
+    // dropped and counted.
+    uint8_t discard[RADIO_QUEUE_SLOT_SIZE];
+    radio_msg_t *slot = rx_queue.claim();
+    uint8_t *frame = slot ? slot->data : discard;
+    memcpy(frame, packet->payload, len);
+    // A sniffer wants every frame as it was sent
+    if (spi_streaming()) {
+        queue_received(frame, (uint8_t) len, slot, &info);
+        spi_stream_refresh();
+        update_data_ready();
+        return;
+    }
+    // Strip the link header, and hold on to fragments until the whole
+    // message has arrived
+    const uint8_t *msg;
+    len = radio_link.input(frame, (uint8_t) len, &msg,
+            (uint32_t) (system_timer_current_time_us() / 1000));
+    // Have the transmit fiber acknowledge reliable frames, repeats included
+    if (radio_link.acks_waiting())
+        MicroBitEvent(PYB_RADIO_ID_SPI, PYB_RADIO_SPI_EVT_TX);
+    if (len < 0) {
+        TRACE(TRACE_LINK_FRAGMENT, frame[0], 0);
+        return;
+    }
+    // A batch frame holds several messages, each queued separately
+    do {
+        queue_received(msg, (uint8_t) len, msg == frame ? slot : NULL, &info);
+    } while ((len = radio_link.next_message(&msg)) >= 0);
+    update_data_ready();
 
     // Let the message get handled in the main loop.
     return;
 }
 
-int main()
-{
-    uint8_t pin_state = 0;
+/**
+ * Takes frames off the radio from the idle fiber. The radio driver's
+ * datagram layer only keeps their payloads, so this runs ahead of the
+ * driver's own idle tick, which finds nothing left to do.
+ */
+class RadioReceiver : public MicroBitComponent {
+    public:
+        virtual void idleTick() {
+            FrameBuffer *packet;
+            while ((packet = module.radio.recv()) != NULL) {
+                onRadioMsg(packet);
+                delete packet;
+            }
+        }
+};
+
+static RadioReceiver radio_receiver;
+
+/**
+ * SPIS END interrupt: wake the SPI fiber if a command arrived
+ */
+void onSpiEnd(void) {
+    update_data_ready();
+    if (spi.receive())
+        MicroBitEvent(PYB_RADIO_ID_SPI, PYB_RADIO_SPI_EVT_END);
+}
 
+/**
+ * Bring up the module, radio and SPI slave
+ */
+void setup(void)
+{
     // Initialise the module and radio
     module.init();
-    module.messageBus.listen(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, onRadioMsg);
+#if PYB_RADIO_LATENCY_HISTOGRAM
+    LatencyHistogram::start_timer();
+#endif
+    // The radio adds its idle tick when it is enabled, after this one
+    fiber_add_idle_component(&radio_receiver);
     module.radio.enable();
+    module.radio_restore_config();
+    radio_link.set_node_id((uint16_t) microbit_serial_number());
 
     //led.period_us(100);
 
@@ -80,26 +224,196 @@ int main()
     // Prime with a default response
     spi.reply(0x00);
 
-    int r = 0;
-    while (true) {
-        // Check whether we've received a message on SPI
-        r = spi.receive();
-        // Sometimes the SPI lock is not released. Force release here if it is still
-        // held by the CPU but there is no waiting message
-        if (r == 0 && spi.sem_state() == 1)
-          spi.release();
-        // If we have, handle it
-        if (r) {
-          spi_op_status_t success = spi.read_buffer(io_buffer, sizeof(io_buffer), 0);
-            if (success != SPI_OP_SUCCESS)
-                continue;
-            spi_radio_cmds_t cmd = (spi_radio_cmds_t) io_buffer[0];
-            spi_cmd_switch(cmd, io_buffer, r);
-            //led.pulsewidth_us(1* (pin_state ^= 1));
-            module.led_io.setAnalogValue(5 * (pin_state ^= 1));
+    // Wake up as soon as a command arrives rather than waiting to be polled
+    spi.attach(onSpiEnd);
+#if PYB_RADIO_SPI_DOUBLE_BUFFER
+    spi.double_buffer(1);
+#endif
+    update_data_ready();
+}
+
+/**
+ * Whether a queued message is short enough to share a frame with another
+ */
+static int batchable(const radio_msg_t *msg) {
+    return !(msg->flags & RADIO_MSG_RELIABLE) && msg->length > 0 &&
+        msg->length + 2 < LINK_BATCH_DATA;
+}
+
+// Wakes the transmit fiber when the coalescing window of a waiting batch
+// closes. fiber_sleep only wakes on a system tick, which is longer than the
+// window.
+static Timeout coalesce_timer;
+
+static void onCoalesceTimeout(void) {
+    MicroBitEvent(PYB_RADIO_ID_SPI, PYB_RADIO_SPI_EVT_TX);
+}
+
+/**
+ * Pack the short messages at the front of the transmit queue into one frame,
+ * once no more can join it or the oldest has waited out the coalescing
+ * window. Return 1 if they were sent, or 0 if they are still waiting, in
+ * which case the transmit fiber is woken again when the window closes.
+ */
+static int send_coalesced(const radio_msg_t *msg, uint32_t now) {
+    uint8_t count = 0, length = 0;
+    const radio_msg_t *m = msg;
+    while (m != NULL && batchable(m) && length + 1 + m->length <= LINK_BATCH_DATA) {
+        tx_buffer[length] = m->length;
+        memcpy(tx_buffer + length + 1, m->data, m->length);
+        length += m->length + 1;
+        count += 1;
+        m = tx_queue.next(m);
+    }
+    // A message that can't join stops the batch, as messages go out in order
+    int full = m != NULL || length + 2 > LINK_BATCH_DATA;
+    uint32_t waited = (uint32_t) system_timer_current_time_us() - msg->time;
+    if (!full && waited < radio_link.coalesce_window()) {
+        coalesce_timer.attach_us(onCoalesceTimeout, radio_link.coalesce_window() - waited);
+        return 0;
+    }
+
+    int r = count > 1 ? radio_link.send_batch(tx_buffer, length) :
+        radio_link.send(msg->data, msg->length, now);
+    for (uint8_t i = 0; i < count; i += 1) {
+        if (r == MICROBIT_OK)
+            tx_status.sent += 1;
+        else
+            tx_status.failed += 1;
+        TRACE(TRACE_RADIO_TX, tx_queue.front()->length, tx_queue.depth() - 1);
+        tx_queue.pop();
+        tx_status.completed += 1;
+    }
+    return 1;
+}
+
+/**
+ * Send waiting acknowledgements, relays and overdue resends, then the message at the
+ * front of the transmit queue if there is one. A reliable message waits at
+ * the front while the window is full, and short messages while coalescing,
+ * so that messages go out in order.
+ * Return 1 if anything was sent.
+ */
+int service_tx(void)
+{
+    uint32_t now = (uint32_t) (system_timer_current_time_us() / 1000);
+    int handled = radio_link.poll(now) > 0;
+    const radio_msg_t *msg = tx_queue.front();
+    if (msg == NULL)
+        return handled;
+    // Flooded messages are relayed one to a frame
+    if (radio_link.coalesce_enabled() && !radio_link.relay_enabled() && batchable(msg))
+        return send_coalesced(msg, now) || handled;
+    int r;
+    if (msg->flags & RADIO_MSG_RELIABLE) {
+        if (radio_link.window_free() == 0)
+            return handled;
+        // The message is numbered by its place in the queue, as in the
+        // reply to SPI_SEND_CMD
+        r = radio_link.send_reliable(msg->data[0] | msg->data[1] << 8, msg->data+2,
+                msg->length-2, tx_status.completed, now);
+    } else {
+        const uint8_t *data = msg->data;
+        if (msg->length > RADIO_QUEUE_SLOT_SIZE) {
+            tx_queue.read(msg, tx_buffer);
+            data = tx_buffer;
         }
+        r = radio_link.send(data, msg->length, now);
+    }
+    if (r == MICROBIT_OK)
+        tx_status.sent += 1;
+    else
+        tx_status.failed += 1;
+    TRACE(TRACE_RADIO_TX, msg->length, tx_queue.depth() - 1);
+    tx_queue.pop();
+    tx_status.completed += 1;
+    return 1;
+}
+
+/**
+ * Handle a command from the pyboard, if one is waiting.
+ * Return 1 if a command was handled.
+ */
+int service_spi(void)
+{
+    static uint8_t pin_state = 0;
+
+    // Check whether we've received a message on SPI
+    int r = spi.receive();
+    // Sometimes the SPI lock is not released. Force release here if it is still
+    // held by the CPU but there is no waiting message
+    if (r == 0 && spi.sem_state() == 1)
+      spi.force_release();
+    // If we have, handle it in place in the SPIS buffers
+    if (r) {
+        spi_view_t in = spi.rx_view();
+        if (in.length == 0)
+            return 0;
+        spi_radio_cmds_t cmd = (spi_radio_cmds_t) in.data[0];
+        TRACE(TRACE_CMD_START, cmd, (uint16_t) in.length);
+        if (spi_streaming())
+            spi_stream(in.data, in.length, spi.tx_view().data);
+        else
+            spi_cmd_switch(cmd, in.data, in.length, spi.tx_view().data);
+        TRACE(TRACE_CMD_END, cmd, spi.tx_view().data[0]);
+#if PYB_RADIO_LATENCY_HISTOGRAM
+        // The reply has been put in place and the semaphore released
+        latency.record(cmd, LatencyHistogram::now(LATENCY_CC_THREAD) - spi.command_start());
+#endif
+        update_data_ready();
+        // Hand anything the command queued to the transmit fiber
+        if (tx_queue.depth() > 0)
+            MicroBitEvent(PYB_RADIO_ID_SPI, PYB_RADIO_SPI_EVT_TX);
+        //led.pulsewidth_us(1* (pin_state ^= 1));
+        module.led_io.setAnalogValue(5 * (pin_state ^= 1));
+        return 1;
+    }
+    return 0;
+}
+
+// The host simulation drives setup and service_spi itself
+#ifndef PYB_RADIO_SIM
+/**
+ * Handle commands as soon as the SPIS interrupt says one has arrived
+ */
+void spi_fiber(void)
+{
+    while (true) {
+        // Handle everything that is waiting before going back to sleep
+        while (service_spi());
+        fiber_wait_for_event(PYB_RADIO_ID_SPI, PYB_RADIO_SPI_EVT_END);
+    }
+}
+
+/**
+ * Send queued messages in the background, so that commands are answered
+ * without waiting for the radio. Woken when messages are queued, when
+ * acknowledgements are due and when a coalescing window closes.
+ */
+void tx_fiber(void)
+{
+    while (true) {
+        while (service_tx());
+        fiber_wait_for_event(PYB_RADIO_ID_SPI, PYB_RADIO_SPI_EVT_TX);
+    }
+}
+
+int main()
+{
+    setup();
+    create_fiber(spi_fiber);
+    create_fiber(tx_fiber);
+
+    while (true) {
+        // Commands are handled by spi_fiber and sends by tx_fiber. Polling
+        // here catches work that arrived between a fiber checking and
+        // sleeping, releases a stuck semaphore, and resends reliable
+        // messages whose acknowledgement is overdue.
+        service_spi();
+        service_tx();
 
         // Run any waiting events (i.e. a message has arrived?)
+        TRACE(TRACE_SCHEDULE, 0, 0);
         schedule();
         fiber_sleep(1);
     }
@@ -108,3 +422,4 @@ int main()
     // Use if we don't use main.
     release_fiber();
 }
+#endif
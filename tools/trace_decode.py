@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""
+Decode a radio module event trace into a timeline.
+
+The trace is read from the module with Radio.trace_dump() in
+py/quokka_radio.py, which needs firmware built with PYB_RADIO_TRACE, and
+saved to a file:
+
+    open('trace.bin', 'wb').write(r.trace_dump())
+
+Then on the host:
+
+    python3 tools/trace_decode.py trace.bin
+
+Each line gives the time since the first record, the time since the
+previous record and the decoded event. The record layout and event codes
+follow inc/PybRadioTrace.h.
+"""
+
+import argparse
+import ast
+import os
+import struct
+import sys
+
+RECORD = struct.Struct('<IBBH')
+
+EVENTS = {
+    0x01: 'SPIS_END',
+    0x02: 'SEM_ACQUIRE',
+    0x03: 'SEM_RELEASE',
+    0x04: 'RADIO_RX',
+    0x05: 'SCHEDULE',
+    0x06: 'CMD_START',
+    0x07: 'CMD_END',
+    0x08: 'RADIO_FILTERED',
+    0x09: 'RADIO_TX',
+    0x0a: 'LINK_FRAGMENT',
+}
+
+SEMSTAT = {0: 'free', 1: 'cpu', 2: 'spis', 3: 'cpu_pending'}
+
+DRIVER = os.path.join(os.path.dirname(__file__), '..', 'py', 'quokka_radio.py')
+
+
+def load_names(path, start, end):
+    """
+    Evaluate the constant assignments in the driver between the comments
+    start and end, without importing it, and map value to name.
+    """
+    with open(path) as f:
+        source = f.read()
+    tree = ast.parse(source)
+    lines = source.splitlines()
+    first = next(i for i, line in enumerate(lines) if line.startswith(start)) + 1
+    last = next(i for i, line in enumerate(lines) if line.startswith(end)) + 1
+
+    values, names = {}, {}
+    for node in tree.body:
+        if not (isinstance(node, ast.Assign) and len(node.targets) == 1 and
+                isinstance(node.targets[0], ast.Name)):
+            continue
+        try:
+            value = eval(compile(ast.Expression(node.value), path, 'eval'), {}, values)
+        except Exception:
+            continue
+        name = node.targets[0].id
+        values[name] = value
+        if first <= node.lineno <= last and isinstance(value, int):
+            names.setdefault(value, name)
+    return names
+
+
+def describe(event, arg, data, commands, responses):
+    def command(op):
+        return commands.get(op, '0x%02x' % op)
+
+    if event == 0x01:
+        return 'len=%d first=%s' % (data, command(arg))
+    if event == 0x02:
+        return 'semstat=%s' % SEMSTAT.get(arg, arg)
+    if event == 0x04:
+        return 'len=%d queued=%d' % (arg, data)
+    if event == 0x06:
+        return '%s len=%d' % (command(arg), data)
+    if event == 0x07:
+        return '%s -> %s' % (command(arg), responses.get(data, '0x%02x' % data))
+    if event == 0x08:
+        return 'len=%d' % arg
+    if event == 0x09:
+        return 'len=%d waiting=%d' % (arg, data)
+    if event == 0x0a:
+        return 'type=0x%02x' % arg
+    return ''
+
+
+def decode(data, commands, responses, out):
+    previous = start = None
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        time, event, arg, extra = RECORD.unpack_from(data, offset)
+        if start is None:
+            start = previous = time
+        # Times are a wrapping 32 bit microsecond count
+        since_start = (time - start) & 0xffffffff
+        delta = (time - previous) & 0xffffffff
+        previous = time
+        out.write('%12d us  +%8d  %-12s %s\n' % (
+            since_start, delta, EVENTS.get(event, '0x%02x' % event),
+            describe(event, arg, extra, commands, responses)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('trace', help='file written from Radio.trace_dump()')
+    parser.add_argument('--driver', default=DRIVER,
+                        help='quokka_radio.py to take command names from')
+    args = parser.parse_args()
+
+    with open(args.trace, 'rb') as f:
+        data = f.read()
+    if len(data) % RECORD.size:
+        sys.stderr.write('warning: trailing %d bytes ignored\n' % (len(data) % RECORD.size))
+
+    commands = load_names(args.driver, '# Cmds from master', '# Responses')
+    responses = load_names(args.driver, '# Responses', '# Size of the SPI buffers')
+    decode(data, commands, responses, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()